@@ -82,12 +82,36 @@ typedef enum {
   OUTPUT_TSV
 } output_format_t;
 
+/* Position output instead of line text */
+typedef enum {
+  INDEX_NONE = 0,
+  INDEX_OFFSETS,             /* Varint byte offset delta and length per line */
+  INDEX_LINES,               /* Varint line number delta per line */
+  INDEX_BITMAP,              /* One bit per input line */
+  INDEX_ZERO_COPY            /* Selected byte ranges copied by the kernel, -Z */
+} index_mode_t;
+
+/* Compression of stdout */
+typedef enum {
+  COMPRESS_NONE = 0,
+  COMPRESS_GZIP,
+  COMPRESS_ZSTD
+} compress_method_t;
+
 /* Bloom filter type enum */
 typedef enum {
   BLOOM_REGULAR = 0,
-  BLOOM_SCALING
+  BLOOM_SCALING,
+  BLOOM_AUTO                 /* Regular, scaling for files over 10MB */
 } bloom_type_t;
 
+/* Thread placement mode */
+typedef enum {
+  AFFINITY_AUTO = 0,
+  AFFINITY_NONE,
+  AFFINITY_LIST
+} affinity_mode_t;
+
 typedef struct {
   uid_t starting_uid;
   uid_t uid;
@@ -114,17 +138,37 @@ typedef struct {
   int show_duplicates;       /* Show duplicate lines instead of unique */
   int count_duplicates;      /* Count duplicate occurrences */
   output_format_t output_format; /* Output format */
+  index_mode_t index_mode;   /* Write positions of selected lines instead */
+  char *unique_out;          /* File for unique lines with --unique-out */
+  char *dup_out;             /* File for repeated lines with --dup-out */
+  char *count_out;           /* File for exact counts with --count-out */
+  int split_output;          /* Lines go to the --unique-out/--dup-out files */
+  int zero_copy;             /* Copy selected lines from the input file with -Z */
+  compress_method_t compress; /* Compress stdout with --compress */
+  int latency_ms;            /* Longest a selected line may wait with --latency-ms */
+  int perf_counters;         /* Count hardware events with --perf-counters */
+  int validate;              /* Check filter verdicts against an exact set */
+  int stats_interval;        /* Seconds between --stats-interval records, 0 for off */
+  char *stats_out;           /* Destination of the stats records, stderr when NULL */
+  char *trace_file;          /* Chrome trace event output of --trace, NULL for off */
+  int populate;              /* Prefault large allocations on every usable cpu */
+  int huge_pages;            /* Map large allocations on reserved huge pages */
   bloom_type_t bloom_type;   /* Bloom filter type */
   char *save_bloom_file;     /* File to save bloom filter to */
   char *load_bloom_file;     /* File to load bloom filter from */
   int adaptive_sizing;       /* Use adaptive bloom filter sizing */
+  affinity_mode_t affinity_mode; /* How to pin pipeline threads to CPUs */
+  char *affinity_list;       /* CPU list for AFFINITY_LIST */
+  int deterministic;         /* Make parallel output identical to serial */
+  int top_k;                 /* Report the K most frequent lines, 0 for off */
   
   /* Statistics */
   uint64_t total_lines;      /* Total lines processed */
   uint64_t unique_lines;     /* Unique lines found */
   uint64_t duplicate_lines;  /* Duplicate lines found */
+  uint64_t total_bytes;      /* Input bytes processed */
   double processing_time;    /* Time taken for processing */
-  size_t memory_used;        /* Memory used by bloom filter */
+  size_t memory_used;        /* Peak accounted memory of all subsystems */
 } Config_t;
 
 #endif	/* end of COMMON_H */
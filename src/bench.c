@@ -0,0 +1,1017 @@
+/*****
+ *
+ * Description: Benchmark Suite Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * Generates synthetic inputs with a known shape and times buniq on them
+ * against a sort -u baseline. The generated lines are a pure function
+ * of their distinct index and the seed, so the same options always
+ * produce the same bytes and runs can be compared across builds.
+ *
+ * For make check and make check-perf it can also check every output
+ * against the serial one and compare the timings with a baseline file
+ * written by an earlier run.
+ *
+ ****/
+
+#include "bench.h"
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <getopt.h>
+
+PRIVATE const char *profile_names[BENCH_PROFILES] = { "password", "hash", "log" };
+PRIVATE const char *engine_names[BENCH_ENGINES] = { "regular", "scaling", "deterministic" };
+
+/* Check results go to stdout, or stderr when stdout carries JSON */
+PRIVATE FILE *notes = NULL;
+
+/*
+ * Output modes -V runs serially and with -R, @name stands for a file and
+ * # for a -t K whose summary holds every distinct line. A smaller K
+ * gives estimates that depend on how lines were split among hashers.
+ */
+PRIVATE const char *const output_modes[][BENCH_MODE_ARGS + 1] = {
+  { "-c", NULL },
+  { "-c", "-D", NULL },
+  { "-t", "#", NULL },
+  { "-D", NULL },
+  { "-I", "offsets", NULL },
+  { "-I", "lines", NULL },
+  { "-I", "bitmap", NULL },
+  { "-Z", NULL },
+  { "-f", "json", NULL },
+  { "-f", "csv", NULL },
+  { "-f", "tsv", NULL },
+  { "--unique-out", "@unique", "--dup-out", "@dup", "--count-out", "@count", NULL }
+};
+
+PRIVATE const char *log_daemons[] = { "sshd", "cron", "nginx", "postfix/smtpd", "kernel", "systemd" };
+PRIVATE const char *log_messages[] = {
+  "Accepted publickey for deploy",
+  "Failed password for invalid user admin",
+  "connection reset by peer",
+  "GET /api/v1/items HTTP/1.1 200",
+  "session opened for user root by (uid=0)",
+  "NOQUEUE: reject: RCPT from unknown"
+};
+
+/****
+ *
+ * Next value of a splitmix64 sequence
+ *
+ ****/
+PRIVATE uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/****
+ *
+ * Build the line of one distinct index
+ *
+ ****/
+PRIVATE size_t make_line(const bench_dataset_t *set, uint64_t index, char *buf) {
+  static const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!@#$_";
+  static const char hex[] = "0123456789abcdef";
+  uint64_t state = set->seed ^ (index * 0xd1342543de82ef95ULL);
+  uint64_t r = splitmix64(&state);
+  size_t len = 0;
+
+  switch (set->profile) {
+    case BENCH_PASSWORD: {
+      /* Shorter words are more common, like real password lists */
+      uint64_t a = r % 15, b = (r >> 8) % 15;
+      size_t n = 6 + (size_t)((a < b) ? a : b);
+      for (size_t i = 0; i < n; i++) {
+        if ((i & 7) == 0) r = splitmix64(&state);
+        buf[len++] = charset[(r >> ((i & 7) * 8)) % (sizeof(charset) - 1)];
+      }
+      break;
+    }
+    case BENCH_HASH:
+      for (int i = 0; i < 32; i++) {
+        if ((i & 15) == 0) r = splitmix64(&state);
+        buf[len++] = hex[(r >> ((i & 15) * 4)) & 15];
+      }
+      break;
+    case BENCH_LOG:
+    default: {
+      uint64_t s = splitmix64(&state);
+      len = (size_t)snprintf(buf, BENCH_MAX_LINE,
+                             "2025-08-%02d %02d:%02d:%02d.%03d web%02d %s[%u]: %s from 10.%u.%u.%u port %u",
+                             (int)(1 + r % 28), (int)((r >> 8) % 24), (int)((r >> 16) % 60),
+                             (int)((r >> 24) % 60), (int)((r >> 32) % 1000), (int)((r >> 42) % 16),
+                             log_daemons[(r >> 48) % (sizeof(log_daemons) / sizeof(log_daemons[0]))],
+                             (unsigned)(s % 32768),
+                             log_messages[(s >> 16) % (sizeof(log_messages) / sizeof(log_messages[0]))],
+                             (unsigned)((s >> 24) & 255), (unsigned)((s >> 32) & 255),
+                             (unsigned)((s >> 40) & 255), (unsigned)(1024 + (s >> 48) % 64000));
+      if (len >= BENCH_MAX_LINE) len = BENCH_MAX_LINE - 1;
+      break;
+    }
+  }
+  buf[len++] = '\n';
+
+  return len;
+}
+
+/****
+ *
+ * Write a synthetic dataset
+ *
+ * Each line is either a new distinct line or, with probability
+ * dup_ratio, a repeat of an earlier one. With a window repeats are
+ * drawn from the most recent distinct lines only, which models logs
+ * where duplicates cluster, otherwise from the whole input so far.
+ *
+ * Arguments:
+ *   set - Shape of the dataset
+ *   path - File to create
+ *   bytes - Set to the size written
+ *
+ * Returns:
+ *   TRUE on success, FAILED if the file could not be written
+ *
+ ****/
+int bench_generate(const bench_dataset_t *set, const char *path, uint64_t *bytes) {
+  FILE *out;
+  char line[BENCH_MAX_LINE + 1];
+  uint64_t state = set->seed;
+  uint64_t distinct = 0;
+  uint64_t threshold = (uint64_t)(set->dup_ratio * 18446744073709551615.0);
+
+  if ((out = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "ERR - Unable to create %s: %s\n", path, strerror(errno));
+    return FAILED;
+  }
+
+  *bytes = 0;
+  for (uint64_t i = 0; i < set->lines; i++) {
+    uint64_t index;
+    size_t len;
+
+    if (distinct > 0 && set->dup_ratio > 0 && splitmix64(&state) <= threshold) {
+      uint64_t span = (set->window > 0 && set->window < distinct) ? set->window : distinct;
+      index = distinct - 1 - splitmix64(&state) % span;
+    } else {
+      index = distinct++;
+    }
+    len = make_line(set, index, line);
+    fwrite(line, 1, len, out);
+    *bytes += len;
+  }
+
+  if (fclose(out) != 0) {
+    fprintf(stderr, "ERR - Unable to write %s: %s\n", path, strerror(errno));
+    return FAILED;
+  }
+
+  return TRUE;
+}
+
+/****
+ *
+ * Seconds on the monotonic clock
+ *
+ ****/
+PRIVATE double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/****
+ *
+ * Count the lines of a file
+ *
+ ****/
+PRIVATE uint64_t count_lines(const char *path) {
+  char buf[65536];
+  uint64_t lines = 0;
+  ssize_t n;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return 0;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    const char *p = buf;
+    const char *end = buf + n;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+      lines++;
+      p++;
+    }
+  }
+  close(fd);
+
+  return lines;
+}
+
+/****
+ *
+ * Start a command with stdin from /dev/null, stdout to out_path and
+ * stderr to err_path, or discarded when err_path is NULL
+ *
+ ****/
+PRIVATE pid_t spawn(const char *const argv[], int c_locale, const char *out_path, const char *err_path) {
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int null = open("/dev/null", O_RDWR);
+    int err = (err_path != NULL) ? open(err_path, O_WRONLY | O_CREAT | O_TRUNC, 0600) : null;
+
+    if (out < 0 || null < 0 || err < 0) _exit(127);
+    dup2(null, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    if (c_locale) setenv("LC_ALL", "C", 1);
+    /* execvp() takes char *const [] but never writes the strings */
+    execvp(argv[0], (char *const *)(uintptr_t)argv);
+    _exit(127);
+  }
+
+  return pid;
+}
+
+/****
+ *
+ * Time a command
+ *
+ * Runs the command iterations times with stdout sent to out_path and
+ * stderr discarded, keeping the fastest wall clock time. Peak resident
+ * memory comes from the rusage of each child.
+ *
+ * Arguments:
+ *   argv - Command and arguments, NULL terminated
+ *   c_locale - Run with LC_ALL=C, so sort compares bytes like buniq
+ *   out_path - File receiving the command's output
+ *   iterations - Times to run it
+ *   result - Set to the measurements
+ *
+ * Returns:
+ *   TRUE if every run exited with status 0, FAILED otherwise
+ *
+ ****/
+int bench_run(const char *const argv[], int c_locale, const char *out_path, int iterations, bench_result_t *result) {
+  memset(result, 0, sizeof(bench_result_t));
+
+  for (int i = 0; i < iterations; i++) {
+    struct rusage usage;
+    double start = now_seconds();
+    double elapsed;
+    int status;
+    pid_t pid = spawn(argv, c_locale, out_path, NULL);
+
+    if (pid < 0) {
+      fprintf(stderr, "ERR - Unable to fork: %s\n", strerror(errno));
+      result->status = FAILED;
+      return FAILED;
+    }
+
+    while (wait4(pid, &status, 0, &usage) < 0) {
+      if (errno != EINTR) {
+        result->status = FAILED;
+        return FAILED;
+      }
+    }
+    elapsed = now_seconds() - start;
+
+    if (!WIFEXITED(status)) {
+      result->status = FAILED;
+      return FAILED;
+    }
+    result->status = WEXITSTATUS(status);
+    if (result->status != 0) return FAILED;
+
+    if (i == 0 || elapsed < result->seconds) result->seconds = elapsed;
+    /* Linux and the BSDs report kilobytes */
+    if ((uint64_t)usage.ru_maxrss * 1024 > result->maxrss) result->maxrss = (uint64_t)usage.ru_maxrss * 1024;
+  }
+  result->out_lines = count_lines(out_path);
+
+  return TRUE;
+}
+
+/****
+ *
+ * Name of a profile
+ *
+ ****/
+const char *bench_profile_name(bench_profile_t profile) {
+  return profile_names[profile];
+}
+
+/****
+ *
+ * Name of an engine
+ *
+ ****/
+const char *bench_engine_name(bench_engine_t engine) {
+  return engine_names[engine];
+}
+
+/****
+ *
+ * Look up a name in a table, FAILED if it is not there
+ *
+ ****/
+PRIVATE int find_name(const char *name, const char **names, int count) {
+  for (int i = 0; i < count; i++) {
+    if (strcmp(name, names[i]) == 0) return i;
+  }
+  return FAILED;
+}
+
+/****
+ *
+ * Parse a comma separated list of names into a selection mask
+ *
+ ****/
+PRIVATE int parse_names(const char *arg, const char **names, int count, int *mask) {
+  char copy[256];
+  char *save = NULL;
+
+  snprintf(copy, sizeof(copy), "%s", arg);
+  *mask = 0;
+  for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    int i = find_name(tok, names, count);
+    if (i == FAILED) return FAILED;
+    *mask |= 1 << i;
+  }
+
+  return (*mask != 0) ? TRUE : FAILED;
+}
+
+/****
+ *
+ * Parse a comma separated list of thread counts
+ *
+ ****/
+PRIVATE int parse_threads(const char *arg, int *threads) {
+  char copy[256];
+  char *save = NULL;
+  int n = 0;
+
+  snprintf(copy, sizeof(copy), "%s", arg);
+  for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    int t = atoi(tok);
+    if (t < 1 || t > 1024 || n == BENCH_MAX_THREADS) return FAILED;
+    threads[n++] = t;
+  }
+
+  return (n > 0) ? n : FAILED;
+}
+
+/****
+ *
+ * Compare two files byte for byte
+ *
+ ****/
+PRIVATE int files_equal(const char *a, const char *b) {
+  char buf_a[65536], buf_b[65536];
+  int fd_a = open(a, O_RDONLY);
+  int fd_b = open(b, O_RDONLY);
+  int equal = (fd_a >= 0 && fd_b >= 0);
+
+  /* Regular files return whole reads until their end */
+  while (equal) {
+    ssize_t n = read(fd_a, buf_a, sizeof(buf_a));
+    ssize_t m = read(fd_b, buf_b, sizeof(buf_b));
+    if (n != m || n < 0 || memcmp(buf_a, buf_b, (size_t)n) != 0) {
+      equal = FALSE;
+    } else if (n == 0) {
+      break;
+    }
+  }
+  if (fd_a >= 0) close(fd_a);
+  if (fd_b >= 0) close(fd_b);
+
+  return equal;
+}
+
+/****
+ *
+ * Run a command once more with -d 1 and name the filter buniq reports
+ *
+ * Returns:
+ *   "regular" or "scaling", NULL if the run said neither
+ *
+ ****/
+PRIVATE const char *filter_used(const char *const argv[], const char *dir) {
+  const char *debug_argv[12];
+  char err_path[PATH_MAX], line[256];
+  const char *used = NULL;
+  int n = 0;
+  int status;
+  pid_t pid;
+  FILE *err;
+
+  debug_argv[n++] = argv[0];
+  debug_argv[n++] = "-d";
+  debug_argv[n++] = "1";
+  for (int i = 1; argv[i] != NULL && n < 11; i++) {
+    debug_argv[n++] = argv[i];
+  }
+  debug_argv[n] = NULL;
+
+  snprintf(err_path, sizeof(err_path), "%s/buniq-bench-debug-%d.txt", dir, (int)getpid());
+  if ((pid = spawn(debug_argv, FALSE, "/dev/null", err_path)) < 0) return NULL;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) break;
+  }
+  if ((err = fopen(err_path, "r")) != NULL) {
+    while (used == NULL && fgets(line, sizeof(line), err) != NULL) {
+      if (strstr(line, "Using regular bloom filter") != NULL) used = "regular";
+      if (strstr(line, "Using scaling bloom filter") != NULL) used = "scaling";
+    }
+    fclose(err);
+  }
+  unlink(err_path);
+
+  return used;
+}
+
+/****
+ *
+ * Check one output against the serial one
+ *
+ * Deterministic runs must match it byte for byte. Other parallel runs
+ * see the lines in another order, so their false positives differ; they
+ * must still print every line at most once and nothing that is not in
+ * the input, which sort -u of the output alone and together with the
+ * exact distinct lines tells.
+ *
+ ****/
+PRIVATE int verify_output(const char *out_path, const char *ref_path, const char *truth_path,
+                          uint64_t truth, int exact, const char *dir) {
+  char scratch[PATH_MAX];
+  const char *once_argv[] = { "sort", "-u", out_path, NULL };
+  const char *union_argv[] = { "sort", "-u", out_path, truth_path, NULL };
+  bench_result_t once, all;
+  uint64_t out_lines = count_lines(out_path);
+
+  if (exact) {
+    if (files_equal(out_path, ref_path)) return TRUE;
+    fprintf(notes, "MISMATCH  output differs from the serial run\n");
+    return FAILED;
+  }
+
+  snprintf(scratch, sizeof(scratch), "%s/buniq-bench-verify-%d.txt", dir, (int)getpid());
+  bench_run(once_argv, TRUE, scratch, 1, &once);
+  bench_run(union_argv, TRUE, scratch, 1, &all);
+  unlink(scratch);
+  if (once.status != 0 || all.status != 0) {
+    fprintf(notes, "MISMATCH  unable to sort the output\n");
+    return FAILED;
+  }
+  if (once.out_lines != out_lines) {
+    fprintf(notes, "MISMATCH  %lu lines printed more than once\n", (unsigned long)(out_lines - once.out_lines));
+    return FAILED;
+  }
+  if (all.out_lines != truth) {
+    fprintf(notes, "MISMATCH  %lu lines printed that are not in the input\n", (unsigned long)(all.out_lines - truth));
+    return FAILED;
+  }
+
+  return TRUE;
+}
+
+/****
+ *
+ * Path of one file a mode check writes, tag 'a' for the serial run and
+ * 'b' for the -R one
+ *
+ ****/
+PRIVATE void mode_path(char *path, size_t size, const char *dir, const char *name, char tag) {
+  snprintf(path, size, "%s/buniq-bench-%s-%c-%d.txt", dir, name, tag, (int)getpid());
+}
+
+/****
+ *
+ * Run buniq in one output mode, serially when threads is 1
+ *
+ * Arguments starting with @ are replaced by the path of a file of that
+ * name, # by top_k.
+ *
+ ****/
+PRIVATE int run_mode(const char *binary, const char *const mode[], int threads, const char *data_path,
+                     const char *top_k, const char *dir, char tag) {
+  char paths[BENCH_MODE_ARGS][PATH_MAX];
+  char out_path[PATH_MAX], err_path[PATH_MAX], jarg[16];
+  const char *run_argv[BENCH_MODE_ARGS + 6];
+  int n = 0;
+  int status;
+  pid_t pid;
+
+  run_argv[n++] = binary;
+  if (threads > 1) {
+    snprintf(jarg, sizeof(jarg), "%d", threads);
+    run_argv[n++] = "-j";
+    run_argv[n++] = jarg;
+    run_argv[n++] = "-R";
+  }
+  for (int i = 0; mode[i] != NULL; i++) {
+    if (mode[i][0] == '@') {
+      mode_path(paths[i], sizeof(paths[i]), dir, mode[i] + 1, tag);
+      run_argv[n++] = paths[i];
+    } else if (strcmp(mode[i], "#") == 0) {
+      run_argv[n++] = top_k;
+    } else {
+      run_argv[n++] = mode[i];
+    }
+  }
+  run_argv[n++] = data_path;
+  run_argv[n] = NULL;
+
+  mode_path(out_path, sizeof(out_path), dir, "stdout", tag);
+  mode_path(err_path, sizeof(err_path), dir, "stderr", tag);
+  if ((pid = spawn(run_argv, FALSE, out_path, err_path)) < 0) return FAILED;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return FAILED;
+  }
+
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? TRUE : FAILED;
+}
+
+/****
+ *
+ * Names of the files a mode writes: stdout, stderr and its @ files
+ *
+ ****/
+PRIVATE int mode_files(const char *const mode[], const char *names[]) {
+  int n = 0;
+
+  names[n++] = "stdout";
+  names[n++] = "stderr";
+  for (int i = 0; mode[i] != NULL; i++) {
+    if (mode[i][0] == '@') names[n++] = mode[i] + 1;
+  }
+
+  return n;
+}
+
+/****
+ *
+ * Compare what the serial and -R runs of a mode wrote, removing the
+ * -R files
+ *
+ ****/
+PRIVATE int mode_outputs_equal(const char *const mode[], const char *dir) {
+  const char *names[BENCH_MODE_ARGS + 2];
+  int n = mode_files(mode, names);
+  int equal = TRUE;
+
+  for (int i = 0; i < n; i++) {
+    char a[PATH_MAX], b[PATH_MAX];
+    mode_path(a, sizeof(a), dir, names[i], 'a');
+    mode_path(b, sizeof(b), dir, names[i], 'b');
+    if (!files_equal(a, b)) equal = FALSE;
+    unlink(b);
+  }
+
+  return equal;
+}
+
+/****
+ *
+ * Check that -R prints what a serial run does in every output mode
+ *
+ * Covers counts, top-k, duplicates, index output, zero copy, every
+ * text format and the split files, comparing stdout, stderr and each
+ * file byte for byte at every thread count above one.
+ *
+ ****/
+PRIVATE int verify_modes(const char *binary, const bench_dataset_t *set, const char *data_path,
+                         const int *threads, int num_threads, const char *dir) {
+  /* Enough counters for every line, so the summary is exact */
+  uint64_t k = set->lines / BENCH_TOP_COUNTERS_PER_K + 1;
+  char top_k[24];
+  int rc = TRUE;
+  int checked = 0;
+
+  snprintf(top_k, sizeof(top_k), "%lu", (unsigned long)k);
+
+  for (size_t m = 0; m < sizeof(output_modes) / sizeof(output_modes[0]); m++) {
+    const char *const *mode = output_modes[m];
+    const char *names[BENCH_MODE_ARGS + 2];
+    char name[128];
+    size_t len = 0;
+
+    /* Past buniq's -t limit the summary would be an estimate */
+    if (strcmp(mode[0], "-t") == 0 && k > BENCH_TOP_MAX) continue;
+    name[0] = '\0';
+    for (int i = 0; mode[i] != NULL; i++) {
+      if (mode[i][0] != '@' && len < sizeof(name)) {
+        len += (size_t)snprintf(name + len, sizeof(name) - len, "%s%s", (len > 0) ? " " : "",
+                                (strcmp(mode[i], "#") == 0) ? top_k : mode[i]);
+      }
+    }
+
+    if (run_mode(binary, mode, 1, data_path, top_k, dir, 'a') != TRUE) {
+      fprintf(notes, "MISMATCH  serial %s run failed\n", name);
+      rc = FAILED;
+    } else {
+      for (int t = 0; t < num_threads; t++) {
+        if (threads[t] == 1) continue;
+        if (run_mode(binary, mode, threads[t], data_path, top_k, dir, 'b') != TRUE ||
+            mode_outputs_equal(mode, dir) != TRUE) {
+          fprintf(notes, "MISMATCH  %s with -j %d -R differs from the serial run\n", name, threads[t]);
+          rc = FAILED;
+        }
+        checked++;
+      }
+    }
+
+    /* Drop the serial run's files */
+    for (int i = 0; i < mode_files(mode, names); i++) {
+      char path[PATH_MAX];
+      mode_path(path, sizeof(path), dir, names[i], 'a');
+      unlink(path);
+    }
+  }
+  if (rc == TRUE && checked > 0) {
+    fprintf(notes, "%-9s %d output mode runs with -R match the serial run\n", bench_profile_name(set->profile), checked);
+  }
+
+  return rc;
+}
+
+/****
+ *
+ * Read a baseline file
+ *
+ * The first line names the workload, a baseline of another one is
+ * refused since its numbers do not compare.
+ *
+ * Returns:
+ *   Entries read, 0 when there is no file, FAILED for another workload
+ *
+ ****/
+PRIVATE int load_baselines(const char *path, const bench_dataset_t *set, bench_baseline_t *base) {
+  char line[256], expect[256];
+  int n = 0;
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL) return 0;
+  snprintf(expect, sizeof(expect), "# buniq-bench baseline: lines %lu ratio %.3f window %lu seed %lu\n",
+           (unsigned long)set->lines, set->dup_ratio, (unsigned long)set->window, (unsigned long)set->seed);
+  if (fgets(line, sizeof(line), file) == NULL || strcmp(line, expect) != 0) {
+    fclose(file);
+    return FAILED;
+  }
+  while (n < BENCH_MAX_BASELINES && fgets(line, sizeof(line), file) != NULL) {
+    unsigned long rss;
+    if (sscanf(line, "%15s %15s %d %lf %lu", base[n].profile, base[n].engine, &base[n].threads,
+               &base[n].lines_per_sec, &rss) == 5) {
+      base[n++].maxrss = rss;
+    }
+  }
+  fclose(file);
+
+  return n;
+}
+
+/****
+ *
+ * Write a baseline file
+ *
+ ****/
+PRIVATE int save_baselines(const char *path, const bench_dataset_t *set, const bench_baseline_t *base, int n) {
+  FILE *file = fopen(path, "w");
+
+  if (file == NULL) {
+    fprintf(stderr, "ERR - Unable to write baseline %s: %s\n", path, strerror(errno));
+    return FAILED;
+  }
+  fprintf(file, "# buniq-bench baseline: lines %lu ratio %.3f window %lu seed %lu\n",
+          (unsigned long)set->lines, set->dup_ratio, (unsigned long)set->window, (unsigned long)set->seed);
+  for (int i = 0; i < n; i++) {
+    fprintf(file, "%s %s %d %.0f %lu\n", base[i].profile, base[i].engine, base[i].threads,
+            base[i].lines_per_sec, (unsigned long)base[i].maxrss);
+  }
+  fclose(file);
+
+  return TRUE;
+}
+
+/****
+ *
+ * Compare a run with its baseline, FAILED on a regression
+ *
+ ****/
+PRIVATE int check_baseline(const bench_baseline_t *base, int n, const bench_baseline_t *run, double tolerance) {
+  for (int i = 0; i < n; i++) {
+    int rc = TRUE;
+
+    if (strcmp(base[i].profile, run->profile) != 0 || strcmp(base[i].engine, run->engine) != 0 ||
+        base[i].threads != run->threads) {
+      continue;
+    }
+    if (run->lines_per_sec < base[i].lines_per_sec * (1.0 - tolerance / 100.0)) {
+      fprintf(notes, "REGRESSED %.0f lines/s is %.0f%% below the baseline %.0f\n", run->lines_per_sec,
+             100.0 * (1.0 - run->lines_per_sec / base[i].lines_per_sec), base[i].lines_per_sec);
+      rc = FAILED;
+    }
+    if (run->maxrss > base[i].maxrss + BENCH_RSS_SLACK &&
+        (double)run->maxrss > (double)base[i].maxrss * (1.0 + tolerance / 100.0)) {
+      fprintf(notes, "REGRESSED maxrss %.1fMB is %.0f%% above the baseline %.1fMB\n", (double)run->maxrss / (1024.0 * 1024.0),
+             100.0 * ((double)run->maxrss / (double)base[i].maxrss - 1.0), (double)base[i].maxrss / (1024.0 * 1024.0));
+      rc = FAILED;
+    }
+    return rc;
+  }
+  fprintf(notes, "NEW       no baseline for this run\n");
+
+  return TRUE;
+}
+
+/****
+ *
+ * Print the usage text
+ *
+ ****/
+PRIVATE void print_usage(void) {
+  fprintf(stderr, "syntax: buniq-bench [options]\n\n");
+  fprintf(stderr, " -b (path)      buniq binary [default: ./buniq]\n");
+  fprintf(stderr, " -n (lines)     lines per dataset [default: 1000000]\n");
+  fprintf(stderr, " -P (list)      profiles: password,hash,log [default: all]\n");
+  fprintf(stderr, " -r (ratio)     chance a line repeats an earlier one [default: 0.5]\n");
+  fprintf(stderr, " -w (lines)     repeat only the last N distinct lines, 0 for any [default: 0]\n");
+  fprintf(stderr, " -E (list)      engines: regular,scaling,deterministic [default: all]\n");
+  fprintf(stderr, " -j (list)      thread counts [default: 1,2,4]\n");
+  fprintf(stderr, " -i (N)         iterations, the fastest is reported [default: 3]\n");
+  fprintf(stderr, " -s (seed)      generator seed [default: 1]\n");
+  fprintf(stderr, " -f (type)      report format: text, json [default: text]\n");
+  fprintf(stderr, " -o (dir)       directory for datasets [default: /tmp]\n");
+  fprintf(stderr, " -g (file)      only write the first profile's dataset to file\n");
+  fprintf(stderr, " -k             keep generated datasets\n");
+  fprintf(stderr, " -V             check every output against the serial run\n");
+  fprintf(stderr, " -c (file)      compare with a baseline written by -u\n");
+  fprintf(stderr, " -u (file)      write the results as the new baseline\n");
+  fprintf(stderr, " -T (pct)       allowed slowdown and memory growth [default: 25]\n");
+  fprintf(stderr, " -h             this info\n");
+}
+
+/****
+ *
+ * Print one result row
+ *
+ ****/
+PRIVATE void report_row(int json, int *first, const char *profile, const char *engine, int threads,
+                        uint64_t lines, uint64_t bytes, uint64_t truth, const bench_result_t *r) {
+  double lps = (r->seconds > 0) ? (double)lines / r->seconds : 0;
+  double mbps = (r->seconds > 0) ? (double)bytes / r->seconds / (1024.0 * 1024.0) : 0;
+  /* Every distinct line missing from the output was a false positive */
+  double fpr = (truth > 0) ? ((double)truth - (double)r->out_lines) / (double)truth : 0;
+
+  if (json) {
+    printf("%s    { \"profile\": \"%s\", \"engine\": \"%s\", \"threads\": %d, \"seconds\": %.4f, "
+           "\"lines_per_sec\": %.0f, \"mb_per_sec\": %.1f, \"maxrss\": %lu, \"output_lines\": %lu, "
+           "\"fpr\": %.6f, \"status\": %d }",
+           *first ? "" : ",\n", profile, engine, threads, r->seconds, lps, mbps,
+           (unsigned long)r->maxrss, (unsigned long)r->out_lines, fpr, r->status);
+    *first = FALSE;
+  } else if (r->status != 0) {
+    printf("%-9s %-13s %7d  %s\n", profile, engine, threads, "FAILED");
+  } else {
+    printf("%-9s %-13s %7d %12.0f %9.1f %9.1f %10lu %9.5f%%\n", profile, engine, threads, lps, mbps,
+           (double)r->maxrss / (1024.0 * 1024.0), (unsigned long)r->out_lines, fpr * 100);
+  }
+}
+
+/****
+ *
+ * Main function
+ *
+ ****/
+int main(int argc, char *argv[]) {
+  bench_dataset_t set;
+  const char *binary = "./buniq";
+  const char *dir = "/tmp";
+  const char *gen_only = NULL;
+  const char *check_path = NULL;
+  const char *update_path = NULL;
+  bench_baseline_t base[BENCH_MAX_BASELINES], runs[BENCH_MAX_BASELINES];
+  int num_base = 0;
+  int num_runs = 0;
+  double tolerance = BENCH_TOLERANCE;
+  int verify = FALSE;
+  int profiles = (1 << BENCH_PROFILES) - 1;
+  int engines = (1 << BENCH_ENGINES) - 1;
+  int threads[BENCH_MAX_THREADS] = { 1, 2, 4 };
+  int num_threads = 3;
+  int iterations = 3;
+  int json = FALSE;
+  int keep = FALSE;
+  int first = TRUE;
+  int rc = EXIT_SUCCESS;
+  int c;
+
+  memset(&set, 0, sizeof(set));
+  set.lines = 1000000;
+  set.dup_ratio = 0.5;
+  set.seed = 1;
+
+  while ((c = getopt(argc, argv, "b:n:P:r:w:E:j:i:s:f:o:g:kVc:u:T:h")) != -1) {
+    switch (c) {
+      case 'b': binary = optarg; break;
+      case 'n': set.lines = strtoull(optarg, NULL, 10); break;
+      case 'r': set.dup_ratio = atof(optarg); break;
+      case 'w': set.window = strtoull(optarg, NULL, 10); break;
+      case 'i': iterations = atoi(optarg); break;
+      case 's': set.seed = strtoull(optarg, NULL, 10); break;
+      case 'o': dir = optarg; break;
+      case 'g': gen_only = optarg; break;
+      case 'k': keep = TRUE; break;
+      case 'V': verify = TRUE; break;
+      case 'c': check_path = optarg; break;
+      case 'u': update_path = optarg; break;
+      case 'T': tolerance = atof(optarg); break;
+      case 'P':
+        if (parse_names(optarg, profile_names, BENCH_PROFILES, &profiles) == FAILED) {
+          fprintf(stderr, "ERR - Unknown profile in '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'E':
+        if (parse_names(optarg, engine_names, BENCH_ENGINES, &engines) == FAILED) {
+          fprintf(stderr, "ERR - Unknown engine in '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'j':
+        if ((num_threads = parse_threads(optarg, threads)) == FAILED) {
+          fprintf(stderr, "ERR - Invalid thread list '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'f':
+        if (strcmp(optarg, "json") == 0) {
+          json = TRUE;
+        } else if (strcmp(optarg, "text") != 0) {
+          fprintf(stderr, "ERR - Unknown format '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (set.lines == 0 || set.dup_ratio < 0 || set.dup_ratio > 1 || iterations < 1) {
+    fprintf(stderr, "ERR - Lines and iterations must be positive and the ratio between 0 and 1\n");
+    return EXIT_FAILURE;
+  }
+  if (tolerance <= 0 || tolerance >= 100) {
+    fprintf(stderr, "ERR - Tolerance must be between 0 and 100 percent\n");
+    return EXIT_FAILURE;
+  }
+  notes = json ? stderr : stdout;
+  if (check_path != NULL && (num_base = load_baselines(check_path, &set, base)) == FAILED) {
+    fprintf(stderr, "ERR - %s is the baseline of another workload, replace it with -u\n", check_path);
+    return EXIT_FAILURE;
+  }
+  /* Timings only compare on the machine that recorded them, never guess one */
+  if (check_path != NULL && num_base == 0 && update_path == NULL) {
+    fprintf(stderr, "ERR - No baseline in %s, record one on this machine with -u (make perf-baseline)\n", check_path);
+    return EXIT_FAILURE;
+  }
+
+  if (gen_only != NULL) {
+    uint64_t bytes;
+    for (set.profile = 0; !(profiles & (1 << set.profile)); set.profile++);
+    return (bench_generate(&set, gen_only, &bytes) == TRUE) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  if (json) {
+    printf("{\n  \"lines\": %lu,\n  \"dup_ratio\": %.3f,\n  \"window\": %lu,\n  \"seed\": %lu,\n  \"results\": [\n",
+           (unsigned long)set.lines, set.dup_ratio, (unsigned long)set.window, (unsigned long)set.seed);
+  } else {
+    printf("%lu lines per dataset, repeat ratio %.2f, window %lu, best of %d\n\n",
+           (unsigned long)set.lines, set.dup_ratio, (unsigned long)set.window, iterations);
+    printf("%-9s %-13s %7s %12s %9s %9s %10s %10s\n",
+           "profile", "engine", "threads", "lines/s", "MB/s", "maxrssMB", "uniques", "fpr");
+  }
+
+  for (set.profile = 0; set.profile < BENCH_PROFILES; set.profile++) {
+    char data_path[PATH_MAX], out_path[PATH_MAX], truth_path[PATH_MAX], ref_path[PATH_MAX];
+    const char *sort_argv[] = { "sort", "-u", data_path, NULL };
+    const char *ref_argv[] = { binary, "-b", "regular", data_path, NULL };
+    bench_result_t result;
+    uint64_t bytes, truth;
+
+    if (!(profiles & (1 << set.profile))) continue;
+
+    snprintf(data_path, sizeof(data_path), "%s/buniq-bench-%s-%d.txt", dir, bench_profile_name(set.profile), (int)getpid());
+    snprintf(out_path, sizeof(out_path), "%s/buniq-bench-out-%d.txt", dir, (int)getpid());
+    snprintf(truth_path, sizeof(truth_path), "%s/buniq-bench-truth-%d.txt", dir, (int)getpid());
+    snprintf(ref_path, sizeof(ref_path), "%s/buniq-bench-ref-%d.txt", dir, (int)getpid());
+    if (bench_generate(&set, data_path, &bytes) != TRUE) return EXIT_FAILURE;
+
+    /* sort -u is both the speed baseline and the exact distinct count */
+    bench_run(sort_argv, TRUE, truth_path, iterations, &result);
+    truth = result.out_lines;
+    report_row(json, &first, bench_profile_name(set.profile), "sort -u", 1, set.lines, bytes, truth, &result);
+    if (result.status != 0) rc = EXIT_FAILURE;
+
+    /* The serial run every other output is checked against */
+    if (verify && (bench_run(ref_argv, FALSE, ref_path, 1, &result) != TRUE ||
+                   verify_output(ref_path, ref_path, truth_path, truth, FALSE, dir) != TRUE)) {
+      fprintf(notes, "MISMATCH  serial %s run\n", bench_profile_name(set.profile));
+      rc = EXIT_FAILURE;
+    }
+    if (verify && verify_modes(binary, &set, data_path, threads, num_threads, dir) != TRUE) {
+      rc = EXIT_FAILURE;
+    }
+
+    for (int e = 0; e < BENCH_ENGINES; e++) {
+      if (!(engines & (1 << e))) continue;
+      for (int t = 0; t < num_threads; t++) {
+        char jarg[16];
+        const char *run_argv[8];
+        const char *want = (e == BENCH_SCALING) ? "scaling" : "regular";
+        const char *used;
+        int n = 0;
+
+        if (e == BENCH_DETERMINISTIC && threads[t] == 1) continue;
+        snprintf(jarg, sizeof(jarg), "%d", threads[t]);
+        run_argv[n++] = binary;
+        if (threads[t] > 1) {
+          run_argv[n++] = "-j";
+          run_argv[n++] = jarg;
+        }
+        if (e == BENCH_DETERMINISTIC) {
+          run_argv[n++] = "-R";
+        }
+        /* Forced, since by default files over 10MB get the scaling filter */
+        run_argv[n++] = "-b";
+        run_argv[n++] = want;
+        run_argv[n++] = data_path;
+        run_argv[n] = NULL;
+
+        bench_run(run_argv, FALSE, out_path, iterations, &result);
+        report_row(json, &first, bench_profile_name(set.profile), bench_engine_name(e), threads[t],
+                   set.lines, bytes, truth, &result);
+        if (result.status != 0) {
+          rc = EXIT_FAILURE;
+          continue;
+        }
+        if ((used = filter_used(run_argv, dir)) == NULL || strcmp(used, want) != 0) {
+          fprintf(notes, "MISMATCH  %s run used the %s filter\n", bench_engine_name(e), (used != NULL) ? used : "unknown");
+          rc = EXIT_FAILURE;
+        }
+
+        /* -R and the regular serial run print exactly what the reference does */
+        if (verify && verify_output(out_path, ref_path, truth_path, truth,
+                                    e == BENCH_DETERMINISTIC || (e == BENCH_REGULAR && threads[t] == 1), dir) != TRUE) {
+          rc = EXIT_FAILURE;
+        }
+        if (num_runs < BENCH_MAX_BASELINES) {
+          bench_baseline_t *run = &runs[num_runs++];
+          snprintf(run->profile, sizeof(run->profile), "%s", bench_profile_name(set.profile));
+          snprintf(run->engine, sizeof(run->engine), "%s", bench_engine_name(e));
+          run->threads = threads[t];
+          run->lines_per_sec = (result.seconds > 0) ? (double)set.lines / result.seconds : 0;
+          run->maxrss = result.maxrss;
+          if (num_base > 0 && check_baseline(base, num_base, run, tolerance) != TRUE) rc = EXIT_FAILURE;
+        }
+      }
+    }
+
+    unlink(out_path);
+    unlink(truth_path);
+    unlink(ref_path);
+    if (!keep) unlink(data_path);
+  }
+
+  if (json) printf("\n  ]\n}\n");
+
+  if (update_path != NULL && save_baselines(update_path, &set, runs, num_runs) != TRUE) return EXIT_FAILURE;
+  if (check_path != NULL || verify) {
+    fprintf(notes, "\n%s\n", (rc == EXIT_SUCCESS) ? "PASS" : "FAIL");
+  }
+
+  return rc;
+}
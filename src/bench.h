@@ -0,0 +1,104 @@
+/*****
+ *
+ * Description: Benchmark Suite Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef BENCH_DOT_H
+#define BENCH_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* Longest generated line, well under MAX_LINE_LEN so nothing is truncated */
+#define BENCH_MAX_LINE 256
+
+/* Most thread counts and engines one run can compare */
+#define BENCH_MAX_THREADS 16
+#define BENCH_MAX_ENGINES 4
+
+/* Shapes of synthetic input */
+typedef enum {
+  BENCH_PASSWORD = 0,        /* Short mixed-case words, 6 to 20 bytes */
+  BENCH_HASH,                /* 32 hex digits, fixed length */
+  BENCH_LOG,                 /* Syslog style lines, 70 to 130 bytes */
+  BENCH_PROFILES
+} bench_profile_t;
+
+/* Filter setups a run can be timed with */
+typedef enum {
+  BENCH_REGULAR = 0,         /* -b regular, at any input size */
+  BENCH_SCALING,             /* -b scaling */
+  BENCH_DETERMINISTIC,       /* -R -b regular, parallel runs only */
+  BENCH_ENGINES
+} bench_engine_t;
+
+/* Dataset to generate */
+typedef struct {
+  bench_profile_t profile;
+  uint64_t lines;            /* Lines written */
+  double dup_ratio;          /* Chance a line repeats an earlier one */
+  uint64_t window;           /* Repeats come from the last window distinct lines, 0 for all */
+  uint64_t seed;
+} bench_dataset_t;
+
+/* Outcome of one timed command */
+typedef struct {
+  double seconds;            /* Wall clock time of the best iteration */
+  uint64_t maxrss;           /* Largest resident set of any iteration, bytes */
+  uint64_t out_lines;        /* Lines written to stdout */
+  int status;                /* Exit status, FAILED if it did not exit normally */
+} bench_result_t;
+
+/* Most runs one baseline file holds */
+#define BENCH_MAX_BASELINES 64
+
+/* Default allowed slowdown or memory growth against a baseline, percent */
+#define BENCH_TOLERANCE 25.0
+
+/* Memory growth below this is never a regression, maxrss is noisy at small sizes */
+#define BENCH_RSS_SLACK (1024 * 1024)
+
+/* Most arguments one output mode checked by -V passes */
+#define BENCH_MODE_ARGS 6
+
+/* buniq's -t limit and the Space-Saving counters it keeps per K */
+#define BENCH_TOP_MAX 1000000
+#define BENCH_TOP_COUNTERS_PER_K 4
+
+/* Stored measurement of one run, the reference of a later check */
+typedef struct {
+  char profile[16];
+  char engine[16];
+  int threads;
+  double lines_per_sec;
+  uint64_t maxrss;
+} bench_baseline_t;
+
+/* Function prototypes */
+int bench_generate(const bench_dataset_t *set, const char *path, uint64_t *bytes);
+int bench_run(const char *const argv[], int c_locale, const char *out_path, int iterations, bench_result_t *result);
+const char *bench_profile_name(bench_profile_t profile);
+const char *bench_engine_name(bench_engine_t engine);
+
+#endif /* BENCH_DOT_H */
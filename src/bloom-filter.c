@@ -32,6 +32,15 @@
  *
  ****/
 
+/* Insert locks, picked by element hash so repeats of a line share one */
+#define BLOOM_INSERT_LOCKS 64
+
+/* Each insert lock on its own cache line */
+PRIVATE struct {
+  char held;
+  char pad[63];
+} insert_locks[BLOOM_INSERT_LOCKS];
+
 /****
  *
  * global variables
@@ -154,7 +163,7 @@ inline static int bloom_check_add(struct bloom * bloom,
   }
 
   int hits = 0;
-  MurmurHash3_x64_128(buffer, len, 0x9747b28c, &hash );
+  MurmurHash3_x64_128(buffer, len, BLOOM_HASH_SEED, &hash );
   register uint64_t a = hash[0];
   register uint64_t b = hash[1];
   register uint64_t x;
@@ -200,16 +209,40 @@ inline int bloom_check_add_64(struct bloom * bloom, const void * buffer, int len
 {
   uint64_t hash[2];
 
+  MurmurHash3_x64_128(buffer, len, BLOOM_HASH_SEED, &hash );
+  return bloom_check_add_64_hashed( bloom, hash[0], hash[1] );
+}
+
+/****
+ *
+ * Check and add an element whose hash has already been computed
+ *
+ * All bits of an element fall inside the partition selected by the top
+ * bits of the first hash word. Partitions are whole 64-bit words, so
+ * threads working on different partitions never touch the same memory
+ * and the result only depends on the order of earlier elements in the
+ * same partition.
+ *
+ * Arguments:
+ *   bloom - Pointer to initialized bloom filter structure with 64-bit buffer
+ *   a - First 64 bits of the element's MurmurHash3_x64_128 (BLOOM_HASH_SEED)
+ *   b - Second 64 bits of the element's hash
+ *
+ * Returns:
+ *   1 if element was already present (or collision occurred)
+ *   0 if element was not present and has been added
+ *
+ ****/
+inline int bloom_check_add_64_hashed(struct bloom * bloom, uint64_t a, uint64_t b )
+{
   int hits = 0;
-  MurmurHash3_x64_128(buffer, len, 0x9747b28c, &hash );
-  register uint64_t a = hash[0];
-  register uint64_t b = hash[1];
+  uint64_t base = (uint64_t)BLOOM_PARTITION( a ) * bloom->partition_bits;
   register uint64_t x;
   register uint64_t i;
 
   /* First pass: check all bits without modifying */
   for (i = 0; i < bloom->hashes; i++) {
-    x = (a + i*b) % bloom->bits;
+    x = base + (a + i*b) % bloom->partition_bits;
     size_t qword = x >> 6;
     uint64_t mask = 1ULL << (x % 64);
     if (bloom->bf64[qword] & mask) {
@@ -223,7 +256,7 @@ inline int bloom_check_add_64(struct bloom * bloom, const void * buffer, int len
 
   /* Second pass: set all bits since element is new */
   for (i = 0; i < bloom->hashes; i++) {
-    x = (a + i*b) % bloom->bits;
+    x = base + (a + i*b) % bloom->partition_bits;
     size_t qword = x >> 6;
     uint64_t mask = 1ULL << (x % 64);
     bloom->bf64[qword] |= mask;
@@ -255,15 +288,16 @@ inline int bloom_check_add_64_optimized(struct bloom * bloom, const void * buffe
   uint64_t hash[2];
 
   int hits = 0;
-  MurmurHash3_x64_128(buffer, len, 0x9747b28c, &hash );
+  MurmurHash3_x64_128(buffer, len, BLOOM_HASH_SEED, &hash );
   register uint64_t a = hash[0];
   register uint64_t b = hash[1];
+  uint64_t base = (uint64_t)BLOOM_PARTITION( a ) * bloom->partition_bits;
   register uint64_t x;
   register uint64_t i;
 
   /* Check all bits first */
   for (i = 0; i < bloom->hashes; i++) {
-    x = (a + i*b) % bloom->bits;
+    x = base + (a + i*b) % bloom->partition_bits;
     size_t qword = x >> 6;
     uint64_t c = bloom->bf64[qword];
     uint64_t mask = 1ULL << (x % 64);
@@ -278,7 +312,7 @@ inline int bloom_check_add_64_optimized(struct bloom * bloom, const void * buffe
 
   /* Not all bits set, so set them all and return 0 (new element) */
   for (i = 0; i < bloom->hashes; i++) {
-    x = (a + i*b) % bloom->bits;
+    x = base + (a + i*b) % bloom->partition_bits;
     size_t qword = x >> 6;
     bloom->bf64[qword] |= (1ULL << (x % 64));
   }
@@ -286,6 +320,95 @@ inline int bloom_check_add_64_optimized(struct bloom * bloom, const void * buffe
   return 0;                  // new element added
 }
 
+/****
+ *
+ * Thread-safe check and add for 64-bit bloom filter
+ *
+ * Same contract as bloom_check_add_64 but safe to call from several
+ * threads sharing one filter. The check pass uses plain relaxed loads so
+ * duplicates never write to shared cache lines; new elements are added
+ * under a striped insert lock, so two threads adding the same element at
+ * once cannot both report it new. Results match the serial version.
+ *
+ * Arguments:
+ *   bloom - Pointer to initialized bloom filter structure with 64-bit buffer
+ *   buffer - Pointer to data buffer containing the element to check/add
+ *   len - Length of the data buffer in bytes
+ *
+ * Returns:
+ *   1 if element was already present (or collision occurred)
+ *   0 if element was not present and has been added
+ *
+ ****/
+int bloom_check_add_64_atomic(struct bloom * bloom, const void * buffer, int len )
+{
+  uint64_t hash[2];
+
+  MurmurHash3_x64_128(buffer, len, BLOOM_HASH_SEED, &hash );
+  return bloom_check_add_64_atomic_hashed( bloom, hash[0], hash[1] );
+}
+
+/****
+ *
+ * Thread-safe check and add of an element whose hash has already been computed
+ *
+ * Arguments:
+ *   bloom - Pointer to initialized bloom filter structure with 64-bit buffer
+ *   a - First 64 bits of the element's MurmurHash3_x64_128 (BLOOM_HASH_SEED)
+ *   b - Second 64 bits of the element's hash
+ *
+ * Returns:
+ *   1 if element was already present (or collision occurred)
+ *   0 if element was not present and has been added
+ *
+ ****/
+int bloom_check_add_64_atomic_hashed(struct bloom * bloom, uint64_t a, uint64_t b )
+{
+  int hits = 0;
+  uint64_t base = (uint64_t)BLOOM_PARTITION( a ) * bloom->partition_bits;
+  register uint64_t x;
+  register int i;
+
+  /* First pass: check all bits without modifying */
+  for (i = 0; i < bloom->hashes; i++) {
+    x = base + (a + i*b) % bloom->partition_bits;
+    uint64_t mask = 1ULL << (x % 64);
+    if (__atomic_load_n(&bloom->bf64[x >> 6], __ATOMIC_RELAXED) & mask) {
+      hits++;
+    }
+  }
+
+  if (hits EQ bloom->hashes) {
+    return 1;                // 1 == element already in (or collision)
+  }
+
+  /****
+   *
+   * Second pass: set all bits under the element's insert lock. Two
+   * threads adding the same element at once would otherwise each find
+   * some bit still clear and both report it new. Repeats never get
+   * here, so only new elements pay for the lock.
+   *
+   ****/
+  char *lock = &insert_locks[a % BLOOM_INSERT_LOCKS].held;
+  while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+      /* spin, the holder only sets a few bits */
+    }
+  }
+  hits = 0;
+  for (i = 0; i < bloom->hashes; i++) {
+    x = base + (a + i*b) % bloom->partition_bits;
+    uint64_t mask = 1ULL << (x % 64);
+    if (__atomic_fetch_or(&bloom->bf64[x >> 6], mask, __ATOMIC_RELAXED) & mask) {
+      hits++;
+    }
+  }
+  __atomic_clear(lock, __ATOMIC_RELEASE);
+
+  return (hits EQ bloom->hashes) ? 1 : 0;
+}
+
 /** ***************************************************************************
  * Initialize the bloom filter for use.
  *
@@ -317,6 +440,8 @@ inline int bloom_check_add_64_optimized(struct bloom * bloom, const void * buffe
 int bloom_init(struct bloom * bloom, size_t entries, double error)
 {
   bloom->ready = 0;
+  bloom->bf = NULL;
+  bloom->bf64 = NULL;
 
   /* Validate input parameters */
   if (entries < 1000 || entries > SIZE_MAX / 64) {
@@ -345,10 +470,11 @@ int bloom_init(struct bloom * bloom, size_t entries, double error)
 
   bloom->hashes = (int)ceil(0.693147180559945 * bloom->bpe);  // ln(2)
 
-  bloom->bf = (unsigned char *)XMALLOC( bloom->bytes );
+  bloom->bf = (unsigned char *)mem_large_alloc( bloom->bytes );
   if (bloom->bf EQ NULL) {
     return 1;
   }
+  mem_account( MEM_FILTER, (int64_t)bloom->bytes );
 
   bloom->ready = 1;
   return 0;
@@ -376,6 +502,8 @@ int bloom_init(struct bloom * bloom, size_t entries, double error)
 int bloom_init_64(struct bloom * bloom, size_t entries, double error)
 {
   bloom->ready = 0;
+  bloom->bf = NULL;
+  bloom->bf64 = NULL;
 
   /* Validate input parameters */
   if (entries < 1000 || entries > SIZE_MAX / 64) {
@@ -402,12 +530,18 @@ int bloom_init_64(struct bloom * bloom, size_t entries, double error)
     bloom->qwords = bloom->bits / 64;
   }
 
+  /* Round up to BLOOM_PARTITIONS partitions of whole 64-bit words */
+  bloom->qwords = ((bloom->qwords + BLOOM_PARTITIONS - 1) / BLOOM_PARTITIONS) * BLOOM_PARTITIONS;
+  bloom->partition_bits = (bloom->qwords / BLOOM_PARTITIONS) * 64;
+  bloom->bits = bloom->qwords * 64;
+
   bloom->hashes = (int)ceil(0.693147180559945 * bloom->bpe);  // ln(2)
 
   bloom->bytes = bloom->qwords * sizeof(uint64_t);  // Set bytes field for 64-bit version
 
-  if ( ( bloom->bf64 = (uint64_t *)XMALLOC( bloom->bytes ) ) EQ NULL )
+  if ( ( bloom->bf64 = (uint64_t *)mem_large_alloc( bloom->bytes ) ) EQ NULL )
     return 1;
+  mem_account( MEM_FILTER, (int64_t)bloom->bytes );
 
   bloom->ready = 1;
   return 0;
@@ -482,6 +616,9 @@ void bloom_print(struct bloom * bloom)
   fprintf(stderr, " ->bits per elem = %f\n", bloom->bpe);
   fprintf(stderr, " ->bytes = %ld\n", bloom->bytes);
   fprintf(stderr, " ->hash functions = %d\n", bloom->hashes);
+  if (bloom->partition_bits > 0) {
+    fprintf(stderr, " ->partitions = %d of %ld bits\n", BLOOM_PARTITIONS, bloom->partition_bits);
+  }
 }
 
 /** ***************************************************************************
@@ -499,10 +636,13 @@ void bloom_print(struct bloom * bloom)
  */
 void bloom_free(struct bloom * bloom)
 {
-  if ( bloom->bf != NULL )
-    XFREE(bloom->bf);
-  else if ( bloom->bf64 != NULL )
-    XFREE( bloom->bf64 );
+  if ( bloom->bf != NULL ) {
+    mem_large_free( bloom->bf, bloom->bytes );
+    mem_account( MEM_FILTER, -(int64_t)bloom->bytes );
+  } else if ( bloom->bf64 != NULL ) {
+    mem_large_free( bloom->bf64, bloom->bytes );
+    mem_account( MEM_FILTER, -(int64_t)bloom->bytes );
+  }
 
   bloom->ready = 0;
 }
@@ -27,6 +27,14 @@
  *
  ****/
 
+/* Seed for the MurmurHash3_x64_128 hash feeding the 64-bit filters */
+#define BLOOM_HASH_SEED 0x9747b28c
+
+/* 64-bit filters are split into independent partitions picked by the top hash bits */
+#define BLOOM_PARTITION_SHIFT 6
+#define BLOOM_PARTITIONS (1 << BLOOM_PARTITION_SHIFT)
+#define BLOOM_PARTITION(a) ((unsigned int)((a) >> (64 - BLOOM_PARTITION_SHIFT)))
+
 /****
  *
  * includes
@@ -84,6 +92,7 @@ struct bloom
   // change incompatibly at any moment. Client code MUST NOT access or rely
   // on these.
   double bpe;
+  size_t partition_bits;
   unsigned char *bf;
   uint64_t *bf64;
   int ready;
@@ -98,7 +107,10 @@ struct bloom
 int bloom_init(struct bloom * bloom, size_t entries, double error);
 int bloom_init_64(struct bloom * bloom, size_t entries, double error);
 int bloom_check_add_64(struct bloom * bloom, const void * buffer, int len );
+int bloom_check_add_64_hashed(struct bloom * bloom, uint64_t a, uint64_t b );
 int bloom_check_add_64_optimized(struct bloom * bloom, const void * buffer, int len );
+int bloom_check_add_64_atomic(struct bloom * bloom, const void * buffer, int len );
+int bloom_check_add_64_atomic_hashed(struct bloom * bloom, uint64_t a, uint64_t b );
 void bloom_print(struct bloom * bloom);
 void bloom_free(struct bloom * bloom);
 int bloom_reset(struct bloom * bloom);
@@ -0,0 +1,466 @@
+/*****
+ *
+ * Description: Parallel Output Compression Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+
+/* fopencookie() needs this before any system header */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "topology.h"
+#include "main.h"
+#include "mem.h"
+
+#ifdef COMPRESS_HAVE_GZIP
+# include <zlib.h>
+#endif
+#ifdef COMPRESS_HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+extern Config_t *config;
+
+#ifdef COMPRESS_HAVE_STREAM
+
+/* Chunk ring shared by the producer, compression threads and writer */
+PRIVATE compress_chunk_t *chunks = NULL;
+PRIVATE int num_chunks = 0;
+PRIVATE pthread_t *threads = NULL;
+PRIVATE int num_threads = 0;
+PRIVATE pthread_t writer;
+PRIVATE pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+PRIVATE pthread_cond_t compressed = PTHREAD_COND_INITIALIZER;
+PRIVATE pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+PRIVATE uint64_t fill_seq = 0;       /* Chunk the producer appends to */
+PRIVATE uint64_t compress_seq = 0;   /* Next chunk to hand a compression thread */
+PRIVATE int finishing = FALSE;
+PRIVATE int failed = FALSE;
+PRIVATE compress_method_t active = COMPRESS_NONE;
+PRIVATE FILE *plain_stdout = NULL;
+
+/****
+ *
+ * Compress one chunk into a self-contained gzip member or zstd frame
+ *
+ * Concatenated members and frames are valid streams, so chunks can be
+ * compressed in any order as long as they are written in order.
+ *
+ ****/
+PRIVATE int compress_chunk(compress_chunk_t *chunk, void *state) {
+  if (state == NULL) return FAILED;
+#ifdef COMPRESS_HAVE_GZIP
+  if (active == COMPRESS_GZIP) {
+    z_stream *z = (z_stream *)state;
+    size_t bound;
+    
+    /* Reset first, a finished stream leaves the gzip wrapper out of the bound */
+    deflateReset(z);
+    bound = deflateBound(z, (uLong)chunk->in_len);
+    if (bound > chunk->out_size) {
+      if (chunk->out != NULL) XFREE(chunk->out);
+      mem_account(MEM_BUFFERS, (int64_t)(bound - chunk->out_size));
+      chunk->out_size = bound;
+      chunk->out = (char *)XMALLOC(chunk->out_size);
+    }
+    z->next_in = (Bytef *)chunk->in;
+    z->avail_in = (uInt)chunk->in_len;
+    z->next_out = (Bytef *)chunk->out;
+    z->avail_out = (uInt)chunk->out_size;
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) return FAILED;
+    chunk->out_len = chunk->out_size - z->avail_out;
+    return TRUE;
+  }
+#endif
+#ifdef COMPRESS_HAVE_ZSTD
+  if (active == COMPRESS_ZSTD) {
+    size_t bound = ZSTD_compressBound(chunk->in_len);
+    size_t n;
+    
+    if (bound > chunk->out_size) {
+      if (chunk->out != NULL) XFREE(chunk->out);
+      mem_account(MEM_BUFFERS, (int64_t)(bound - chunk->out_size));
+      chunk->out_size = bound;
+      chunk->out = (char *)XMALLOC(chunk->out_size);
+    }
+    n = ZSTD_compressCCtx((ZSTD_CCtx *)state, chunk->out, chunk->out_size,
+                          chunk->in, chunk->in_len, COMPRESS_ZSTD_LEVEL);
+    if (ZSTD_isError(n)) return FAILED;
+    chunk->out_len = n;
+    return TRUE;
+  }
+#endif
+  (void)chunk;
+  (void)state;
+  return FAILED;
+}
+
+/****
+ *
+ * Compression thread, takes queued chunks in order until finishing
+ *
+ * A thread whose compressor cannot be set up still takes its chunks,
+ * failing each one, so the writer and producer are never left waiting.
+ *
+ ****/
+PRIVATE void *compress_thread(void *arg) {
+  void *state = NULL;
+  
+  (void)arg;
+#ifdef COMPRESS_HAVE_GZIP
+  z_stream z;
+  if (active == COMPRESS_GZIP) {
+    memset(&z, 0, sizeof(z));
+    /* 16 + window bits writes a gzip header and trailer */
+    if (deflateInit2(&z, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+      state = &z;
+    }
+  }
+#endif
+#ifdef COMPRESS_HAVE_ZSTD
+  if (active == COMPRESS_ZSTD) state = ZSTD_createCCtx();
+#endif
+  if (state == NULL) {
+    fprintf(stderr, "ERR - Unable to initialize the output compressor\n");
+  }
+  
+  pthread_mutex_lock(&ring_mutex);
+  for (;;) {
+    compress_chunk_t *chunk = &chunks[compress_seq % num_chunks];
+    int ok;
+    
+    while (!(chunk->seq == compress_seq && chunk->state == CHUNK_QUEUED) && !finishing) {
+      pthread_cond_wait(&queued, &ring_mutex);
+      chunk = &chunks[compress_seq % num_chunks];
+    }
+    if (!(chunk->seq == compress_seq && chunk->state == CHUNK_QUEUED)) break;
+    chunk->state = CHUNK_BUSY;
+    compress_seq++;
+    pthread_mutex_unlock(&ring_mutex);
+    
+    ok = compress_chunk(chunk, state);
+    
+    pthread_mutex_lock(&ring_mutex);
+    if (ok != TRUE) {
+      chunk->out_len = 0;
+      failed = TRUE;
+    }
+    chunk->state = CHUNK_DONE;
+    pthread_cond_broadcast(&compressed);
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  
+#ifdef COMPRESS_HAVE_GZIP
+  if (active == COMPRESS_GZIP && state != NULL) deflateEnd(&z);
+#endif
+#ifdef COMPRESS_HAVE_ZSTD
+  if (active == COMPRESS_ZSTD) ZSTD_freeCCtx((ZSTD_CCtx *)state);
+#endif
+  
+  return NULL;
+}
+
+/****
+ *
+ * Writer thread, writes compressed chunks to stdout in order
+ *
+ ****/
+PRIVATE void *writer_thread(void *arg) {
+  uint64_t seq = 0;
+  
+  (void)arg;
+  pthread_mutex_lock(&ring_mutex);
+  for (;;) {
+    compress_chunk_t *chunk = &chunks[seq % num_chunks];
+    size_t done = 0;
+    
+    while (!(chunk->seq == seq && chunk->state == CHUNK_DONE) && !(finishing && seq == fill_seq)) {
+      pthread_cond_wait(&compressed, &ring_mutex);
+    }
+    if (!(chunk->seq == seq && chunk->state == CHUNK_DONE)) break;
+    pthread_mutex_unlock(&ring_mutex);
+    
+    USDT2(output__flush, STDOUT_FILENO, chunk->out_len);
+    while (done < chunk->out_len) {
+      ssize_t n = write(STDOUT_FILENO, chunk->out + done, chunk->out_len - done);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      done += (size_t)n;
+    }
+    
+    pthread_mutex_lock(&ring_mutex);
+    if (done < chunk->out_len) {
+      if (!failed) fprintf(stderr, "ERR - Unable to write compressed output: %s\n", strerror(errno));
+      failed = TRUE;
+    }
+    chunk->in_len = 0;
+    chunk->state = CHUNK_FREE;
+    seq++;
+    pthread_cond_broadcast(&freed);
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  
+  return NULL;
+}
+
+/****
+ *
+ * Hand the chunk being filled to the compression threads and wait for
+ * the next one to be free
+ *
+ ****/
+PRIVATE void submit_chunk(void) {
+  compress_chunk_t *next;
+  
+  pthread_mutex_lock(&ring_mutex);
+  chunks[fill_seq % num_chunks].state = CHUNK_QUEUED;
+  fill_seq++;
+  pthread_cond_broadcast(&queued);
+  
+  next = &chunks[fill_seq % num_chunks];
+  while (next->state != CHUNK_FREE) {
+    pthread_cond_wait(&freed, &ring_mutex);
+  }
+  next->seq = fill_seq;
+  pthread_mutex_unlock(&ring_mutex);
+}
+
+/****
+ *
+ * stdio write hook of the replacement stdout
+ *
+ ****/
+PRIVATE ssize_t cookie_write(void *cookie, const char *buf, size_t size) {
+  size_t left = size;
+  
+  (void)cookie;
+  while (left > 0) {
+    compress_chunk_t *chunk = &chunks[fill_seq % num_chunks];
+    size_t n = COMPRESS_CHUNK_SIZE - chunk->in_len;
+    
+    if (n > left) n = left;
+    memcpy(chunk->in + chunk->in_len, buf, n);
+    chunk->in_len += n;
+    buf += n;
+    left -= n;
+    if (chunk->in_len == COMPRESS_CHUNK_SIZE) submit_chunk();
+  }
+  
+  return (ssize_t)size;
+}
+
+/****
+ *
+ * Stop the first started compression threads and, if it runs, the writer
+ *
+ * Threads exit once nothing is queued and the writer once everything
+ * queued is written.
+ *
+ ****/
+PRIVATE void stop_threads(int started, int writer_started) {
+  pthread_mutex_lock(&ring_mutex);
+  finishing = TRUE;
+  pthread_cond_broadcast(&queued);
+  pthread_cond_broadcast(&compressed);
+  pthread_mutex_unlock(&ring_mutex);
+  
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (writer_started) {
+    pthread_mutex_lock(&ring_mutex);
+    pthread_cond_broadcast(&compressed);
+    pthread_mutex_unlock(&ring_mutex);
+    pthread_join(writer, NULL);
+  }
+}
+
+/****
+ *
+ * Free the chunk ring and the thread list
+ *
+ ****/
+PRIVATE void free_chunks(void) {
+  for (int i = 0; i < num_chunks; i++) {
+    XFREE(chunks[i].in);
+    if (chunks[i].out != NULL) XFREE(chunks[i].out);
+    mem_account(MEM_BUFFERS, -(int64_t)(COMPRESS_CHUNK_SIZE + chunks[i].out_size));
+  }
+  XFREE(chunks);
+  XFREE(threads);
+  chunks = NULL;
+  threads = NULL;
+}
+
+/****
+ *
+ * Queue the partly filled chunk so it is written without waiting to fill
+ *
+ * For --latency-ms. The caller holds the stdout lock, which keeps the
+ * producer out of cookie_write(), and has just flushed stdout. Each cut
+ * becomes one more gzip member or zstd frame in the stream.
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   None (void function)
+ *
+ ****/
+void compress_cut(void) {
+  if (chunks == NULL || plain_stdout == NULL) return;
+  if (chunks[fill_seq % num_chunks].in_len > 0) submit_chunk();
+}
+
+/****
+ *
+ * Compress everything later written to stdout
+ *
+ * stdout is replaced by a stream that cuts output into chunks. Worker
+ * threads compress the chunks independently, pigz style, and a writer
+ * thread writes them to the real stdout in order. Anything already
+ * buffered on stdout is flushed uncompressed first.
+ *
+ * Arguments:
+ *   method - COMPRESS_GZIP or COMPRESS_ZSTD
+ *
+ * Returns:
+ *   TRUE on success, FAILED if the method was not built in or the
+ *   threads or stream cannot be created
+ *
+ ****/
+int compress_start(compress_method_t method) {
+  cookie_io_functions_t io = { NULL, cookie_write, NULL, NULL };
+  FILE *stream;
+  int started = 0;
+  
+#ifndef COMPRESS_HAVE_GZIP
+  if (method == COMPRESS_GZIP) {
+    fprintf(stderr, "ERR - buniq was built without zlib, gzip output is not available\n");
+    return FAILED;
+  }
+#endif
+#ifndef COMPRESS_HAVE_ZSTD
+  if (method == COMPRESS_ZSTD) {
+    fprintf(stderr, "ERR - buniq was built without libzstd, zstd output is not available\n");
+    return FAILED;
+  }
+#endif
+  
+  active = method;
+  num_threads = (config->num_threads > 1) ? config->num_threads : topology_auto_threads();
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > COMPRESS_MAX_THREADS) num_threads = COMPRESS_MAX_THREADS;
+  
+  /* Enough chunks to keep every thread busy while one is written and one filled */
+  num_chunks = num_threads * 2 + 2;
+  chunks = (compress_chunk_t *)XMALLOC(num_chunks * sizeof(compress_chunk_t));
+  for (int i = 0; i < num_chunks; i++) {
+    chunks[i].in = (char *)XMALLOC(COMPRESS_CHUNK_SIZE);
+  }
+  mem_account(MEM_BUFFERS, (int64_t)num_chunks * COMPRESS_CHUNK_SIZE);
+  fill_seq = compress_seq = 0;
+  finishing = failed = FALSE;
+  
+  threads = (pthread_t *)XMALLOC(num_threads * sizeof(pthread_t));
+  while (started < num_threads && pthread_create(&threads[started], NULL, compress_thread, NULL) == 0) {
+    started++;
+  }
+  if (started < num_threads || pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+    fprintf(stderr, "ERR - Unable to start output compression threads\n");
+    stop_threads(started, FALSE);
+    free_chunks();
+    return FAILED;
+  }
+  
+  if ((stream = fopencookie(NULL, "w", io)) == NULL) {
+    fprintf(stderr, "ERR - Unable to create compressed output stream\n");
+    stop_threads(num_threads, TRUE);
+    free_chunks();
+    return FAILED;
+  }
+  setvbuf(stream, NULL, _IOFBF, COMPRESS_CHUNK_SIZE);
+  fflush(stdout);
+  plain_stdout = stdout;
+  stdout = stream;
+  
+  if (config->debug >= 1) {
+    fprintf(stderr, "DEBUG - Compressing output with %d threads\n", num_threads);
+  }
+  
+  return TRUE;
+}
+
+/****
+ *
+ * Compress and write the rest of the output, then restore stdout
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   TRUE if all output was written, FAILED otherwise
+ *
+ ****/
+int compress_finish(void) {
+  compress_chunk_t *last;
+  
+  if (chunks == NULL) return FAILED;
+  
+  if (plain_stdout != NULL) {
+    fclose(stdout);
+    stdout = plain_stdout;
+    plain_stdout = NULL;
+  }
+  
+  /* The last chunk, even when empty, so empty output is still a valid stream */
+  last = &chunks[fill_seq % num_chunks];
+  if (last->in_len > 0 || fill_seq == 0) submit_chunk();
+  
+  stop_threads(num_threads, TRUE);
+  free_chunks();
+  
+  return failed ? FAILED : TRUE;
+}
+
+#else /* COMPRESS_HAVE_STREAM */
+
+/* Without a replaceable stdout there is nothing to compress through */
+int compress_start(compress_method_t method) {
+  (void)method;
+  fprintf(stderr, "ERR - buniq was built without fopencookie(), compressed output is not available\n");
+  return FAILED;
+}
+
+void compress_cut(void) {
+}
+
+int compress_finish(void) {
+  return FAILED;
+}
+
+#endif /* COMPRESS_HAVE_STREAM */
@@ -0,0 +1,80 @@
+/*****
+ *
+ * Description: Parallel Output Compression Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+
+#ifndef COMPRESS_DOT_H
+#define COMPRESS_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+#include <pthread.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+# define COMPRESS_HAVE_GZIP 1
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+# define COMPRESS_HAVE_ZSTD 1
+#endif
+
+/* stdout is swapped for an fopencookie() stream, which only glibc allows */
+#if defined(HAVE_FOPENCOOKIE) && defined(__GLIBC__)
+# define COMPRESS_HAVE_STREAM 1
+#endif
+
+/* Output is cut into chunks of this size, each compressed on its own */
+#define COMPRESS_CHUNK_SIZE (1024 * 1024)
+
+/* Most compression threads, more only add memory */
+#define COMPRESS_MAX_THREADS 32
+
+/* Default levels, the speed the tools themselves default to */
+#define COMPRESS_GZIP_LEVEL 6
+#define COMPRESS_ZSTD_LEVEL 3
+
+typedef enum {
+  CHUNK_FREE = 0,            /* Available to the producer */
+  CHUNK_QUEUED,              /* Full, waiting for a compression thread */
+  CHUNK_BUSY,                /* Being compressed */
+  CHUNK_DONE                 /* Compressed, waiting to be written */
+} chunk_state_t;
+
+/* Piece of output, compressed into a complete gzip member or zstd frame */
+typedef struct {
+  char *in;
+  size_t in_len;
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  uint64_t seq;
+  chunk_state_t state;
+} compress_chunk_t;
+
+/* Function prototypes */
+int compress_start(compress_method_t method);
+void compress_cut(void);
+int compress_finish(void);
+
+#endif /* COMPRESS_DOT_H */
@@ -0,0 +1,271 @@
+/*****
+ *
+ * Description: Exact Line Occurrence Count Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "count.h"
+#include "main.h"
+
+
+/****
+ *
+ * Initialize an empty count table
+ *
+ * Arguments:
+ *   table - Table to initialize
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_table_init(count_table_t *table) {
+  memset(table, 0, sizeof(count_table_t));
+  mem_arena_init(&table->keys, COUNT_CHUNK_SIZE, MEM_COUNTS);
+}
+
+/****
+ *
+ * Release a count table and the key bytes it owns
+ *
+ * Arguments:
+ *   table - Table to free
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_table_free(count_table_t *table) {
+  for (int i = 0; i < BLOOM_PARTITIONS; i++) {
+    if (table->parts[i].slots != NULL) {
+      mem_account(MEM_COUNTS, -(int64_t)(table->parts[i].size * sizeof(count_entry_t)));
+      mem_large_free(table->parts[i].slots, table->parts[i].size * sizeof(count_entry_t));
+    }
+  }
+  mem_arena_free(&table->keys);
+  count_table_init(table);
+}
+
+/****
+ *
+ * Copy key bytes into the table's arena
+ *
+ ****/
+PRIVATE const char *store_key(count_table_t *table, const char *key, uint32_t len) {
+  char *copy = mem_arena_alloc(&table->keys, len);
+
+  if (len > 0) memcpy(copy, key, len);
+
+  return copy;
+}
+
+/****
+ *
+ * Find the slot holding a key, or the empty slot where it belongs
+ *
+ ****/
+PRIVATE count_entry_t *find_slot(count_map_t *map, uint64_t a, uint64_t b, const char *key, uint32_t len) {
+  size_t mask = map->size - 1;
+  size_t slot = b & mask;
+
+  while (map->slots[slot].count != 0) {
+    count_entry_t *entry = &map->slots[slot];
+    if (entry->a == a && entry->b == b && entry->len == len &&
+        memcmp(entry->key, key, len) == 0) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  return &map->slots[slot];
+}
+
+/****
+ *
+ * Make room for one more entry, doubling the map at half full
+ *
+ ****/
+PRIVATE void reserve_slot(count_map_t *map) {
+  count_entry_t *old = map->slots;
+  size_t old_size = map->size;
+
+  if (old != NULL && (map->used + 1) * 2 <= map->size) return;
+
+  map->size = (old != NULL) ? old_size * 2 : COUNT_MAP_SIZE;
+  map->slots = (count_entry_t *)mem_large_alloc(map->size * sizeof(count_entry_t));
+  mem_account(MEM_COUNTS, (int64_t)((map->size - old_size) * sizeof(count_entry_t)));
+  if (old == NULL) return;
+
+  for (size_t i = 0; i < old_size; i++) {
+    if (old[i].count != 0) {
+      size_t mask = map->size - 1;
+      size_t slot = old[i].b & mask;
+      while (map->slots[slot].count != 0) {
+        slot = (slot + 1) & mask;
+      }
+      map->slots[slot] = old[i];
+    }
+  }
+  mem_large_free(old, old_size * sizeof(count_entry_t));
+}
+
+/****
+ *
+ * Count one occurrence of a line
+ *
+ * Arguments:
+ *   table - Table to add to
+ *   line - Line without its newline, copied on first occurrence
+ *   len - Length of the line
+ *   position - Input position, only the smallest one per key is kept
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_table_add(count_table_t *table, const char *line, uint32_t len, uint64_t position) {
+  uint64_t hash[2];
+  count_map_t *map;
+  count_entry_t *entry;
+
+  MurmurHash3_x64_128(line, len, BLOOM_HASH_SEED, hash);
+  map = &table->parts[BLOOM_PARTITION(hash[0])];
+  reserve_slot(map);
+  entry = find_slot(map, hash[0], hash[1], line, len);
+
+  if (entry->count == 0) {
+    entry->a = hash[0];
+    entry->b = hash[1];
+    entry->key = store_key(table, line, len);
+    entry->len = len;
+    entry->first = position;
+    map->used++;
+  }
+  entry->count++;
+  table->total++;
+}
+
+/****
+ *
+ * Merge one partition of another table into this one
+ *
+ * Keys are not copied, so src must outlive dst. Different partitions
+ * of the same destination can be merged concurrently.
+ *
+ * Arguments:
+ *   dst - Table receiving the counts
+ *   src - Table whose partition is merged
+ *   part - Partition to merge
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_table_merge(count_table_t *dst, const count_table_t *src, int part) {
+  const count_map_t *from = &src->parts[part];
+  count_map_t *map = &dst->parts[part];
+
+  for (size_t i = 0; i < from->size; i++) {
+    const count_entry_t *other = &from->slots[i];
+    count_entry_t *entry;
+
+    if (other->count == 0) continue;
+    reserve_slot(map);
+    entry = find_slot(map, other->a, other->b, other->key, other->len);
+    if (entry->count == 0) {
+      *entry = *other;
+      map->used++;
+    } else {
+      entry->count += other->count;
+      if (other->first < entry->first) entry->first = other->first;
+    }
+  }
+}
+
+/****
+ *
+ * Number of distinct lines in a table
+ *
+ * Arguments:
+ *   table - Table to inspect
+ *
+ * Returns:
+ *   Count of distinct keys
+ *
+ ****/
+size_t count_table_distinct(const count_table_t *table) {
+  size_t distinct = 0;
+
+  for (int i = 0; i < BLOOM_PARTITIONS; i++) {
+    distinct += table->parts[i].used;
+  }
+
+  return distinct;
+}
+
+/****
+ *
+ * Order entries by first occurrence
+ *
+ ****/
+PRIVATE int compare_first(const void *x, const void *y) {
+  const count_entry_t *ex = *(const count_entry_t * const *)x;
+  const count_entry_t *ey = *(const count_entry_t * const *)y;
+
+  return (ex->first > ey->first) - (ex->first < ey->first);
+}
+
+/****
+ *
+ * Write every distinct line with its count
+ *
+ * Lines are handed to emit in order of first occurrence.
+ *
+ * Arguments:
+ *   table - Table to write
+ *   emit - Called once per distinct line
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_table_emit(const count_table_t *table, count_emit_fn emit) {
+  size_t distinct = count_table_distinct(table);
+  const count_entry_t **order;
+  size_t n = 0;
+
+  if (distinct == 0) return;
+
+  order = (const count_entry_t **)XMALLOC(distinct * sizeof(count_entry_t *));
+  for (int i = 0; i < BLOOM_PARTITIONS; i++) {
+    const count_map_t *map = &table->parts[i];
+    for (size_t j = 0; j < map->size; j++) {
+      if (map->slots[j].count != 0) {
+        order[n++] = &map->slots[j];
+      }
+    }
+  }
+  qsort(order, n, sizeof(count_entry_t *), compare_first);
+
+  for (size_t i = 0; i < n; i++) {
+    emit(order[i]->key, order[i]->len, order[i]->count);
+  }
+
+  XFREE(order);
+}
@@ -0,0 +1,76 @@
+/*****
+ *
+ * Description: Exact Line Occurrence Count Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef COUNT_DOT_H
+#define COUNT_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+#include "bloom-filter.h"
+#include "mem.h"
+
+/* Initial slots of each partition map, a power of two */
+#define COUNT_MAP_SIZE 1024
+
+/* Key bytes are copied into arena chunks of this size */
+#define COUNT_CHUNK_SIZE (1024 * 1024)
+
+/* Distinct line and its occurrences, empty while count is 0 */
+typedef struct {
+  uint64_t a;                /* Murmur hash halves, a also picks the partition */
+  uint64_t b;
+  uint64_t count;
+  uint64_t first;            /* Input position of the first occurrence */
+  const char *key;           /* Line without its newline */
+  uint32_t len;
+} count_entry_t;
+
+/* Open addressing map for one partition */
+typedef struct {
+  count_entry_t *slots;
+  size_t size;               /* Power of two */
+  size_t used;
+} count_map_t;
+
+/* Count table split by the same partitions as the bloom filter */
+typedef struct {
+  count_map_t parts[BLOOM_PARTITIONS];
+  mem_arena_t keys;          /* Key bytes, one arena per table so hashers never share one */
+  uint64_t total;            /* Lines added */
+} count_table_t;
+
+/* Receives each distinct line and its count from count_table_emit() */
+typedef void (*count_emit_fn)(const char *line, size_t len, uint64_t count);
+
+/* Function prototypes */
+void count_table_init(count_table_t *table);
+void count_table_free(count_table_t *table);
+void count_table_add(count_table_t *table, const char *line, uint32_t len, uint64_t position);
+void count_table_merge(count_table_t *dst, const count_table_t *src, int part);
+size_t count_table_distinct(const count_table_t *table);
+void count_table_emit(const count_table_t *table, count_emit_fn emit);
+
+#endif /* COUNT_DOT_H */
@@ -18,6 +18,8 @@
 
 #include "murmur.h"
 #include "dablooms.h"
+#include "mem.h"
+#include "probes.h"
 
 #define DABLOOMS_VERSION "0.9.1"
 
@@ -59,6 +61,9 @@ const char *dablooms_version(void)
  ****/
 void free_bitmap(bitmap_t *bitmap)
 {
+    if (bitmap->array != NULL && bitmap->array != MAP_FAILED) {
+        mem_account(MEM_SCALING, -(int64_t)bitmap->bytes);
+    }
     if ((munmap(bitmap->array, bitmap->bytes)) < 0) {
         perror("Error, unmapping memory");
     }
@@ -157,7 +162,9 @@ bitmap_t *bitmap_resize(bitmap_t *bitmap, size_t old_size, size_t new_size)
         }
     }
     
+    mem_account(MEM_SCALING, (int64_t)new_size - (int64_t)old_size);
     bitmap->bytes = new_size;
+    USDT2(bitmap__resize, old_size, new_size);
     return bitmap;
 }
 
@@ -662,6 +669,7 @@ counting_bloom_t *new_counting_bloom_from_scale(scaling_bloom_t *bloom)
     
     bloom->num_bytes += cur_bloom->num_bytes;
     cur_bloom->bitmap = bloom->bitmap;
+    USDT3(scaling__grow, bloom->num_blooms, bloom->capacity, bloom->num_bytes);
     
     return cur_bloom;
 }
@@ -897,8 +905,9 @@ int scaling_bloom_check(scaling_bloom_t *bloom, const char *s, size_t len)
  ****/
 int scaling_bloom_check_add(scaling_bloom_t *bloom, const char *s, size_t len, uint64_t id)
 {
-    int i, found = 0;
+    int i;
     counting_bloom_t *cur_bloom = NULL;
+    counting_bloom_t *target = NULL;
     
     /* First check if item exists in any bloom filter */
     for (i = bloom->num_blooms - 1; i >= 0; i--) {
@@ -906,9 +915,9 @@ int scaling_bloom_check_add(scaling_bloom_t *bloom, const char *s, size_t len, u
         if (counting_bloom_check(cur_bloom, s, len)) {
             return 1; /* Already exists */
         }
-        /* Find the appropriate bloom filter for adding */
-        if (!found && id >= cur_bloom->header->id) {
-            found = 1;
+        /* Find the appropriate bloom filter for adding, the newest one that covers id */
+        if (target == NULL && id >= cur_bloom->header->id) {
+            target = cur_bloom;
         }
     }
     
@@ -916,9 +925,7 @@ int scaling_bloom_check_add(scaling_bloom_t *bloom, const char *s, size_t len, u
     uint64_t seqnum = scaling_bloom_clear_seqnums(bloom);
     
     /* Use the appropriate bloom filter or create new one if needed */
-    if (!found) {
-        cur_bloom = bloom->blooms[bloom->num_blooms - 1];
-    }
+    cur_bloom = (target != NULL) ? target : bloom->blooms[bloom->num_blooms - 1];
     
     if ((id > bloom->header->max_id) && (cur_bloom->header->count >= cur_bloom->capacity - 1)) {
         cur_bloom = new_counting_bloom_from_scale(bloom);
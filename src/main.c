@@ -44,6 +44,9 @@
 PRIVATE void cleanup( void );
 PRIVATE void print_version( void );
 PRIVATE void print_help( void );
+PRIVATE void serial_progress( uint64_t bytes, uint64_t lines, uint64_t dups );
+PRIVATE void *signal_thread( void *arg );
+PRIVATE int same_file( const char *a, const char *b );
 
 /****
  *
@@ -53,6 +56,7 @@ PRIVATE void print_help( void );
 
 PUBLIC int quit = FALSE;
 PUBLIC int reload = FALSE;
+PRIVATE volatile int signal_done = FALSE;
 PUBLIC Config_t *config = NULL;
 PUBLIC int diffIt = FALSE;
 PUBLIC int baseDirLen;
@@ -63,6 +67,9 @@ PUBLIC char compDir[PATH_MAX];
 /* hashes */
 struct hash_s *lineHash = NULL;
 
+/* heavy hitters summary for --top */
+PUBLIC topk_t *heavy_hitters = NULL;
+
 /****
  *
  * external variables
@@ -94,6 +101,7 @@ int main(int argc, char *argv[]) {
   PRIVATE struct passwd *pwd_ent;
   char *tmp_ptr = NULL;
   char *home_dir = NULL;
+  int exit_code = EXIT_SUCCESS;
 
   
   /* setup config */
@@ -107,10 +115,14 @@ int main(int argc, char *argv[]) {
   config->show_duplicates = FALSE;
   config->count_duplicates = FALSE;
   config->output_format = OUTPUT_TEXT;
-  config->bloom_type = BLOOM_REGULAR;
+  config->bloom_type = BLOOM_AUTO;
   config->save_bloom_file = NULL;
   config->load_bloom_file = NULL;
   config->adaptive_sizing = FALSE;
+  config->affinity_mode = AFFINITY_AUTO;
+  config->affinity_list = NULL;
+  config->deterministic = FALSE;
+  config->index_mode = INDEX_NONE;
 
   /* store current pid */
   config->cur_pid = getpid();
@@ -155,9 +167,26 @@ int main(int argc, char *argv[]) {
       {"save-bloom", required_argument, 0, 'S' },
       {"load-bloom", required_argument, 0, 'L' },
       {"adaptive", no_argument, 0, 'a' },
+      {"affinity", required_argument, 0, 'A' },
+      {"deterministic", no_argument, 0, 'R' },
+      {"top", required_argument, 0, 't' },
+      {"index", required_argument, 0, 'I' },
+      {"unique-out", required_argument, 0, OPT_UNIQUE_OUT },
+      {"dup-out", required_argument, 0, OPT_DUP_OUT },
+      {"count-out", required_argument, 0, OPT_COUNT_OUT },
+      {"zero-copy", no_argument, 0, 'Z' },
+      {"compress", required_argument, 0, OPT_COMPRESS },
+      {"latency-ms", required_argument, 0, OPT_LATENCY_MS },
+      {"perf-counters", no_argument, 0, OPT_PERF_COUNTERS },
+      {"validate", no_argument, 0, OPT_VALIDATE },
+      {"stats-interval", required_argument, 0, OPT_STATS_INTERVAL },
+      {"stats-out", required_argument, 0, OPT_STATS_OUT },
+      {"trace", required_argument, 0, OPT_TRACE },
+      {"populate", no_argument, 0, OPT_POPULATE },
+      {"huge-pages", no_argument, 0, OPT_HUGE_PAGES },
       {0, no_argument, 0, 0}
     };
-    c = getopt_long(argc, argv, "vd:e:hj:cspDf:b:S:L:a", long_options, &option_index);
+    c = getopt_long(argc, argv, "vd:e:hj:cspDf:b:S:L:aA:Rt:I:Z", long_options, &option_index);
 #else
     c = getopt( argc, argv, "vd:e:h" );
 #endif
@@ -194,9 +223,13 @@ int main(int argc, char *argv[]) {
 
     case 'j':
       /* number of threads */
-      config->num_threads = atoi( optarg );
-      if ( config->num_threads < 1 || config->num_threads > 64 ) {
-        fprintf( stderr, "ERR - Number of threads must be between 1 and 64\n" );
+      if ( strcmp( optarg, "auto" ) == 0 ) {
+        config->num_threads = topology_auto_threads();
+      } else {
+        config->num_threads = atoi( optarg );
+      }
+      if ( config->num_threads < 1 || config->num_threads > MAX_THREADS ) {
+        fprintf( stderr, "ERR - Number of threads must be between 1 and %d, or auto\n", MAX_THREADS );
         return( EXIT_FAILURE );
       }
       break;
@@ -239,12 +272,14 @@ int main(int argc, char *argv[]) {
 
     case 'b':
       /* bloom filter type */
-      if ( strcmp( optarg, "regular" ) == 0 ) {
+      if ( strcmp( optarg, "auto" ) == 0 ) {
+        config->bloom_type = BLOOM_AUTO;
+      } else if ( strcmp( optarg, "regular" ) == 0 ) {
         config->bloom_type = BLOOM_REGULAR;
       } else if ( strcmp( optarg, "scaling" ) == 0 ) {
         config->bloom_type = BLOOM_SCALING;
       } else {
-        fprintf( stderr, "ERR - Invalid bloom filter type: %s (use regular or scaling)\n", optarg );
+        fprintf( stderr, "ERR - Invalid bloom filter type: %s (use auto, regular or scaling)\n", optarg );
         return( EXIT_FAILURE );
       }
       break;
@@ -264,11 +299,194 @@ int main(int argc, char *argv[]) {
       config->adaptive_sizing = TRUE;
       break;
 
+    case 'A':
+      /* thread placement */
+      if ( strcmp( optarg, "auto" ) == 0 ) {
+        config->affinity_mode = AFFINITY_AUTO;
+      } else if ( strcmp( optarg, "none" ) == 0 ) {
+        config->affinity_mode = AFFINITY_NONE;
+      } else if ( isdigit( (unsigned char)optarg[0] ) ) {
+        config->affinity_mode = AFFINITY_LIST;
+        /* A repeated -A replaces the earlier list */
+        if ( config->affinity_list != NULL ) {
+          free( config->affinity_list );
+        }
+        config->affinity_list = strdup( optarg );
+      } else {
+        fprintf( stderr, "ERR - Invalid affinity: %s (use auto, none or a cpu list)\n", optarg );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case 'R':
+      /* parallel output identical to a serial run */
+      config->deterministic = TRUE;
+      break;
+
+    case 't':
+      /* heavy hitter report */
+      config->top_k = atoi( optarg );
+      if ( config->top_k < 1 || config->top_k > TOPK_MAX ) {
+        fprintf( stderr, "ERR - Top count must be between 1 and %d\n", TOPK_MAX );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case 'I':
+      /* positions instead of line text */
+      if ( strcmp( optarg, "offsets" ) == 0 ) {
+        config->index_mode = INDEX_OFFSETS;
+      } else if ( strcmp( optarg, "lines" ) == 0 ) {
+        config->index_mode = INDEX_LINES;
+      } else if ( strcmp( optarg, "bitmap" ) == 0 ) {
+        config->index_mode = INDEX_BITMAP;
+      } else {
+        fprintf( stderr, "ERR - Invalid index mode: %s (use offsets, lines or bitmap)\n", optarg );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case 'Z':
+      /* kernel copies selected lines from the input file */
+      config->zero_copy = TRUE;
+      break;
+
+    case OPT_UNIQUE_OUT:
+      /* unique lines to a file */
+      if ( config->unique_out != NULL ) {
+        free( config->unique_out );
+      }
+      config->unique_out = strdup( optarg );
+      break;
+
+    case OPT_DUP_OUT:
+      /* repeated lines to a file */
+      if ( config->dup_out != NULL ) {
+        free( config->dup_out );
+      }
+      config->dup_out = strdup( optarg );
+      break;
+
+    case OPT_COUNT_OUT:
+      /* exact counts to a file */
+      if ( config->count_out != NULL ) {
+        free( config->count_out );
+      }
+      config->count_out = strdup( optarg );
+      break;
+
+    case OPT_COMPRESS:
+      /* compressed stdout */
+      if ( strcmp( optarg, "gzip" ) EQ 0 ) {
+        config->compress = COMPRESS_GZIP;
+      } else if ( strcmp( optarg, "zstd" ) EQ 0 ) {
+        config->compress = COMPRESS_ZSTD;
+      } else {
+        fprintf( stderr, "ERR - Invalid compression: %s (use gzip or zstd)\n", optarg );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case OPT_LATENCY_MS:
+      /* bounded output delay for live streams */
+      config->latency_ms = atoi( optarg );
+      if ( config->latency_ms < 1 || config->latency_ms > MAX_LATENCY_MS ) {
+        fprintf( stderr, "ERR - Latency must be between 1 and %d ms\n", MAX_LATENCY_MS );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case OPT_PERF_COUNTERS:
+      /* hardware counters are reported with the statistics */
+      config->perf_counters = TRUE;
+      config->show_stats = TRUE;
+      break;
+
+    case OPT_VALIDATE:
+      /* observed false positive rate is reported with the statistics */
+      config->validate = TRUE;
+      config->show_stats = TRUE;
+      break;
+
+    case OPT_STATS_INTERVAL:
+      /* periodic JSON stats records */
+      config->stats_interval = atoi( optarg );
+      if ( config->stats_interval < 1 || config->stats_interval > MAX_STATS_INTERVAL ) {
+        fprintf( stderr, "ERR - Stats interval must be between 1 and %d seconds\n", MAX_STATS_INTERVAL );
+        return( EXIT_FAILURE );
+      }
+      break;
+
+    case OPT_STATS_OUT:
+      /* stats records to a file or descriptor */
+      if ( config->stats_out != NULL ) {
+        free( config->stats_out );
+      }
+      config->stats_out = strdup( optarg );
+      break;
+
+    case OPT_TRACE:
+      /* per thread timeline of the pipeline */
+      if ( config->trace_file != NULL ) {
+        free( config->trace_file );
+      }
+      config->trace_file = strdup( optarg );
+      break;
+
+    case OPT_POPULATE:
+      /* fault filters and tables in before processing */
+      config->populate = TRUE;
+      break;
+
+    case OPT_HUGE_PAGES:
+      /* back filters and tables with reserved huge pages */
+      config->huge_pages = TRUE;
+      break;
+
     default:
       fprintf( stderr, "Unknown option code [0%o]\n", c);
     }
   }
 
+  /* Index output is binary, it replaces any text format */
+  if ( config->index_mode != INDEX_NONE ) {
+    if ( config->count_duplicates ) {
+      fprintf( stderr, "ERR - -I cannot be combined with -c\n" );
+      return( EXIT_FAILURE );
+    }
+    config->output_format = OUTPUT_TEXT;
+  }
+
+  /* Unique and repeated lines with a file of their own are not printed */
+  if ( config->unique_out != NULL || config->dup_out != NULL ) {
+    if ( config->index_mode != INDEX_NONE || config->count_duplicates ) {
+      fprintf( stderr, "ERR - --unique-out and --dup-out cannot be combined with -I or -c\n" );
+      return( EXIT_FAILURE );
+    }
+    config->split_output = TRUE;
+  }
+
+  /* Each output file is truncated by its own writer, so two may not share a file */
+  if ( same_file( config->unique_out, config->dup_out ) || same_file( config->unique_out, config->count_out ) ||
+       same_file( config->dup_out, config->count_out ) ) {
+    fprintf( stderr, "ERR - --unique-out, --dup-out and --count-out must name different files\n" );
+    return( EXIT_FAILURE );
+  }
+
+  /* Selected lines are byte ranges of the input, found like -I offsets */
+  if ( config->zero_copy ) {
+    if ( optind >= argc || strcmp( argv[optind], "-" ) EQ 0 ) {
+      fprintf( stderr, "ERR - -Z needs an input file, not stdin\n" );
+      return( EXIT_FAILURE );
+    }
+    if ( config->index_mode != INDEX_NONE || config->count_duplicates || config->split_output ||
+         config->output_format != OUTPUT_TEXT || config->compress != COMPRESS_NONE ) {
+      fprintf( stderr, "ERR - -Z only writes plain text and cannot be combined with -I, -c, -f, --compress or split output\n" );
+      return( EXIT_FAILURE );
+    }
+    config->index_mode = INDEX_ZERO_COPY;
+  }
+
   /* set default error rate if not set */
   if ( config->eRate EQ 0 )
     config->eRate = 0.01;
@@ -302,40 +520,164 @@ int main(int argc, char *argv[]) {
     show_info();
   }
 
+  /* SIGUSR1 is taken by a thread of its own, every thread started from here on blocks it */
+  sigset_t usr1;
+  pthread_t signal_tid;
+  sigemptyset( &usr1 );
+  sigaddset( &usr1, SIGUSR1 );
+  pthread_sigmask( SIG_BLOCK, &usr1, NULL );
+  
   /* Initialize timing */
   struct timeval start_time, end_time;
+  stats_t stats;
+  perf_group_t perf_group;
+  init_stats(&stats);
   gettimeofday(&start_time, NULL);
   
+  if ( config->top_k > 0 ) {
+    heavy_hitters = ( topk_t * )XMALLOC( sizeof( topk_t ) );
+    topk_init( heavy_hitters, config->top_k );
+  }
+  
+  if ( output_open_sinks() != TRUE || stats_stream_open( config->stats_out ) != TRUE ||
+       ( config->trace_file && trace_open( config->trace_file ) != TRUE ) ) {
+    output_close_sinks();
+    cleanup();
+    return( EXIT_FAILURE );
+  }
+  
+  if ( config->compress != COMPRESS_NONE && compress_start( config->compress ) != TRUE ) {
+    output_close_sinks();
+    cleanup();
+    return( EXIT_FAILURE );
+  }
+  
+  /* Half the latency budget goes to the flush, half to parallel batching */
+  if ( config->latency_ms > 0 && output_start_flusher( ( config->latency_ms + 1 ) / 2 ) != TRUE ) {
+    if ( config->compress != COMPRESS_NONE ) compress_finish();
+    output_close_sinks();
+    cleanup();
+    return( EXIT_FAILURE );
+  }
+  
+  output_header(config->output_format);
+  
+  if ( config->zero_copy && zcopy_open( argv[optind] ) != TRUE ) {
+    output_close_sinks();
+    cleanup();
+    return( EXIT_FAILURE );
+  }
+  
+  /* Verdicts are checked in input order on one thread, counts have no filter */
+  if ( config->validate ) {
+    if ( config->count_duplicates ) {
+      fprintf( stderr, "WARN - --validate has no filter to check with -c\n" );
+      config->validate = FALSE;
+    } else if ( config->num_threads > 1 ) {
+      fprintf( stderr, "WARN - --validate runs serially, ignoring -j %d\n", config->num_threads );
+      config->num_threads = 1;
+    }
+  }
+  
+  /* Large buffers are mapped lazily unless asked to prefault them */
+  mem_large_setup( config->populate ? topology_auto_threads() : 0, config->huge_pages );
+  
+  /* Sampled per stage timings for --stats, also the spans of --trace */
+  if ( config->show_stats || config->trace_file ) {
+    stage_enable();
+  }
+  if ( config->perf_counters ) {
+    perf_enable();
+  }
+  
+  /* Progress by bytes of the input file, or just counters for stdin, also feeds the stats records */
+  {
+    struct stat in_stat;
+    uint64_t total = 0;
+    
+    if ( optind < argc && strcmp( argv[optind], "-" ) != 0 &&
+         stat( argv[optind], &in_stat ) EQ 0 && S_ISREG( in_stat.st_mode ) ) {
+      total = (uint64_t)in_stat.st_size;
+    }
+    progress_start( total, config->show_progress );
+  }
+  if ( pthread_create( &signal_tid, NULL, signal_thread, &usr1 ) != 0 ) {
+    fprintf( stderr, "WARN - Unable to start signal thread, SIGUSR1 snapshots are off\n" );
+    signal_done = TRUE;
+  }
+  
+  /* The main thread reads in serial runs and writes in parallel ones */
+  trace_thread( ( config->num_threads > 1 ) ? "writer" : "main" );
+  perf_thread_begin( &perf_group );
+  
   if (optind < argc) {
     /* Process specified file */
     if (config->num_threads > 1) {
-      process_file_parallel( argv[optind++], config->num_threads );
+      process_file_parallel( argv[optind++], config->num_threads, &stats.pipeline );
     } else {
       processFile( argv[optind++] );
     }
   } else {
     /* No file specified, read from stdin */
     if (config->num_threads > 1) {
-      process_file_parallel( "-", config->num_threads );
+      process_file_parallel( "-", config->num_threads, &stats.pipeline );
     } else {
       processFile( "-" );
     }
   }
   
+  perf_thread_end( &perf_group );
+  if ( !signal_done ) {
+    signal_done = TRUE;
+    pthread_kill( signal_tid, SIGUSR1 );
+    pthread_join( signal_tid, NULL );
+  }
+  progress_stop();
+  stats_stream_close();
+  if ( trace_close() != TRUE ) {
+    exit_code = EXIT_FAILURE;
+  }
+  
   /* Calculate processing time */
   gettimeofday(&end_time, NULL);
   config->processing_time = get_time_diff(&start_time, &end_time);
   
+  /* Copy the last run of selected lines before anything else is printed */
+  if ( config->zero_copy && zcopy_close() != TRUE ) {
+    exit_code = EXIT_FAILURE;
+  }
+  
+  output_footer(config->output_format);
+  
+  /* Report the most frequent lines if requested */
+  if ( heavy_hitters != NULL ) {
+    output_top( heavy_hitters, config->output_format, &stats.top );
+  }
+  
   /* Show statistics if requested */
   if (config->show_stats) {
-    stats_t stats;
-    init_stats(&stats);
     stats.total_lines = config->total_lines;
     stats.unique_lines = config->unique_lines;
     stats.duplicate_lines = config->duplicate_lines;
+    stats.total_bytes = config->total_bytes;
+    config->memory_used = mem_peak( MEM_TOTAL );
     finalize_stats(&stats, config->processing_time, config->memory_used);
     output_stats(&stats, config->output_format);
   }
+  
+  output_end(config->output_format);
+  
+  if ( config->latency_ms > 0 ) {
+    output_stop_flusher();
+  }
+  
+  if ( config->compress != COMPRESS_NONE && compress_finish() != TRUE ) {
+    exit_code = EXIT_FAILURE;
+  }
+  
+  if ( output_close_sinks() != TRUE ) {
+    exit_code = EXIT_FAILURE;
+  }
 
   /****
    *
@@ -348,7 +690,7 @@ int main(int argc, char *argv[]) {
 
   cleanup();
 
-  return( EXIT_SUCCESS );
+  return( exit_code );
 }
 
 /****
@@ -430,31 +772,53 @@ PRIVATE void print_help( void ) {
   fprintf( stderr, " -v|--version         display version information\n" );
   fprintf( stderr, "\n" );
   fprintf( stderr, "Advanced Options:\n" );
-  fprintf( stderr, " -j|--threads (N)     use N threads for parallel processing\n" );
-  fprintf( stderr, " -c|--count           count duplicate occurrences\n" );
+  fprintf( stderr, " -j|--threads (N)     use N threads for parallel processing, or auto\n" );
+  fprintf( stderr, " -c|--count           print each distinct line once with its exact count\n" );
   fprintf( stderr, " -s|--stats           show processing statistics\n" );
   fprintf( stderr, " -p|--progress        show progress bar\n" );
   fprintf( stderr, " -D|--duplicates      show duplicate lines instead of unique\n" );
   fprintf( stderr, " -f|--format (type)   output format: text, json, csv, tsv\n" );
-  fprintf( stderr, " -b|--bloom-type (t)  bloom filter type: regular, scaling\n" );
+  fprintf( stderr, " -b|--bloom-type (t)  bloom filter type: auto, regular, scaling [default: auto]\n" );
   fprintf( stderr, " -S|--save-bloom (f)  save bloom filter to file\n" );
   fprintf( stderr, " -L|--load-bloom (f)  load bloom filter from file\n" );
   fprintf( stderr, " -a|--adaptive        use adaptive bloom filter sizing\n" );
+  fprintf( stderr, " -A|--affinity (m)    pin threads: auto, none, or cpus 0,2,4-7 [default: auto]\n" );
+  fprintf( stderr, " -R|--deterministic   parallel output identical to a serial run\n" );
+  fprintf( stderr, " -t|--top (K)         report the K most frequent lines\n" );
+  fprintf( stderr, " -I|--index (mode)    write positions, not text: offsets, lines, bitmap\n" );
+  fprintf( stderr, " -Z|--zero-copy       copy unique lines from the input file in the kernel\n" );
+  fprintf( stderr, " --unique-out (f)     write unique lines to a file, not stdout\n" );
+  fprintf( stderr, " --dup-out (f)        write repeated lines to a file, not stdout\n" );
+  fprintf( stderr, " --count-out (f)      also write exact counts of every line to a file\n" );
+  fprintf( stderr, " --compress (type)    compress stdout in parallel: gzip, zstd\n" );
+  fprintf( stderr, " --latency-ms (N)     write selected lines within N ms on live streams\n" );
+  fprintf( stderr, " --perf-counters      add hardware counters per line and byte to -s\n" );
+  fprintf( stderr, " --validate           measure the real false positive rate with -s\n" );
+  fprintf( stderr, " --stats-interval (N) write a JSON stats record every N seconds\n" );
+  fprintf( stderr, " --stats-out (f)      stats records to a file or fd:N, not stderr\n" );
+  fprintf( stderr, " --trace (f)          write a per thread timeline as Chrome trace JSON\n" );
+  fprintf( stderr, " --populate           fault filters and tables in on every cpu at start\n" );
+  fprintf( stderr, " --huge-pages         map filters and tables on reserved huge pages\n" );
 #else
   fprintf( stderr, " -d (0-9)   enable debugging info\n" );
   fprintf( stderr, " -e (rate)  error rate [default: 0.01]\n" );
   fprintf( stderr, " -h         this info\n" );
   fprintf( stderr, " -v         display version information\n" );
-  fprintf( stderr, " -j (N)     use N threads for parallel processing\n" );
-  fprintf( stderr, " -c         count duplicate occurrences\n" );
+  fprintf( stderr, " -j (N)     use N threads for parallel processing, or auto\n" );
+  fprintf( stderr, " -c         print each distinct line once with its exact count\n" );
   fprintf( stderr, " -s         show processing statistics\n" );
   fprintf( stderr, " -p         show progress bar\n" );
   fprintf( stderr, " -D         show duplicate lines instead of unique\n" );
   fprintf( stderr, " -f (type)  output format: text, json, csv, tsv\n" );
-  fprintf( stderr, " -b (type)  bloom filter type: regular, scaling\n" );
+  fprintf( stderr, " -b (type)  bloom filter type: auto, regular, scaling [default: auto]\n" );
   fprintf( stderr, " -S (file)  save bloom filter to file\n" );
   fprintf( stderr, " -L (file)  load bloom filter from file\n" );
   fprintf( stderr, " -a         use adaptive bloom filter sizing\n" );
+  fprintf( stderr, " -A (mode)  pin threads: auto, none, or cpus 0,2,4-7 [default: auto]\n" );
+  fprintf( stderr, " -R         parallel output identical to a serial run\n" );
+  fprintf( stderr, " -t (K)     report the K most frequent lines\n" );
+  fprintf( stderr, " -I (mode)  write positions, not text: offsets, lines, bitmap\n" );
+  fprintf( stderr, " -Z         copy unique lines from the input file in the kernel\n" );
 #endif
 
   fprintf( stderr, "\n" );
@@ -463,7 +827,18 @@ PRIVATE void print_help( void ) {
   fprintf( stderr, "  cat file | %s                  # Remove duplicates from stdin\n", PACKAGE );
   fprintf( stderr, "  %s -e 0.001 large.txt          # Use lower error rate for better accuracy\n", PACKAGE );
   fprintf( stderr, "  %s -j 4 -s large.txt           # Use 4 threads and show statistics\n", PACKAGE );
+  fprintf( stderr, "  %s -j auto -A 0-7 large.txt    # One thread per usable cpu, pinned to cpus 0-7\n", PACKAGE );
+  fprintf( stderr, "  %s -j 8 -R huge.txt            # Parallel, same output as a serial run\n", PACKAGE );
   fprintf( stderr, "  %s -c -f json data.txt         # Count duplicates and output as JSON\n", PACKAGE );
+  fprintf( stderr, "  %s -t 20 -s access.log         # Also report the 20 most frequent lines\n", PACKAGE );
+  fprintf( stderr, "  %s -I offsets in.log > in.idx  # Byte offset and length of each unique line\n", PACKAGE );
+  fprintf( stderr, "  %s -Z big.log > big.uniq       # Output copied by the kernel, not read back\n", PACKAGE );
+  fprintf( stderr, "  %s --dup-out dups.txt in.txt   # Uniques to stdout, repeats to a file\n", PACKAGE );
+  fprintf( stderr, "  %s --compress gzip in > u.gz   # Output gzipped on every core\n", PACKAGE );
+  fprintf( stderr, "  %s --latency-ms 100 < fifo     # Unique lines within 100ms of arriving\n", PACKAGE );
+  fprintf( stderr, "  %s --perf-counters big.txt     # Cycles and cache misses per line\n", PACKAGE );
+  fprintf( stderr, "  %s --validate -b scaling in    # Observed against configured error rate\n", PACKAGE );
+  fprintf( stderr, "  %s --stats-interval 60 < feed  # Running totals every minute, or on SIGUSR1\n", PACKAGE );
   fprintf( stderr, "  %s -D -p huge.txt              # Show duplicates with progress bar\n", PACKAGE );
   fprintf( stderr, "  %s -b scaling -a input.txt     # Use adaptive scaling bloom filter\n", PACKAGE );
   fprintf( stderr, "\n" );
@@ -496,6 +871,28 @@ PRIVATE void cleanup( void ) {
   if ( config->load_bloom_file ) {
     free( config->load_bloom_file );
   }
+  if ( config->affinity_list ) {
+    free( config->affinity_list );
+  }
+  if ( config->unique_out ) {
+    free( config->unique_out );
+  }
+  if ( config->dup_out ) {
+    free( config->dup_out );
+  }
+  if ( config->count_out ) {
+    free( config->count_out );
+  }
+  if ( config->stats_out ) {
+    free( config->stats_out );
+  }
+  if ( config->trace_file ) {
+    free( config->trace_file );
+  }
+  if ( heavy_hitters != NULL ) {
+    topk_free( heavy_hitters );
+    XFREE( heavy_hitters );
+  }
   
 #ifdef MEM_DEBUG
   XFREE_ALL();
@@ -503,6 +900,216 @@ PRIVATE void cleanup( void ) {
   XFREE( config );
 }
 
+/****
+ *
+ * Choose and size the bloom filter for an input
+ *
+ * Shared by the serial and parallel paths so both make the same choice
+ * and therefore produce the same output. With -b auto, the default,
+ * regular files over 10MB use the scaling filter and everything else a
+ * regular filter sized from the file size; -b regular and -b scaling
+ * force one or the other.
+ *
+ * Arguments:
+ *   fName - Path to input file, or "-" for stdin
+ *   fSize - Size of the input file, 0 for stdin
+ *   plan - Filled in with the chosen filter and its sizing
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void plan_filter( const char *fName, size_t fSize, filter_plan_t *plan ) {
+  int is_stdin = ( strcmp( fName, "-" ) EQ 0 );
+
+  /* Scaling bloom filter becomes impractical for very large datasets (>10M items) */
+  /* so stdin uses a large regular filter unless scaling is asked for */
+  plan->use_scaling = ( config->bloom_type EQ BLOOM_SCALING ) ||
+                      ( config->bloom_type EQ BLOOM_AUTO && !is_stdin && fSize > 10 * 1024 * 1024 ); /* > 10MB */
+
+  if ( plan->use_scaling ) {
+    /* For stdin, use a larger initial capacity to reduce scaling needs */
+    plan->capacity = is_stdin ? 10000000 : 1000000;
+    plan->entries = 0;
+    /* For very large datasets from stdin, use a higher error rate to reduce memory */
+    plan->error_rate = ( is_stdin && config->eRate < 0.1 ) ? 0.1 : config->eRate;
+  } else if ( is_stdin ) {
+    /* For stdin, estimate based on typical password list sizes */
+    plan->capacity = 0;
+    plan->entries = 50000000; /* 50M entries */
+    /* Use higher error rate to keep memory reasonable */
+    plan->error_rate = ( config->eRate < 0.01 ) ? 0.01 : config->eRate;
+  } else {
+    /* Estimate lines based on file size with average line length of 20 chars */
+    /* Add 50% buffer for safety */
+    plan->capacity = 0;
+    plan->entries = ( ( fSize / 20 ) * 3 ) / 2;
+
+    /* Ensure reasonable bounds */
+    if ( plan->entries < 1000 ) plan->entries = 1000;
+    if ( plan->entries > 10000000 ) plan->entries = 10000000;
+
+    plan->error_rate = config->eRate;
+  }
+}
+
+/****
+ *
+ * Count the exact occurrences of every line of a stream
+ *
+ * Lines are read and truncated exactly like processFile() does, then
+ * written once each with their count in order of first occurrence.
+ *
+ * Arguments:
+ *   inFile - Open input stream
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void count_stream( FILE *inFile ) {
+  char rBuf[MAX_LINE_LEN + 1];
+  count_table_t counts;
+  uint64_t line_count = 0;
+  uint64_t bytes = 0;
+  uint64_t lap = STAGE_BEGIN( 0 );
+  uint64_t start;
+
+  count_table_init( &counts );
+
+  while ( fgets( rBuf, sizeof( rBuf ), inFile ) != NULL ) {
+    STAGE_LAP( STAGE_READ, lap );
+    size_t line_len = strlen( rBuf );
+    line_count++;
+    bytes += line_len;
+
+    if ( line_len > 0 && rBuf[line_len - 1] EQ '\n' ) {
+      line_len--;
+    } else if ( line_len EQ sizeof(rBuf) - 1 ) {
+      /* Line was truncated, skip rest of line */
+      int ch;
+      while ( (ch = fgetc(inFile)) != '\n' && ch != EOF ) {
+        /* Skip rest of line */
+      }
+    }
+    STAGE_LAP( STAGE_SCAN, lap );
+
+    count_table_add( &counts, rBuf, (uint32_t)line_len, line_count );
+    if ( heavy_hitters != NULL ) {
+      topk_add( heavy_hitters, rBuf, (uint32_t)line_len );
+    }
+    STAGE_LAP( STAGE_TALLY, lap );
+    if ( ( line_count & ( PROGRESS_BATCH_LINES - 1 ) ) EQ 0 ) {
+      serial_progress( bytes, line_count, line_count );
+    }
+    lap = STAGE_BEGIN( line_count );
+  }
+  /* Distinct lines are only known at the end, report none as unique */
+  serial_progress( bytes, line_count, line_count );
+
+  start = STAGE_MARK();
+  count_table_emit( &counts, output_counted_line );
+  if ( config->count_out != NULL ) {
+    count_table_emit( &counts, output_count_sink_line );
+  }
+  stage_done( STAGE_WRITE, start );
+
+  config->total_lines = counts.total;
+  config->total_bytes = bytes;
+  config->unique_lines = count_table_distinct( &counts );
+  config->duplicate_lines = counts.total - config->unique_lines;
+
+  count_table_free( &counts );
+}
+
+/****
+ *
+ * Write a stats record for every SIGUSR1
+ *
+ * The signal is blocked in every other thread, so it is taken here with
+ * sigwait() and the record is written outside of any signal handler.
+ *
+ * Arguments:
+ *   arg - Signal set holding SIGUSR1
+ *
+ * Returns:
+ *   NULL when the run is over
+ *
+ ****/
+PRIVATE void *signal_thread( void *arg ) {
+  sigset_t *set = (sigset_t *)arg;
+  int signo;
+
+  while ( sigwait( set, &signo ) EQ 0 && !signal_done ) {
+    stats_record( "snapshot" );
+  }
+
+  return NULL;
+}
+
+/****
+ *
+ * Check whether two output paths name the same file
+ *
+ * Paths are compared as given, and by device and inode when both
+ * files already exist, so links and ./ prefixes are caught too.
+ *
+ * Arguments:
+ *   a - First path, or NULL
+ *   b - Second path, or NULL
+ *
+ * Returns:
+ *   TRUE if both are set and name the same file, FALSE otherwise
+ *
+ ****/
+PRIVATE int same_file( const char *a, const char *b ) {
+  struct stat a_stat;
+  struct stat b_stat;
+
+  if ( a EQ NULL || b EQ NULL ) {
+    return FALSE;
+  }
+  if ( strcmp( a, b ) EQ 0 ) {
+    return TRUE;
+  }
+  if ( stat( a, &a_stat ) EQ 0 && stat( b, &b_stat ) EQ 0 &&
+       a_stat.st_dev EQ b_stat.st_dev && a_stat.st_ino EQ b_stat.st_ino ) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/****
+ *
+ * Hand the serial loops' totals so far to the progress bar
+ *
+ * Called every PROGRESS_BATCH_LINES lines, so the per line cost is a
+ * mask test. Repeats rather than uniques are passed because that is
+ * what the loops count.
+ *
+ * Arguments:
+ *   bytes - Input bytes read so far
+ *   lines - Lines read so far
+ *   dups - Repeated lines so far
+ *
+ * Returns:
+ *   None (void function)
+ *
+ ****/
+PRIVATE void serial_progress( uint64_t bytes, uint64_t lines, uint64_t dups ) {
+  static uint64_t last_bytes = 0;
+  static uint64_t last_lines = 0;
+  static uint64_t last_dups = 0;
+
+  progress_add( bytes - last_bytes, lines - last_lines, ( lines - last_lines ) - ( dups - last_dups ) );
+  last_bytes = bytes;
+  last_lines = lines;
+  last_dups = dups;
+}
+
 /****
  *
  * Process input file to remove duplicate lines using bloom filters
@@ -525,20 +1132,21 @@ int processFile( const char *fName ) {
   struct stat fStatBuf;
   size_t fSize = 0;
   FILE *inFile;
-  char rBuf[8192];
-  char *readBuf = NULL;
-  size_t readBufSize = 1024 * 1024; /* 1MB read buffer */
+  char rBuf[MAX_LINE_LEN + 1];
+  size_t readBufSize = 1024 * 1024; /* 1MB stdio buffer */
   scaling_bloom_t *sbf = NULL;
   struct bloom bf;
   int use_scaling = FALSE;
   char tmpfile[PATH_MAX];
   uint64_t line_count = 0;
+  uint64_t dup_count = 0;
+  uint64_t input_offset = 0;
+  uint64_t lap = 0;
+  count_table_t tally;
+  filter_plan_t plan;
 
-  /* Check if we're reading from stdin or if file is very large */
+  /* Check if we're reading from stdin or a file */
   if ( strcmp( fName, "-" ) EQ 0 ) {
-    /* For stdin, use regular bloom filter with large capacity instead of scaling */
-    /* Scaling bloom filter becomes impractical for very large datasets (>10M items) */
-    use_scaling = FALSE;
     inFile = stdin;
   } else {
     /* Security validation for file path */
@@ -567,12 +1175,6 @@ int processFile( const char *fName ) {
     
     fSize = fStatBuf.st_size;
     
-    /* Use scaling bloom filter for larger files or stdin */
-    /* Lower threshold since scaling bloom filter is more reliable */
-    if ( fSize > 10 * 1024 * 1024 ) { /* > 10MB */
-      use_scaling = TRUE;
-    }
-    
 #ifdef HAVE_FOPEN64
     if ( ( inFile = fopen64( fName, "r" ) ) EQ NULL ) {
 #else
@@ -583,6 +1185,19 @@ int processFile( const char *fName ) {
     }
   }
 
+  /* Exact counts need no filter */
+  if ( config->count_duplicates ) {
+    count_stream( inFile );
+    if ( inFile != stdin ) {
+      fclose( inFile );
+    }
+    return TRUE;
+  }
+
+  plan_filter( fName, fSize, &plan );
+  use_scaling = plan.use_scaling;
+  count_table_init( &tally );
+
   if ( use_scaling ) {
     /* Create secure temporary file for scaling bloom filter */
     /* Try to use current directory first, fall back to /tmp if needed */
@@ -610,11 +1225,7 @@ int processFile( const char *fName ) {
     tmpfile[sizeof(tmpfile) - 1] = '\0';
     
     /* Initialize scaling bloom filter with initial capacity */
-    /* For stdin, use a larger initial capacity to reduce scaling needs */
-    unsigned int initial_capacity = ( strcmp( fName, "-" ) == 0 ) ? 10000000 : 1000000;
-    /* For very large datasets from stdin, use a higher error rate to reduce memory */
-    double effective_error_rate = ( strcmp( fName, "-" ) == 0 && config->eRate < 0.1 ) ? 0.1 : config->eRate;
-    sbf = new_scaling_bloom( initial_capacity, effective_error_rate, tmpfile );
+    sbf = new_scaling_bloom( plan.capacity, plan.error_rate, tmpfile );
     if ( sbf == NULL ) {
       fprintf( stderr, "ERR - Unable to initialize scaling bloom filter\n" );
       if ( inFile != stdin ) fclose( inFile );
@@ -622,31 +1233,28 @@ int processFile( const char *fName ) {
     }
     
     if ( config->debug > 0 ) {
-      fprintf( stderr, "Using scaling bloom filter with error rate %.4f (effective: %.4f)\n", config->eRate, effective_error_rate );
+      fprintf( stderr, "Using scaling bloom filter with error rate %.4f (effective: %.4f)\n", config->eRate, plan.error_rate );
+    }
+    if ( config->validate ) {
+      validate_begin( TRUE, plan.error_rate );
     }
+    progress_filter( 0, 0, plan.capacity );
     
-    /* For larger files, use optimized buffered reading */
+    /* For larger files, give stdio a larger buffer */
     if ( fSize > 10 * 1024 * 1024 ) { /* > 10MB */
-      /* Allocate large read buffer */
-      readBuf = (char *)XMALLOC( readBufSize );
-      if ( readBuf == NULL ) {
-        fprintf( stderr, "ERR - Unable to allocate read buffer\n" );
-        if ( inFile != stdin ) fclose( inFile );
-        free_scaling_bloom( sbf );
-        unlink( tmpfile );
-        return FAILED;
-      }
-      
-      /* Set large buffer for stdio */
       if ( setvbuf( inFile, NULL, _IOFBF, readBufSize ) != 0 ) {
         fprintf( stderr, "WARN - Unable to set large buffer\n" );
       }
     }
     
     /* Process lines with scaling bloom filter */
+    lap = STAGE_BEGIN( 0 );
     while ( fgets( rBuf, sizeof( rBuf ), inFile ) != NULL ) {
+      STAGE_LAP( STAGE_READ, lap );
       line_count++;
       size_t line_len = strlen( rBuf );
+      uint64_t line_offset = input_offset;
+      uint64_t text_len = line_len;
       
       /* Check for null pointer */
       if ( sbf == NULL ) {
@@ -660,67 +1268,79 @@ int processFile( const char *fName ) {
         /* Line was truncated, skip rest of line */
         int ch;
         while ( (ch = fgetc(inFile)) != '\n' && ch != EOF ) {
-          /* Skip rest of line */
+          text_len++;
+        }
+        if ( ch EQ '\n' ) {
+          input_offset++;
         }
         if ( config->debug > 0 ) {
           fprintf( stderr, "WARN - Line %lu truncated at %zu bytes\n", line_count, line_len );
         }
+      } else if ( line_len > 0 && rBuf[line_len - 1] EQ '\n' ) {
+        text_len--;
+        input_offset++;
       }
+      input_offset += text_len;
+      STAGE_LAP( STAGE_SCAN, lap );
+      
+      if ( heavy_hitters != NULL ) {
+        topk_add_line( heavy_hitters, rBuf, line_len );
+      }
+      if ( config->count_out != NULL ) {
+        count_table_add( &tally, rBuf, (uint32_t)(( text_len < line_len ) ? text_len : line_len), line_count );
+      }
+      STAGE_LAP( STAGE_TALLY, lap );
       
       /* Combined check and add to avoid duplicate hash computation */
       int result = scaling_bloom_check_add( sbf, rBuf, line_len, line_count );
+      STAGE_LAP( STAGE_PROBE, lap );
+      USDT_VERDICT( result, rBuf, line_len );
+      if ( config->validate && result != -1 ) {
+        validate_line( rBuf, line_len, result, line_count, (int)sbf->num_blooms - 1,
+                       sbf->blooms[sbf->num_blooms - 1]->error_rate );
+      }
       if ( result == -1 ) {
         fprintf( stderr, "ERR - Failed to add item to scaling bloom filter at line %lu\n", line_count );
-        if ( readBuf != NULL ) {
-          XFREE( readBuf );
-        }
         free_scaling_bloom( sbf );
         unlink( tmpfile );
+        count_table_free( &tally );
+        validate_end();
         if ( inFile != stdin ) fclose( inFile );
         return FAILED;
-      } else if ( result == 0 ) {
-        /* This is a new unique line, print it */
-        printf( "%s", rBuf );
+      } else if ( config->split_output && output_split( rBuf, line_len, result ) ) {
+        /* Routed to --unique-out or --dup-out */
+      } else if ( result == config->show_duplicates ) {
+        /* Print new unique lines, or repeats with -D */
+        if ( config->index_mode != INDEX_NONE ) {
+          output_index( line_count, line_offset, text_len );
+        } else {
+          output_raw_line( rBuf, line_len, config->output_format );
+        }
       }
+      STAGE_LAP( STAGE_WRITE, lap );
+      if ( result == 1 ) {
+        dup_count++;
+      }
+      if ( ( line_count & ( PROGRESS_BATCH_LINES - 1 ) ) EQ 0 ) {
+        serial_progress( input_offset, line_count, dup_count );
+      }
+      lap = STAGE_BEGIN( line_count );
     }
     
     /* Cleanup */
-    if ( readBuf != NULL ) {
-      XFREE( readBuf );
-    }
     free_scaling_bloom( sbf );
     unlink( tmpfile );
     
   } else {
     /* Use regular bloom filter for files and stdin */
     
-    size_t estimated_lines;
-    double effective_error_rate;
-    
-    if ( strcmp( fName, "-" ) == 0 ) {
-      /* For stdin, estimate based on typical password list sizes */
-      /* Use larger capacity to handle big password lists */
-      estimated_lines = 50000000; /* 50M entries */
-      /* Use higher error rate to keep memory reasonable */
-      effective_error_rate = (config->eRate < 0.01) ? 0.01 : config->eRate;
-      if ( config->debug > 0 ) {
-        fprintf( stderr, "stdin: Using regular bloom filter with capacity %zu, error rate %.4f\n", 
-                estimated_lines, effective_error_rate );
-      }
-    } else {
-      /* Estimate lines based on file size with average line length of 20 chars */
-      /* Add 50% buffer for safety */
-      estimated_lines = ((fSize / 20) * 3) / 2;
-      
-      /* Ensure reasonable bounds */
-      if (estimated_lines < 1000) estimated_lines = 1000;
-      if (estimated_lines > 10000000) estimated_lines = 10000000;
-      
-      effective_error_rate = config->eRate;
+    if ( config->debug > 0 ) {
+      fprintf( stderr, "%sUsing regular bloom filter with capacity %zu, error rate %.4f\n",
+               ( inFile EQ stdin ) ? "stdin: " : "", plan.entries, plan.error_rate );
     }
     
     /* init bloom filter */
-    if ( bloom_init_64( &bf, estimated_lines, effective_error_rate ) != 0 ) {
+    if ( bloom_init_64( &bf, plan.entries, plan.error_rate ) != 0 ) {
       fprintf( stderr, "ERR - Unable to initialize bloom filter\n" );
       if ( inFile != stdin ) fclose( inFile );
       return FAILED;
@@ -729,34 +1349,99 @@ int processFile( const char *fName ) {
     if ( config->debug > 0 ) {
       bloom_print( &bf );
     }
+    if ( config->validate ) {
+      validate_begin( FALSE, plan.error_rate );
+    }
+    progress_filter( bf.bits, bf.hashes, plan.entries );
     
     /* Process lines with regular bloom filter */
+    lap = STAGE_BEGIN( 0 );
     while ( fgets( rBuf, sizeof( rBuf ), inFile ) != NULL ) {
+      STAGE_LAP( STAGE_READ, lap );
+      line_count++;
       size_t line_len = strlen( rBuf );
+      uint64_t line_offset = input_offset;
+      uint64_t text_len = line_len;
       
       /* Check if line was truncated (no newline at end of buffer) */
       if ( line_len == sizeof(rBuf) - 1 && rBuf[line_len - 1] != '\n' ) {
         /* Line was truncated, skip rest of line */
         int ch;
         while ( (ch = fgetc(inFile)) != '\n' && ch != EOF ) {
-          /* Skip rest of line */
+          text_len++;
+        }
+        if ( ch EQ '\n' ) {
+          input_offset++;
         }
         if ( config->debug > 0 ) {
           fprintf( stderr, "WARN - Line truncated at %zu bytes\n", line_len );
         }
+      } else if ( line_len > 0 && rBuf[line_len - 1] EQ '\n' ) {
+        text_len--;
+        input_offset++;
       }
+      input_offset += text_len;
+      STAGE_LAP( STAGE_SCAN, lap );
       
-      /* Use original check-and-add function (fixed bit shift) */
-      if ( bloom_check_add_64( &bf, rBuf, line_len ) == 0 ) {
-        /* This is a new unique line, print it */
-        printf( "%s", rBuf );
+      if ( heavy_hitters != NULL ) {
+        topk_add_line( heavy_hitters, rBuf, line_len );
+      }
+      if ( config->count_out != NULL ) {
+        count_table_add( &tally, rBuf, (uint32_t)(( text_len < line_len ) ? text_len : line_len), line_count );
+      }
+      STAGE_LAP( STAGE_TALLY, lap );
+      
+      /* Use original check-and-add function (fixed bit shift), hash apart on sampled lines */
+      int result;
+      if ( lap != 0 ) {
+        uint64_t hash[2];
+        MurmurHash3_x64_128( rBuf, line_len, BLOOM_HASH_SEED, hash );
+        STAGE_LAP( STAGE_HASH, lap );
+        result = bloom_check_add_64_hashed( &bf, hash[0], hash[1] );
+      } else {
+        result = bloom_check_add_64( &bf, rBuf, line_len );
       }
+      STAGE_LAP( STAGE_PROBE, lap );
+      USDT_VERDICT( result, rBuf, line_len );
+      if ( config->validate ) {
+        validate_line( rBuf, line_len, result, line_count, 0, plan.error_rate );
+      }
+      if ( config->split_output && output_split( rBuf, line_len, result ) ) {
+        /* Routed to --unique-out or --dup-out */
+      } else if ( result == config->show_duplicates ) {
+        /* Print new unique lines, or repeats with -D */
+        if ( config->index_mode != INDEX_NONE ) {
+          output_index( line_count, line_offset, text_len );
+        } else {
+          output_raw_line( rBuf, line_len, config->output_format );
+        }
+      }
+      STAGE_LAP( STAGE_WRITE, lap );
+      if ( result == 1 ) {
+        dup_count++;
+      }
+      if ( ( line_count & ( PROGRESS_BATCH_LINES - 1 ) ) EQ 0 ) {
+        serial_progress( input_offset, line_count, dup_count );
+      }
+      lap = STAGE_BEGIN( line_count );
     }
     
     /* Cleanup regular bloom filter */
     bloom_free( &bf );
   }
 
+  if ( config->count_out != NULL ) {
+    count_table_emit( &tally, output_count_sink_line );
+  }
+  count_table_free( &tally );
+  validate_end();
+
+  serial_progress( input_offset, line_count, dup_count );
+  config->total_lines = line_count;
+  config->total_bytes = input_offset;
+  config->duplicate_lines = dup_count;
+  config->unique_lines = line_count - dup_count;
+
   /* close file */
   if ( inFile != stdin ) {
     fclose( inFile );
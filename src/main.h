@@ -34,6 +34,26 @@
 #define MODE_INTERACTIVE 1
 #define MODE_DEBUG 2
 
+/* Lines are keyed and printed up to this length, like fgets() into an 8k buffer */
+#define MAX_LINE_LEN (8192 - 1)
+
+/* Codes of options that only have a long form */
+#define OPT_UNIQUE_OUT 256
+#define OPT_DUP_OUT 257
+#define OPT_COUNT_OUT 258
+#define OPT_COMPRESS 259
+#define OPT_LATENCY_MS 260
+#define OPT_PERF_COUNTERS 261
+#define OPT_VALIDATE 262
+#define OPT_STATS_INTERVAL 263
+#define OPT_STATS_OUT 264
+#define OPT_TRACE 265
+#define OPT_POPULATE 266
+#define OPT_HUGE_PAGES 267
+
+/* Upper bound for --latency-ms */
+#define MAX_LATENCY_MS 60000
+
 /* arg len boundary */
 #define MAX_ARG_LEN 1024
 
@@ -78,8 +98,15 @@
 #include "bloom-filter.h"
 #include "dablooms.h"
 #include "parallel.h"
+#include "topology.h"
 #include "output.h"
+#include "compress.h"
+#include "count.h"
+#include "topk.h"
 #include "security.h"
+#include "validate.h"
+#include "trace.h"
+#include "probes.h"
 
 /****
  *
@@ -93,6 +120,14 @@
  *
  ****/
 
+/* Filter choice and sizing shared by the serial and parallel paths */
+typedef struct {
+  int use_scaling;           /* Use the dablooms scaling filter */
+  size_t entries;            /* Capacity of the regular filter */
+  unsigned int capacity;     /* Capacity of each scaling sub-filter */
+  double error_rate;         /* Error rate actually used */
+} filter_plan_t;
+
 /****
  *
  * function prototypes
@@ -102,5 +137,7 @@
 int main(int argc, char *argv[]);
 void show_info( void );
 int processFile( const char *fName );
+void plan_filter( const char *fName, size_t fSize, filter_plan_t *plan );
+void count_stream( FILE *inFile );
 
 #endif /* MAIN_DOT_H */
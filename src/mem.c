@@ -33,6 +33,8 @@
  ****/
 
 #include "mem.h"
+#include <pthread.h>
+#include <sys/mman.h>
 
 /****
  *
@@ -59,6 +61,15 @@ extern int quit;
  PRIVATE struct Mem_s *tail;
 #endif
 
+/* Accounted bytes per subsystem, MEM_TOTAL holds the sum */
+PRIVATE int large_populate = 0;    /* Threads prefaulting each mapping, 0 to fault lazily */
+PRIVATE int large_hugetlb = FALSE; /* Ask for reserved huge pages first */
+PRIVATE uint64_t mem_current_bytes[MEM_TOTAL + 1];
+PRIVATE uint64_t mem_peak_bytes[MEM_TOTAL + 1];
+PRIVATE const char *mem_names[MEM_TOTAL + 1] = {
+  "filter", "scaling", "input", "buffers", "pipeline", "counts", "topk", "validate", "trace", "total"
+};
+
 /****
  *
  * functions
@@ -1013,3 +1024,393 @@ char *xstrncpy_( char *d_ptr, const char *s_ptr, const size_t len, const char *f
   return result;
 }
 
+/****
+ *
+ * Raise a peak to at least value
+ *
+ ****/
+PRIVATE void raise_peak( uint64_t *peak, uint64_t value ) {
+  uint64_t seen = __atomic_load_n( peak, __ATOMIC_RELAXED );
+
+  while ( value > seen &&
+          !__atomic_compare_exchange_n( peak, &seen, value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+/****
+ *
+ * Record memory a subsystem allocated or released
+ *
+ * Subsystems call this where they allocate, grow or free their large
+ * buffers, so --stats can report where memory goes. Updates are
+ * relaxed atomics and safe from any thread.
+ *
+ * Arguments:
+ *   sys - Subsystem the memory belongs to
+ *   delta - Bytes allocated, negative when released
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void mem_account( mem_subsystem_t sys, int64_t delta ) {
+  uint64_t now = __atomic_add_fetch( &mem_current_bytes[sys], (uint64_t)delta, __ATOMIC_RELAXED );
+  uint64_t total = __atomic_add_fetch( &mem_current_bytes[MEM_TOTAL], (uint64_t)delta, __ATOMIC_RELAXED );
+
+  if ( delta > 0 ) {
+    raise_peak( &mem_peak_bytes[sys], now );
+    raise_peak( &mem_peak_bytes[MEM_TOTAL], total );
+  }
+}
+
+/****
+ *
+ * Bytes a subsystem holds now
+ *
+ * Arguments:
+ *   sys - Subsystem, or MEM_TOTAL for all of them
+ *
+ * Returns:
+ *   Accounted bytes currently allocated
+ *
+ ****/
+
+uint64_t mem_current( mem_subsystem_t sys ) {
+  return __atomic_load_n( &mem_current_bytes[sys], __ATOMIC_RELAXED );
+}
+
+/****
+ *
+ * Most bytes a subsystem held at once
+ *
+ * Arguments:
+ *   sys - Subsystem, or MEM_TOTAL for all of them
+ *
+ * Returns:
+ *   Peak accounted bytes
+ *
+ ****/
+
+uint64_t mem_peak( mem_subsystem_t sys ) {
+  return __atomic_load_n( &mem_peak_bytes[sys], __ATOMIC_RELAXED );
+}
+
+/****
+ *
+ * Short name of a subsystem for reports
+ *
+ * Arguments:
+ *   sys - Subsystem, or MEM_TOTAL
+ *
+ * Returns:
+ *   Static name string
+ *
+ ****/
+
+const char *mem_subsystem_name( mem_subsystem_t sys ) {
+  return mem_names[sys];
+}
+
+/****
+ *
+ * Set up an empty arena
+ *
+ * An arena hands out byte strings from large chunks and releases them
+ * all at once, so tables that copy a key per distinct line do one
+ * malloc() per chunk, not per key. An arena belongs to one thread or
+ * table and takes no lock.
+ *
+ * Arguments:
+ *   arena - Arena to initialize
+ *   chunk_size - Bytes per chunk, 0 for MEM_ARENA_CHUNK
+ *   sys - Subsystem the chunks are accounted to
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void mem_arena_init( mem_arena_t *arena, size_t chunk_size, mem_subsystem_t sys ) {
+  arena->chunks = NULL;
+  arena->chunk_size = ( chunk_size > 0 ) ? chunk_size : MEM_ARENA_CHUNK;
+  arena->sys = sys;
+}
+
+/****
+ *
+ * Take bytes from an arena
+ *
+ * The bytes are not aligned and live until mem_arena_free(). A request
+ * larger than the chunk size gets a chunk of its own.
+ *
+ * Arguments:
+ *   arena - Arena to allocate from
+ *   size - Number of bytes
+ *
+ * Returns:
+ *   Pointer to size bytes, exits when out of memory like XMALLOC
+ *
+ ****/
+
+char *mem_arena_alloc( mem_arena_t *arena, size_t size ) {
+  mem_arena_chunk_t *chunk = arena->chunks;
+  char *result;
+
+  if ( chunk EQ NULL || chunk->size - chunk->used < size ) {
+    size_t bytes = ( size > arena->chunk_size ) ? size : arena->chunk_size;
+
+    chunk = (mem_arena_chunk_t *)XMALLOC( sizeof( mem_arena_chunk_t ) + bytes );
+    chunk->size = bytes;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    mem_account( arena->sys, (int64_t)( sizeof( mem_arena_chunk_t ) + bytes ) );
+  }
+  result = chunk->data + chunk->used;
+  chunk->used += size;
+
+  return result;
+}
+
+/****
+ *
+ * Release everything allocated from an arena
+ *
+ * Arguments:
+ *   arena - Arena to empty, usable again afterwards
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void mem_arena_free( mem_arena_t *arena ) {
+  while ( arena->chunks != NULL ) {
+    mem_arena_chunk_t *next = arena->chunks->next;
+
+    mem_account( arena->sys, -(int64_t)( sizeof( mem_arena_chunk_t ) + arena->chunks->size ) );
+    XFREE( arena->chunks );
+    arena->chunks = next;
+  }
+}
+
+/****
+ *
+ * Choose how large allocations are backed
+ *
+ * Must be called before the first large allocation, mappings are
+ * released by their rounded length and that depends on hugetlb.
+ *
+ * Arguments:
+ *   populate_threads - Threads prefaulting each new mapping, 0 to fault lazily
+ *   hugetlb - TRUE to map reserved huge pages, falling back to normal pages
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void mem_large_setup( int populate_threads, int hugetlb ) {
+  large_populate = ( populate_threads > 0 ) ? populate_threads : 0;
+  large_hugetlb = hugetlb;
+}
+
+/****
+ *
+ * Length a large allocation is mapped with
+ *
+ ****/
+PRIVATE size_t large_length( size_t size ) {
+  size_t unit = large_hugetlb ? MEM_HUGE_PAGE : (size_t)sysconf( _SC_PAGESIZE );
+
+  return ( size + unit - 1 ) / unit * unit;
+}
+
+/* Slice of a mapping one populate thread faults in */
+typedef struct {
+  volatile char *start;
+  size_t len;
+  size_t page;
+} populate_slice_t;
+
+/****
+ *
+ * Fault in one slice by writing a zero to each page
+ *
+ ****/
+PRIVATE void *populate_slice( void *arg ) {
+  populate_slice_t *slice = (populate_slice_t *)arg;
+
+  for ( size_t off = 0; off < slice->len; off += slice->page ) {
+    slice->start[off] = 0;
+  }
+
+  return NULL;
+}
+
+/****
+ *
+ * Fault in a fresh mapping from several threads at once
+ *
+ * The pages are still zero, so writing zeros only makes the kernel
+ * back them now rather than on first use in the hot loop.
+ *
+ ****/
+PRIVATE void populate( char *ptr, size_t len ) {
+  int threads = large_populate;
+  size_t page = (size_t)sysconf( _SC_PAGESIZE );
+  populate_slice_t slices[threads];
+  pthread_t tids[threads];
+  size_t per;
+
+  if ( (size_t)threads > len / MEM_POPULATE_SLICE ) {
+    threads = (int)( len / MEM_POPULATE_SLICE );
+  }
+  if ( threads < 1 ) {
+    threads = 1;
+  }
+  per = ( len / (size_t)threads + page - 1 ) / page * page;
+
+  for ( int i = 0; i < threads; i++ ) {
+    size_t off = (size_t)i * per;
+
+    slices[i].start = ptr + off;
+    slices[i].len = ( off >= len ) ? 0 : ( ( len - off < per ) ? len - off : per );
+    slices[i].page = page;
+    /* The calling thread takes the first slice, and any a thread could not be started for */
+    if ( i EQ 0 || pthread_create( &tids[i], NULL, populate_slice, &slices[i] ) != 0 ) {
+      tids[i] = pthread_self();
+    }
+  }
+  for ( int i = 0; i < threads; i++ ) {
+    if ( pthread_equal( tids[i], pthread_self() ) ) {
+      populate_slice( &slices[i] );
+    }
+  }
+  for ( int i = 0; i < threads; i++ ) {
+    if ( !pthread_equal( tids[i], pthread_self() ) ) {
+      pthread_join( tids[i], NULL );
+    }
+  }
+}
+
+/****
+ *
+ * Allocate a large zeroed buffer
+ *
+ * Sizes of MEM_LARGE_MIN and up are anonymous mappings. Their pages are
+ * the kernel's shared zero page until first written, so a multi-GB
+ * filter costs nothing at startup and no page is touched twice. Large
+ * mappings are offered to transparent huge pages, which cuts the TLB
+ * misses of random filter probes. Smaller sizes fall back to XMALLOC.
+ *
+ * Arguments:
+ *   size - Number of bytes
+ *
+ * Returns:
+ *   Pointer to zeroed memory, exits when out of memory like XMALLOC
+ *
+ ****/
+
+void *mem_large_alloc( size_t size ) {
+  size_t len;
+  void *result = MAP_FAILED;
+
+  if ( size < MEM_LARGE_MIN ) {
+    return XMALLOC( size );
+  }
+  len = large_length( size );
+
+#ifdef MAP_HUGETLB
+  if ( large_hugetlb ) {
+    result = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+  }
+#endif
+  if ( result EQ MAP_FAILED ) {
+    result = mmap( NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( result EQ MAP_FAILED ) {
+      fprintf( stderr, "out of memory (%zu bytes mapped): %s\n", len, strerror( errno ) );
+      exit( 1 );
+    }
+#ifdef MADV_HUGEPAGE
+    if ( len >= MEM_HUGE_PAGE ) {
+      madvise( result, len, MADV_HUGEPAGE );
+    }
+#endif
+  }
+  if ( large_populate > 0 ) {
+    populate( (char *)result, len );
+  }
+
+  return result;
+}
+
+/****
+ *
+ * Grow or shrink a buffer from mem_large_alloc()
+ *
+ * Mappings are moved with mremap(), so growing copies no data, and
+ * with --populate the pages added are faulted in like a new mapping.
+ * Bytes past old_size are zero when the buffer is mapped, and undefined
+ * when both sizes are small, as with XREALLOC.
+ *
+ * Arguments:
+ *   ptr - Buffer to resize
+ *   old_size - Size it was allocated or last resized with
+ *   new_size - Size wanted
+ *
+ * Returns:
+ *   Pointer to the resized buffer, exits when out of memory
+ *
+ ****/
+
+void *mem_large_realloc( void *ptr, size_t old_size, size_t new_size ) {
+  void *result;
+
+  if ( old_size < MEM_LARGE_MIN && new_size < MEM_LARGE_MIN ) {
+    return XREALLOC( ptr, new_size );
+  }
+#ifdef MREMAP_MAYMOVE
+  if ( old_size >= MEM_LARGE_MIN && new_size >= MEM_LARGE_MIN ) {
+    size_t old_len = large_length( old_size );
+    size_t new_len = large_length( new_size );
+
+    result = mremap( ptr, old_len, new_len, MREMAP_MAYMOVE );
+    if ( result != MAP_FAILED ) {
+      /* Only the added pages are fresh zeros, the rest hold data */
+      if ( large_populate > 0 && new_len > old_len ) {
+        populate( (char *)result + old_len, new_len - old_len );
+      }
+      return result;
+    }
+  }
+#endif
+  result = mem_large_alloc( new_size );
+  memcpy( result, ptr, ( old_size < new_size ) ? old_size : new_size );
+  mem_large_free( ptr, old_size );
+
+  return result;
+}
+
+/****
+ *
+ * Release a buffer from mem_large_alloc()
+ *
+ * Arguments:
+ *   ptr - Buffer to release, NULL is ignored
+ *   size - Size it was allocated or last resized with
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+
+void mem_large_free( void *ptr, size_t size ) {
+  if ( ptr EQ NULL ) {
+    return;
+  }
+  if ( size < MEM_LARGE_MIN ) {
+    XFREE( ptr );
+  } else {
+    munmap( ptr, large_length( size ) );
+  }
+}
@@ -61,6 +61,32 @@
 #define MEM_D_STAT_CLEAN 1
 #define MEM_D_STAT_DE    2
 
+/* Subsystems whose memory is accounted for --stats */
+typedef enum {
+  MEM_FILTER = 0,            /* Bloom filter bit arrays */
+  MEM_SCALING,               /* Scaling filter mmap of its temporary file */
+  MEM_INPUT,                 /* Input file mapping of the parallel path */
+  MEM_BUFFERS,               /* Read, output, sink and compression buffers */
+  MEM_PIPELINE,              /* Parallel queues, blocks and worker scratch */
+  MEM_COUNTS,                /* Exact count tables */
+  MEM_TOPK,                  /* Heavy hitter summaries */
+  MEM_VALIDATE,              /* Exact set of --validate */
+  MEM_TRACE,                 /* Span buffers of --trace */
+  MEM_TOTAL                  /* All of the above, also the number of subsystems */
+} mem_subsystem_t;
+
+/* Chunk size of an arena initialized with 0 */
+#define MEM_ARENA_CHUNK (1024 * 1024)
+
+/* Allocations of this size and up are mapped, smaller ones use XMALLOC */
+#define MEM_LARGE_MIN (256 * 1024)
+
+/* Huge page size, mappings this large are offered to transparent huge pages */
+#define MEM_HUGE_PAGE (2 * 1024 * 1024)
+
+/* Least bytes each thread prefaults with --populate */
+#define MEM_POPULATE_SLICE (32 * 1024 * 1024)
+
 /****
  *
  * typedefs and structs
@@ -75,6 +101,21 @@ struct Mem_s {
   struct Mem_s *next;
 };
 
+/* One allocation of an arena, carved from the front */
+typedef struct mem_arena_chunk_s {
+  struct mem_arena_chunk_s *next;
+  size_t size;
+  size_t used;
+  char data[];
+} mem_arena_chunk_t;
+
+/* Bump allocator for byte strings, released only as a whole */
+typedef struct {
+  mem_arena_chunk_t *chunks;   /* Newest first, only the newest has room */
+  size_t chunk_size;
+  mem_subsystem_t sys;         /* Subsystem the chunks are accounted to */
+} mem_arena_t;
+
 /****
  *
  * function prototypes
@@ -92,5 +133,16 @@ char *xstrdup_( const char *str, const char *filename, const int linenumber );
 void xgrow_( void **old, int elementSize, int *oldCount, int newCount, char *filename, const int linenumber );
 char *xstrcpy_( char *d_ptr, const char *s_ptr, const char *filename, const int linenumber );
 char *xstrncpy_( char *d_ptr, const char *s_ptr, const size_t len, const char *filename, const int linenumber );
+void mem_account( mem_subsystem_t sys, int64_t delta );
+uint64_t mem_current( mem_subsystem_t sys );
+uint64_t mem_peak( mem_subsystem_t sys );
+const char *mem_subsystem_name( mem_subsystem_t sys );
+void mem_arena_init( mem_arena_t *arena, size_t chunk_size, mem_subsystem_t sys );
+char *mem_arena_alloc( mem_arena_t *arena, size_t size );
+void mem_arena_free( mem_arena_t *arena );
+void mem_large_setup( int populate_threads, int hugetlb );
+void *mem_large_alloc( size_t size );
+void *mem_large_realloc( void *ptr, size_t old_size, size_t new_size );
+void mem_large_free( void *ptr, size_t size );
 
 #endif /* end of UTIL_DOT_H */
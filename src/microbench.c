@@ -0,0 +1,509 @@
+/*****
+ *
+ * Description: Hash and Probe Kernel Microbenchmarks
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * Times the hash and filter kernels in isolation on one pinned thread.
+ * Hashing is measured per key length. Probes are measured on filters
+ * sized to fit L1, L2, the last level cache and DRAM, with keys half
+ * already present and half new, which is what a dedup run with a
+ * middling duplicate ratio sees. Every measurement is preceded by an
+ * untimed warmup batch.
+ *
+ ****/
+
+#include "bloom-filter.h"
+#include "dablooms.h"
+#include "topology.h"
+#include <pthread.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC 1
+#endif
+
+/* Globals the linked buniq objects refer to */
+int quit = FALSE;
+int reload = FALSE;
+Config_t *config = NULL;
+
+/* Operations timed per measurement */
+#define MICRO_OPS 2000000
+
+/* Most filter sizes and k values one run compares */
+#define MICRO_MAX_K 8
+
+/* Share of probes that may hit beyond the present half, false positives */
+#define MICRO_HIT_SLACK 0.05
+
+/* Highest cpu number a pin request may name, plus one */
+#ifdef CPU_SETSIZE
+# define MICRO_CPU_LIMIT CPU_SETSIZE
+#else
+# define MICRO_CPU_LIMIT TOPO_MAX_CPUS
+#endif
+
+/* Probe kernels */
+typedef enum {
+  KERNEL_HASHED = 0,         /* bloom_check_add_64_hashed, probe only */
+  KERNEL_64,                 /* bloom_check_add_64, hash and probe */
+  KERNEL_OPTIMIZED,          /* bloom_check_add_64_optimized */
+  KERNEL_ATOMIC,             /* bloom_check_add_64_atomic */
+  KERNEL_SCALING,            /* scaling_bloom_check_add */
+  KERNELS
+} kernel_t;
+
+PRIVATE const char *kernel_names[KERNELS] = { "hashed", "check_add_64", "optimized", "atomic", "scaling" };
+
+/* Filter size class */
+typedef struct {
+  const char *name;
+  size_t bytes;
+} size_class_t;
+
+PRIVATE volatile uint64_t sink;
+PRIVATE double tsc_per_ns;
+PRIVATE int json;
+PRIVATE int first_row = TRUE;
+
+/****
+ *
+ * Next value of a splitmix64 sequence
+ *
+ ****/
+PRIVATE inline uint64_t mix64(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/****
+ *
+ * Nanoseconds on the monotonic clock
+ *
+ ****/
+PRIVATE double now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/****
+ *
+ * Time stamp counter, or 0 where there is none
+ *
+ ****/
+PRIVATE inline uint64_t ticks(void) {
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/****
+ *
+ * Measure time stamp counter ticks per nanosecond
+ *
+ ****/
+PRIVATE void calibrate(void) {
+#ifdef HAVE_TSC
+  double start = now_ns();
+  uint64_t t0 = ticks();
+
+  while (now_ns() - start < 50e6);
+  tsc_per_ns = (double)(ticks() - t0) / (now_ns() - start);
+#else
+  tsc_per_ns = 0;
+#endif
+}
+
+/****
+ *
+ * Print one measurement
+ *
+ ****/
+PRIVATE void report(const char *kernel, const char *size, size_t bytes, int k, double ns, uint64_t ops) {
+  double per_op = ns / (double)ops;
+  double cycles = per_op * tsc_per_ns;
+
+  if (json) {
+    printf("%s    { \"kernel\": \"%s\", \"size\": \"%s\", \"bytes\": %lu, \"k\": %d, "
+           "\"ns_per_op\": %.2f, \"cycles_per_op\": %.1f, \"mops\": %.2f }",
+           first_row ? "" : ",\n", kernel, size, (unsigned long)bytes, k, per_op, cycles, 1e3 / per_op);
+    first_row = FALSE;
+  } else {
+    printf("%-13s %-5s %10lu %3d %9.2f %9.1f %9.2f\n", kernel, size, (unsigned long)bytes, k,
+           per_op, cycles, 1e3 / per_op);
+  }
+}
+
+/****
+ *
+ * Time MurmurHash3_x64_128 on keys of one length
+ *
+ ****/
+PRIVATE void bench_hash(const char *keys, size_t keys_size, int len) {
+  uint64_t hash[2];
+  uint64_t acc = 0;
+  size_t span = keys_size - (size_t)len;
+  double start;
+  char label[16];
+
+  /* Warmup, then the timed run over shifting offsets */
+  for (int i = 0; i < MICRO_OPS / 8; i++) {
+    MurmurHash3_x64_128(keys + ((size_t)i * 64) % span, len, BLOOM_HASH_SEED, hash);
+    acc += hash[0];
+  }
+  start = now_ns();
+  for (int i = 0; i < MICRO_OPS; i++) {
+    MurmurHash3_x64_128(keys + ((size_t)i * 64) % span, len, BLOOM_HASH_SEED, hash);
+    acc += hash[0];
+  }
+  sink = acc;
+
+  snprintf(label, sizeof(label), "%d", len);
+  report("murmur3_128", label, (size_t)len, 0, now_ns() - start, MICRO_OPS);
+}
+
+/****
+ *
+ * Key of one index, 16 bytes
+ *
+ ****/
+PRIVATE inline void make_key(uint64_t index, uint64_t key[2]) {
+  key[0] = mix64(index);
+  key[1] = mix64(key[0]);
+}
+
+/****
+ *
+ * Insert the keys of indexes 0 to count - 1 through the kernel's own
+ * path, so they are found again by it: the hashing kernels set the
+ * bits of the key's MurmurHash3, not of the raw key words
+ *
+ ****/
+PRIVATE void prefill(kernel_t kernel, struct bloom *bf, scaling_bloom_t *sbf, uint64_t count) {
+  uint64_t key[2];
+
+  for (uint64_t i = 0; i < count; i++) {
+    make_key(i, key);
+    switch (kernel) {
+      case KERNEL_HASHED:
+        bloom_check_add_64_hashed(bf, key[0], key[1]);
+        break;
+      case KERNEL_64:
+        bloom_check_add_64(bf, key, sizeof(key));
+        break;
+      case KERNEL_OPTIMIZED:
+        bloom_check_add_64_optimized(bf, key, sizeof(key));
+        break;
+      case KERNEL_ATOMIC:
+        bloom_check_add_64_atomic(bf, key, sizeof(key));
+        break;
+      case KERNEL_SCALING:
+      default:
+        scaling_bloom_check_add(sbf, (const char *)key, sizeof(key), i);
+        break;
+    }
+  }
+}
+
+/****
+ *
+ * Run count probes starting at fresh index next, half on present keys
+ *
+ ****/
+PRIVATE uint64_t run_probes(kernel_t kernel, struct bloom *bf, scaling_bloom_t *sbf,
+                            uint64_t present, uint64_t next, uint64_t count) {
+  uint64_t key[2] = { 0, 0 };
+  uint64_t hits = 0;
+
+  switch (kernel) {
+    case KERNEL_HASHED:
+      for (uint64_t i = 0; i < count; i++) {
+        make_key((i & 1) ? key[0] % present : next + i, key);
+        hits += bloom_check_add_64_hashed(bf, key[0], key[1]);
+      }
+      break;
+    case KERNEL_64:
+      for (uint64_t i = 0; i < count; i++) {
+        make_key((i & 1) ? key[0] % present : next + i, key);
+        hits += bloom_check_add_64(bf, key, sizeof(key));
+      }
+      break;
+    case KERNEL_OPTIMIZED:
+      for (uint64_t i = 0; i < count; i++) {
+        make_key((i & 1) ? key[0] % present : next + i, key);
+        hits += bloom_check_add_64_optimized(bf, key, sizeof(key));
+      }
+      break;
+    case KERNEL_ATOMIC:
+      for (uint64_t i = 0; i < count; i++) {
+        make_key((i & 1) ? key[0] % present : next + i, key);
+        hits += bloom_check_add_64_atomic(bf, key, sizeof(key));
+      }
+      break;
+    case KERNEL_SCALING:
+    default:
+      for (uint64_t i = 0; i < count; i++) {
+        make_key((i & 1) ? key[0] % present : next + i, key);
+        hits += (scaling_bloom_check_add(sbf, (const char *)key, sizeof(key), next + i) == 1);
+      }
+      break;
+  }
+
+  return hits;
+}
+
+/****
+ *
+ * Time one probe kernel on one filter size
+ *
+ * The filter is filled to a quarter of its capacity untimed, capped so
+ * DRAM sizes set up quickly, then timed in batches of at most another
+ * quarter of new keys so it never runs past its design load. Regular
+ * filters are cleared between batches, scaling filters are recreated.
+ * The timed probes must hit about half the time, or the present keys
+ * were not found and the run is rejected.
+ *
+ ****/
+PRIVATE int bench_probe(kernel_t kernel, const size_class_t *size, int k, const char *dir) {
+  struct bloom bf;
+  scaling_bloom_t *sbf = NULL;
+  char path[PATH_MAX];
+  /* Bits per entry at 1% is 9.59, scaling filters use 4 bit counters */
+  uint64_t capacity = (kernel == KERNEL_SCALING) ? (size->bytes * 2) / 10 : (size->bytes * 8) / 10;
+  uint64_t fill = (capacity / 4 > 2 * MICRO_OPS) ? 2 * MICRO_OPS : capacity / 4;
+  uint64_t batch = (capacity / 4 > MICRO_OPS) ? MICRO_OPS : capacity / 4;
+  uint64_t done = 0, next = fill;
+  uint64_t hits = 0;
+  double ns = 0;
+  double hit_rate;
+  int actual_k = k;
+  size_t bytes = 0;
+
+  if (fill < 16) {
+    fprintf(stderr, "ERR - Unable to set up a %s filter of %lu bytes\n", size->name, (unsigned long)size->bytes);
+    return FAILED;
+  }
+  memset(&bf, 0, sizeof(bf));
+  snprintf(path, sizeof(path), "%s/buniq-microbench-%d.bf", dir, (int)getpid());
+
+  if (kernel != KERNEL_SCALING) {
+    if (bloom_init_64(&bf, capacity, 0.01) != 0) {
+      fprintf(stderr, "ERR - Unable to set up a %s filter of %lu bytes\n", size->name, (unsigned long)size->bytes);
+      return FAILED;
+    }
+    bf.hashes = k;
+    bytes = bf.bytes;
+  }
+
+  /* One untimed batch warms the code and the filter, the rest are timed */
+  for (int warm = 1; done < MICRO_OPS; warm = 0) {
+    double start;
+
+    if (kernel == KERNEL_SCALING) {
+      if (sbf != NULL) free_scaling_bloom(sbf);
+      if ((sbf = new_scaling_bloom((unsigned int)capacity, 0.01, path)) == NULL) {
+        fprintf(stderr, "ERR - Unable to set up a %s filter of %lu bytes\n", size->name, (unsigned long)size->bytes);
+        unlink(path);
+        return FAILED;
+      }
+      actual_k = (int)sbf->blooms[0]->nfuncs;
+      bytes = sbf->num_bytes;
+    } else {
+      bloom_reset(&bf);
+    }
+    prefill(kernel, &bf, sbf, fill);
+
+    start = now_ns();
+    sink = run_probes(kernel, &bf, sbf, fill, next, batch);
+    if (!warm) {
+      ns += now_ns() - start;
+      done += batch;
+      hits += sink;
+    }
+    next += batch;
+  }
+
+  if (sbf != NULL) free_scaling_bloom(sbf);
+  unlink(path);
+  if (kernel != KERNEL_SCALING) bloom_free(&bf);
+
+  /* Odd probes are present keys, even ones new */
+  hit_rate = (double)hits / (double)done;
+  if (hit_rate < 0.5 || hit_rate > 0.5 + MICRO_HIT_SLACK) {
+    fprintf(stderr, "ERR - %s on %s hit %.1f%% of probes, not half\n", kernel_names[kernel], size->name, hit_rate * 100);
+    return FAILED;
+  }
+
+  report(kernel_names[kernel], size->name, bytes, actual_k, ns, done);
+  return TRUE;
+}
+
+/****
+ *
+ * Cache size from sysconf, or a fallback
+ *
+ ****/
+PRIVATE size_t cache_size(int level) {
+  long size = -1;
+
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+  size = sysconf((level == 1) ? _SC_LEVEL1_DCACHE_SIZE : (level == 2) ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+#endif
+  if (size > 0) return (size_t)size;
+
+  return (level == 1) ? 32 * 1024 : (level == 2) ? 1024 * 1024 : 32 * 1024 * 1024;
+}
+
+/****
+ *
+ * Print the usage text
+ *
+ ****/
+PRIVATE void print_usage(void) {
+  fprintf(stderr, "syntax: buniq-microbench [options]\n\n");
+  fprintf(stderr, " -c (cpu)       pin to this cpu [default: 0, -1 to leave unpinned]\n");
+  fprintf(stderr, " -k (list)      hash function counts to probe with [default: 3,7,10]\n");
+  fprintf(stderr, " -m (MB)        DRAM filter size [default: 8x the last level cache]\n");
+  fprintf(stderr, " -o (dir)       directory for scaling filter files [default: /tmp]\n");
+  fprintf(stderr, " -f (type)      report format: text, json [default: text]\n");
+  fprintf(stderr, " -q             skip the DRAM size\n");
+  fprintf(stderr, " -h             this info\n");
+}
+
+/****
+ *
+ * Main function
+ *
+ ****/
+int main(int argc, char *argv[]) {
+  static const int key_lens[] = { 8, 16, 32, 64, 128, 256, 1024 };
+  size_class_t sizes[4];
+  int ks[MICRO_MAX_K] = { 3, 7, 10 };
+  int num_k = 3;
+  int num_sizes = 4;
+  int cpu = 0;
+  const char *dir = "/tmp";
+  char *keys;
+  size_t keys_size = 64 * 1024;
+  size_t dram = 0;
+  int status = EXIT_SUCCESS;
+  int pinned = FALSE;
+  int c;
+
+  while ((c = getopt(argc, argv, "c:k:m:o:f:qh")) != -1) {
+    switch (c) {
+      case 'c':
+        if ((cpu = atoi(optarg)) < -1 || cpu >= MICRO_CPU_LIMIT) {
+          fprintf(stderr, "ERR - cpu must be between -1 and %d\n", MICRO_CPU_LIMIT - 1);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'm': dram = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+      case 'o': dir = optarg; break;
+      case 'q': num_sizes = 3; break;
+      case 'k': {
+        char *save = NULL;
+        num_k = 0;
+        for (char *tok = strtok_r(optarg, ",", &save); tok != NULL && num_k < MICRO_MAX_K; tok = strtok_r(NULL, ",", &save)) {
+          if ((ks[num_k] = atoi(tok)) < 1 || ks[num_k] > 32) {
+            fprintf(stderr, "ERR - k must be between 1 and 32\n");
+            return EXIT_FAILURE;
+          }
+          num_k++;
+        }
+        if (num_k == 0) return EXIT_FAILURE;
+        break;
+      }
+      case 'f':
+        json = (strcmp(optarg, "json") == 0);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  /* topology_pin_thread() succeeds without pinning for -1 */
+  if (cpu >= 0) {
+    if (topology_pin_thread(pthread_self(), cpu) == TRUE) {
+      pinned = TRUE;
+    } else {
+      fprintf(stderr, "WARN - Unable to pin to cpu %d, timings may be noisy\n", cpu);
+    }
+  }
+  calibrate();
+
+  /* Half of each cache level, so the filter and the code both fit */
+  sizes[0].name = "L1";
+  sizes[0].bytes = cache_size(1) / 2;
+  sizes[1].name = "L2";
+  sizes[1].bytes = cache_size(2) / 2;
+  sizes[2].name = "LLC";
+  sizes[2].bytes = cache_size(3) / 2;
+  sizes[3].name = "DRAM";
+  sizes[3].bytes = (dram > 0) ? dram : cache_size(3) * 8;
+
+  if (json) {
+    printf("{\n  \"cpu\": %d,\n  \"tsc_per_ns\": %.3f,\n  \"results\": [\n", pinned ? cpu : -1, tsc_per_ns);
+  } else {
+    if (pinned) {
+      printf("Pinned to cpu %d, time stamp counter at %.2f GHz\n\n", cpu, tsc_per_ns);
+    } else {
+      printf("Not pinned, time stamp counter at %.2f GHz\n\n", tsc_per_ns);
+    }
+    printf("%-13s %-5s %10s %3s %9s %9s %9s\n", "kernel", "size", "bytes", "k", "ns/op", "cycles", "Mops/s");
+  }
+
+  keys = (char *)XMALLOC(keys_size);
+  for (size_t i = 0; i < keys_size; i += 8) {
+    uint64_t v = mix64(i);
+    memcpy(keys + i, &v, 8);
+  }
+  for (size_t i = 0; i < sizeof(key_lens) / sizeof(key_lens[0]); i++) {
+    bench_hash(keys, keys_size, key_lens[i]);
+  }
+  XFREE(keys);
+
+  for (int s = 0; s < num_sizes; s++) {
+    for (int kern = 0; kern < KERNELS; kern++) {
+      if (kern == KERNEL_SCALING) {
+        /* Scaling filters take k from their error rate */
+        if (bench_probe(kern, &sizes[s], 0, dir) != TRUE) status = EXIT_FAILURE;
+        continue;
+      }
+      for (int i = 0; i < num_k; i++) {
+        if (bench_probe(kern, &sizes[s], ks[i], dir) != TRUE) status = EXIT_FAILURE;
+      }
+    }
+  }
+
+  if (json) printf("\n  ]\n}\n");
+
+  return status;
+}
@@ -29,40 +29,142 @@
 
 #include "../include/sysdep.h"
 #include "../include/common.h"
+#include "topk.h"
+#include "sink.h"
+#include "zcopy.h"
+#include "mem.h"
+#include "stage.h"
+#include "perf.h"
+#include "validate.h"
 #include <time.h>
 #include <sys/time.h>
 
-/* Progress bar structure */
+/* Selected line recorded by position for the index output modes */
 typedef struct {
-  uint64_t total;
-  uint64_t current;
-  time_t start_time;
+  uint64_t line;             /* Line number, 1 for the first line */
+  uint64_t offset;           /* Byte offset of the line */
+  uint64_t len;              /* Length of the whole line without its newline */
+} index_entry_t;
+
+/* Most bytes output_encode_line() produces for a line of len bytes */
+#define OUTPUT_ENCODED_MAX(len) ((len) * 6 + 64)
+
+/* Progress bar redraw period, 2 Hz */
+#define PROGRESS_INTERVAL_MS 500
+
+/* Progress bar width in characters */
+#define PROGRESS_WIDTH 30
+
+/* Serial loops report progress every this many lines, a power of two */
+#define PROGRESS_BATCH_LINES 8192
+
+/* Longest --stats-interval, one day */
+#define MAX_STATS_INTERVAL 86400
+
+/* Progress bar and stats records fed by relaxed atomic counters */
+typedef struct {
+  uint64_t total;            /* Input bytes, 0 when unknown */
+  uint64_t bytes;            /* Input bytes consumed */
+  uint64_t lines;
+  uint64_t uniques;
+  uint64_t filter_bits;      /* Bits of a regular filter, 0 for the scaling filter */
+  uint64_t filter_capacity;  /* Lines the filter, or one scaling sub-filter, is sized for */
+  int filter_hashes;
+  struct timeval start;
+  struct timeval last;       /* Time of the last stats record */
+  uint64_t last_lines;       /* Lines at the last stats record */
   int width;
-  int last_percent;
+  int draw;                  /* Draw the -p bar, counters alone otherwise */
+  int running;               /* Under mutex */
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
 } progress_bar_t;
 
+/* Stage balance reported by the parallel pipeline's concurrency controller */
+typedef struct {
+  int hashers;               /* Hasher threads started, 0 for serial runs */
+  int active_min;            /* Fewest hashers active during any epoch */
+  int active_max;            /* Most hashers active during any epoch */
+  int active_final;          /* Hashers active when the input ran out */
+  uint64_t epochs;           /* Controller sampling periods */
+  uint64_t grown;            /* Epochs that woke a hasher */
+  uint64_t shrunk;           /* Epochs that parked a hasher */
+  double reader_stall;       /* Seconds the reader waited for a free block */
+  double hasher_idle;        /* Seconds active hashers waited for input, summed */
+  double writer_stall;       /* Seconds the writer waited for hashed blocks */
+  double filter_wait;        /* Seconds hashers queued on the scaling filter lock, summed */
+  double queue_fill;         /* Average fraction of blocks queued for hashers */
+} pipeline_stats_t;
+
+/* Accuracy of the --top report */
+typedef struct {
+  int k;                     /* Results wanted, 0 when --top is off */
+  int counters;              /* Counters the summary monitored */
+  uint64_t stream_length;    /* Lines summarized */
+  uint64_t error_bound;      /* Most any reported count can be high by */
+  uint64_t max_error;        /* Largest error of a reported line */
+  int guaranteed;            /* Leading results certainly among the K most frequent */
+} top_stats_t;
+
+/* Accounted memory per subsystem, indexed by mem_subsystem_t */
+typedef struct {
+  uint64_t peak[MEM_TOTAL + 1];
+  uint64_t current[MEM_TOTAL + 1];
+  uint64_t maxrss;           /* Resident set high-water mark from the kernel */
+} memory_stats_t;
+
 /* Statistics structure */
 typedef struct {
   uint64_t total_lines;
   uint64_t unique_lines;
   uint64_t duplicate_lines;
+  uint64_t total_bytes;
   double processing_time;
   size_t memory_used;
   double throughput;
   double false_positive_rate;
+  memory_stats_t memory;
+  stage_stats_t stages;
+  perf_stats_t perf;
+  validate_stats_t validation;
+  pipeline_stats_t pipeline;
+  top_stats_t top;
 } stats_t;
 
 /* Function prototypes */
-void output_line(const char *line, int count, output_format_t format);
+void output_line(const char *line, size_t len, uint64_t count, output_format_t format);
+size_t output_encode_line(char *dst, const char *line, size_t len, uint64_t count, output_format_t format);
+void output_write_encoded(const char *buf, size_t len, output_format_t format);
+void output_index(uint64_t line, uint64_t offset, uint64_t len);
+void output_counted_line(const char *line, size_t len, uint64_t count);
+int output_open_sinks(void);
+int output_close_sinks(void);
+int output_split(const char *buf, size_t len, int repeat);
+void output_count_sink_line(const char *line, size_t len, uint64_t count);
+int output_start_flusher(int period_ms);
+void output_stop_flusher(void);
+void output_raw_line(const char *line, size_t len, output_format_t format);
 void output_header(output_format_t format);
 void output_footer(output_format_t format);
+void output_top(const topk_t *top, output_format_t format, top_stats_t *tstats);
+void output_end(output_format_t format);
 void output_stats(const stats_t *stats, output_format_t format);
 
 /* Progress bar functions */
 progress_bar_t *create_progress_bar(uint64_t total, int width);
-void update_progress_bar(progress_bar_t *bar, uint64_t current);
+void update_progress_bar(progress_bar_t *bar);
 void finish_progress_bar(progress_bar_t *bar);
 void destroy_progress_bar(progress_bar_t *bar);
+int progress_start(uint64_t total, int draw);
+void progress_add(uint64_t bytes, uint64_t lines, uint64_t uniques);
+void progress_filter(uint64_t bits, int hashes, uint64_t capacity);
+void progress_stop(void);
+
+/* Stats record stream of --stats-interval and SIGUSR1 */
+int stats_stream_open(const char *target);
+void stats_record(const char *kind);
+void stats_stream_close(void);
 
 /* Statistics functions */
 void init_stats(stats_t *stats);
@@ -71,16 +173,14 @@ void finalize_stats(stats_t *stats, double processing_time, size_t memory_used);
 
 /* JSON output functions */
 void output_json_start(void);
-void output_json_line(const char *line, int count, int is_last);
 void output_json_end(const stats_t *stats);
 
 /* CSV output functions */
 void output_csv_header(void);
-void output_csv_line(const char *line, int count, int line_num);
 
 /* Utility functions */
-char *escape_json_string(const char *str);
-char *escape_csv_string(const char *str);
+size_t json_escape(char *dst, const char *src, size_t len);
+size_t csv_escape(char *dst, const char *src, size_t len);
 double get_time_diff(struct timeval *start, struct timeval *end);
 
 #endif /* OUTPUT_DOT_H */
\ No newline at end of file
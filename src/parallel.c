@@ -20,60 +20,135 @@
  *
  ****/
 
+/* memrchr() and F_SETPIPE_SZ need this before any system header */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <poll.h>
+
 #include "parallel.h"
 #include "main.h"
 
 extern Config_t *config;
+extern topk_t *heavy_hitters;
+
+/****
+ *
+ * Monotonic clock in nanoseconds for stall accounting
+ *
+ ****/
+PRIVATE uint64_t now_ns(void) {
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/****
+ *
+ * Charge a wait that began at start to --stats, --trace and the probe
+ *
+ ****/
+PRIVATE void queue_waited(const char *what, uint64_t start) {
+  USDT2(queue__wait, what, now_ns() - start);
+  stage_wait(what, stage_on ? start : 0);
+}
+
+/****
+ *
+ * Lock the work queue, timing the wait only when it is contended
+ *
+ * The uncontended path costs one trylock, so convoys on the queue
+ * show up in --stats and --trace without slowing untimed runs.
+ *
+ ****/
+PRIVATE void lock_queue(thread_pool_t *pool) {
+  if (pthread_mutex_trylock(&pool->queue_mutex) != 0) {
+    uint64_t start = now_ns();
+    pthread_mutex_lock(&pool->queue_mutex);
+    queue_waited("lock queue", start);
+  }
+}
+
+PRIVATE void controller_tick(thread_pool_t *pool);
 
 /****
  *
  * Create and initialize a thread pool for parallel processing
  *
  * Creates a thread pool with the specified number of worker threads and
- * work queue size. Initializes synchronization primitives, work queue,
- * result storage, and spawns worker threads.
+ * a fixed set of blocks that circulate between the reader, the workers
+ * and the writer. Initializes synchronization primitives and spawns
+ * worker threads pinned according to the placement plan.
  *
  * Arguments:
  *   num_threads - Number of worker threads to create
- *   queue_size - Maximum size of the work queue
+ *   num_blocks - Number of input blocks in flight
+ *   placement - CPU placement for the workers, NULL to leave them unpinned
  *
  * Returns:
  *   Pointer to initialized thread_pool_t structure on success, NULL on error
  *
  ****/
-thread_pool_t *create_thread_pool(int num_threads, int queue_size) {
+thread_pool_t *create_thread_pool(int num_threads, int num_blocks, thread_placement_t *placement) {
   thread_pool_t *pool = (thread_pool_t *)XMALLOC(sizeof(thread_pool_t));
   if (pool == NULL) return NULL;
   
   pool->num_threads = num_threads;
-  pool->queue_size = queue_size;
+  pool->active_hashers = num_threads;
   pool->shutdown = 0;
+  pool->placement = placement;
+  pool->block_size = PARALLEL_BLOCK_SIZE;
+  pool->input_fd = -1;
   
-  /* Initialize work queue */
-  pool->work_queue = (char **)XMALLOC(queue_size * sizeof(char *));
+  /* Initialize work queue, sized so submitting never blocks */
+  pool->queue_size = num_blocks;
+  pool->work_queue = (work_block_t **)XMALLOC(num_blocks * sizeof(work_block_t *));
   pool->queue_front = 0;
   pool->queue_rear = 0;
   pool->queue_count = 0;
   
-  /* Initialize results */
-  pool->results = (char **)XMALLOC(queue_size * sizeof(char *));
-  pool->result_counts = (int *)XMALLOC(queue_size * sizeof(int));
-  pool->result_size = queue_size;
-  pool->result_count = 0;
+  /* Initialize blocks, all start on the free list */
+  pool->num_blocks = num_blocks;
+  pool->blocks = (work_block_t *)XMALLOC(num_blocks * sizeof(work_block_t));
+  pool->pending = (work_block_t **)XMALLOC(num_blocks * sizeof(work_block_t *));
+  mem_account(MEM_PIPELINE, (int64_t)(num_blocks * (sizeof(work_block_t) + 2 * sizeof(work_block_t *))));
+  pool->free_blocks = NULL;
+  for (int i = num_blocks - 1; i >= 0; i--) {
+    pool->blocks[i].next = pool->free_blocks;
+    pool->free_blocks = &pool->blocks[i];
+  }
   
   /* Initialize synchronization */
   pthread_mutex_init(&pool->queue_mutex, NULL);
   pthread_cond_init(&pool->queue_not_empty, NULL);
   pthread_cond_init(&pool->queue_not_full, NULL);
   pthread_mutex_init(&pool->result_mutex, NULL);
+  pthread_cond_init(&pool->result_ready, NULL);
+  pthread_cond_init(&pool->block_free, NULL);
+  pthread_mutex_init(&pool->filter_mutex, NULL);
   
   /* Create threads */
   pool->threads = (pthread_t *)XMALLOC(num_threads * sizeof(pthread_t));
+  pool->workers = (worker_ctx_t *)XMALLOC(num_threads * sizeof(worker_ctx_t));
   for (int i = 0; i < num_threads; i++) {
-    if (pthread_create(&pool->threads[i], NULL, worker_thread, pool) != 0) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].id = i;
+    count_table_init(&pool->workers[i].counts);
+    if (config->top_k > 0) topk_init(&pool->workers[i].top, config->top_k);
+    if (pthread_create(&pool->threads[i], NULL, worker_thread, &pool->workers[i]) != 0) {
+      pool->num_threads = i;
       destroy_thread_pool(pool);
       return NULL;
     }
+    if (placement != NULL && i < placement->num_hashers &&
+        topology_pin_thread(pool->threads[i], placement->hasher_cpus[i]) != TRUE &&
+        config->debug > 0) {
+      fprintf(stderr, "WARN - Unable to pin hasher %d to cpu %d\n", i, placement->hasher_cpus[i]);
+    }
   }
   
   return pool;
@@ -84,7 +159,8 @@ thread_pool_t *create_thread_pool(int num_threads, int queue_size) {
  * Destroy a thread pool and clean up all resources
  *
  * Signals shutdown to all worker threads, waits for them to complete,
- * destroys synchronization primitives, and frees all allocated memory.
+ * destroys synchronization primitives, and frees all allocated memory
+ * including block buffers.
  *
  * Arguments:
  *   pool - Pointer to thread pool structure to destroy
@@ -102,6 +178,10 @@ void destroy_thread_pool(thread_pool_t *pool) {
   pthread_cond_broadcast(&pool->queue_not_empty);
   pthread_mutex_unlock(&pool->queue_mutex);
   
+  pthread_mutex_lock(&pool->result_mutex);
+  pthread_cond_broadcast(&pool->block_free);
+  pthread_mutex_unlock(&pool->result_mutex);
+  
   /* Wait for threads to finish */
   for (int i = 0; i < pool->num_threads; i++) {
     pthread_join(pool->threads[i], NULL);
@@ -112,37 +192,138 @@ void destroy_thread_pool(thread_pool_t *pool) {
   pthread_cond_destroy(&pool->queue_not_empty);
   pthread_cond_destroy(&pool->queue_not_full);
   pthread_mutex_destroy(&pool->result_mutex);
+  pthread_cond_destroy(&pool->result_ready);
+  pthread_cond_destroy(&pool->block_free);
+  pthread_mutex_destroy(&pool->filter_mutex);
+  
+  for (int i = 0; i < pool->num_blocks; i++) {
+    work_block_t *block = &pool->blocks[i];
+    mem_account(MEM_PIPELINE, -(int64_t)(block->buf_size + block->out.size + block->split[0].size + block->split[1].size +
+                                         block->verdict_size + block->cands_size * sizeof(candidate_t)));
+    mem_large_free(pool->blocks[i].buf, pool->blocks[i].buf_size);
+    mem_large_free(pool->blocks[i].out.data, pool->blocks[i].out.size);
+    mem_large_free(pool->blocks[i].split[0].data, pool->blocks[i].split[0].size);
+    mem_large_free(pool->blocks[i].split[1].data, pool->blocks[i].split[1].size);
+    if (pool->blocks[i].verdict != NULL) XFREE(pool->blocks[i].verdict);
+    if (pool->blocks[i].cands != NULL) XFREE(pool->blocks[i].cands);
+  }
+  for (int i = 0; i < pool->num_threads; i++) {
+    count_table_free(&pool->workers[i].counts);
+    topk_free(&pool->workers[i].top);
+    mem_account(MEM_PIPELINE, -(int64_t)(pool->workers[i].scratch.cands_size * sizeof(candidate_t) +
+                                         pool->workers[i].scratch.table_size * sizeof(uint32_t)));
+    if (pool->workers[i].scratch.cands != NULL) XFREE(pool->workers[i].scratch.cands);
+    if (pool->workers[i].scratch.table != NULL) XFREE(pool->workers[i].scratch.table);
+  }
   
   XFREE(pool->threads);
+  XFREE(pool->workers);
   XFREE(pool->work_queue);
-  XFREE(pool->results);
-  XFREE(pool->result_counts);
+  XFREE(pool->blocks);
+  XFREE(pool->pending);
+  mem_account(MEM_PIPELINE, -(int64_t)(pool->num_blocks * (sizeof(work_block_t) + 2 * sizeof(work_block_t *))));
   XFREE(pool);
 }
 
 /****
  *
- * Submit a work item to the thread pool queue
+ * Take a free block from the pool
+ *
+ * Blocks until the writer hands a block back, which is what throttles
+ * the reader when hashing or output falls behind.
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *
+ * Returns:
+ *   Pointer to a free block, NULL if the pool is shutting down
+ *
+ ****/
+work_block_t *acquire_block(thread_pool_t *pool) {
+  work_block_t *block;
+  
+  pthread_mutex_lock(&pool->result_mutex);
+  if (pool->free_blocks == NULL && !pool->shutdown) {
+    uint64_t start = now_ns();
+    while (pool->free_blocks == NULL && !pool->shutdown) {
+      pthread_cond_wait(&pool->block_free, &pool->result_mutex);
+    }
+    pool->reader_stall_ns += now_ns() - start;
+    queue_waited("wait free block", start);
+  }
+  block = pool->free_blocks;
+  if (block != NULL) {
+    pool->free_blocks = block->next;
+    block->next = NULL;
+  }
+  pthread_mutex_unlock(&pool->result_mutex);
+  
+  return block;
+}
+
+/****
+ *
+ * Return a block to the free list
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *   block - Block to recycle, its buffers are kept for reuse
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void release_block(thread_pool_t *pool, work_block_t *block) {
+  pthread_mutex_lock(&pool->result_mutex);
+  if (pool->pending[block->seq % pool->num_blocks] == block) {
+    pool->pending[block->seq % pool->num_blocks] = NULL;
+  }
+  block->done = 0;
+  block->data = NULL;
+  block->len = 0;
+  block->out.len = 0;
+  block->split[0].len = 0;
+  block->split[1].len = 0;
+  block->lines = 0;
+  block->emitted = 0;
+  block->next = pool->free_blocks;
+  pool->free_blocks = block;
+  pthread_cond_signal(&pool->block_free);
+  pthread_mutex_unlock(&pool->result_mutex);
+}
+
+/****
+ *
+ * Submit a filled block to the thread pool queue
  *
- * Adds a line of text to the work queue for processing by worker threads.
- * Blocks if the queue is full until space becomes available.
+ * Assigns the block its sequence number, registers it for in-order
+ * output and queues it for the workers.
  *
  * Arguments:
  *   pool - Pointer to thread pool structure
- *   line - Text line to be processed
- *   line_len - Length of the line (currently unused)
- *   line_num - Line number for tracking (currently unused)
+ *   block - Block holding whole lines
  *
  * Returns:
  *   0 on success, -1 if pool is shutting down
  *
  ****/
-int submit_work(thread_pool_t *pool, const char *line, int line_len __attribute__((unused)), int line_num __attribute__((unused))) {
-  pthread_mutex_lock(&pool->queue_mutex);
+int submit_block(thread_pool_t *pool, work_block_t *block) {
+  pthread_mutex_lock(&pool->result_mutex);
+  block->seq = pool->blocks_submitted++;
+  block->done = 0;
+  pool->pending[block->seq % pool->num_blocks] = block;
+  pthread_mutex_unlock(&pool->result_mutex);
+  USDT3(chunk__read, block->seq, block->data, block->len);
+  
+  lock_queue(pool);
   
   /* Wait for space in queue */
-  while (pool->queue_count == pool->queue_size && !pool->shutdown) {
-    pthread_cond_wait(&pool->queue_not_full, &pool->queue_mutex);
+  if (pool->queue_count == pool->queue_size && !pool->shutdown) {
+    uint64_t start = now_ns();
+    while (pool->queue_count == pool->queue_size && !pool->shutdown) {
+      pthread_cond_wait(&pool->queue_not_full, &pool->queue_mutex);
+    }
+    queue_waited("wait queue space", start);
   }
   
   if (pool->shutdown) {
@@ -151,16 +332,95 @@ int submit_work(thread_pool_t *pool, const char *line, int line_len __attribute_
   }
   
   /* Add work to queue */
-  pool->work_queue[pool->queue_rear] = strdup(line);
+  pool->work_queue[pool->queue_rear] = block;
   pool->queue_rear = (pool->queue_rear + 1) % pool->queue_size;
   pool->queue_count++;
+  pool->fill_sum += pool->queue_count;
+  pool->fill_samples++;
   
-  pthread_cond_signal(&pool->queue_not_empty);
+  progress_add(block->len, 0, 0);
+  
+  /* A signal could wake a parked hasher that goes straight back to sleep */
+  if (pool->active_hashers < pool->num_threads) {
+    pthread_cond_broadcast(&pool->queue_not_empty);
+  } else {
+    pthread_cond_signal(&pool->queue_not_empty);
+  }
   pthread_mutex_unlock(&pool->queue_mutex);
   
   return 0;
 }
 
+/****
+ *
+ * Check whether the block with the given sequence number is finished
+ *
+ ****/
+PRIVATE int result_ready(thread_pool_t *pool, uint64_t seq) {
+  work_block_t *slot;
+  int ready;
+  
+  pthread_mutex_lock(&pool->result_mutex);
+  slot = pool->pending[seq % pool->num_blocks];
+  ready = (slot != NULL && slot->seq == seq && slot->done) ||
+          (pool->reader_done && seq >= pool->blocks_submitted);
+  pthread_mutex_unlock(&pool->result_mutex);
+  
+  return ready;
+}
+
+/****
+ *
+ * Wait for the block with the given sequence number to be processed
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *   seq - Sequence number of the next block to write
+ *
+ * Returns:
+ *   The finished block, NULL once the reader is done and all blocks are written
+ *
+ ****/
+work_block_t *next_result(thread_pool_t *pool, uint64_t seq) {
+  work_block_t *block = NULL;
+  uint64_t start = 0;
+  
+  pthread_mutex_lock(&pool->result_mutex);
+  for (;;) {
+    work_block_t *slot = pool->pending[seq % pool->num_blocks];
+    if (slot != NULL && slot->seq == seq && slot->done) {
+      block = slot;
+      break;
+    }
+    if (pool->reader_done && seq >= pool->blocks_submitted) {
+      break;
+    }
+    if (start == 0) start = now_ns();
+    if (pool->ctl.stats == NULL) {
+      pthread_cond_wait(&pool->result_ready, &pool->result_mutex);
+    } else {
+      /* Keep the controller sampling while the writer waits */
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += PARALLEL_EPOCH_NS;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      if (pthread_cond_timedwait(&pool->result_ready, &pool->result_mutex, &deadline) == ETIMEDOUT) {
+        pthread_mutex_unlock(&pool->result_mutex);
+        controller_tick(pool);
+        pthread_mutex_lock(&pool->result_mutex);
+      }
+    }
+  }
+  if (start != 0) {
+    pool->writer_stall_ns += now_ns() - start;
+    queue_waited("wait result", start);
+  }
+  pthread_mutex_unlock(&pool->result_mutex);
+  
+  return block;
+}
+
 /****
  *
  * Set the bloom filter for duplicate detection in the thread pool
@@ -184,182 +444,1244 @@ void set_bloom_filter(thread_pool_t *pool, void *bloom_filter, bloom_type_t type
 
 /****
  *
- * Worker thread function for processing work items
- *
- * Main loop for worker threads that processes lines from the work queue.
- * Checks for duplicates using the configured bloom filter and stores
- * results for output.
+ * Check a line against the shared filter and add it if new
  *
  * Arguments:
- *   arg - Pointer to thread pool structure cast as void*
+ *   pool - Pointer to thread pool structure
+ *   line - Line including its newline
+ *   line_len - Length of the line
+ *   lap - Stage lap of a sampled line, hashing and probing are timed apart
  *
  * Returns:
- *   NULL when thread exits
+ *   1 if the line was seen before, 0 if it is new
  *
  ****/
-void *worker_thread(void *arg) {
-  thread_pool_t *pool = (thread_pool_t *)arg;
+PRIVATE int filter_check_add(thread_pool_t *pool, const char *line, size_t line_len, uint64_t *lap) {
+  int is_duplicate = 0;
   
-  while (1) {
-    pthread_mutex_lock(&pool->queue_mutex);
-    
-    /* Wait for work */
-    while (pool->queue_count == 0 && !pool->shutdown) {
-      pthread_cond_wait(&pool->queue_not_empty, &pool->queue_mutex);
-    }
-    
-    if (pool->shutdown && pool->queue_count == 0) {
-      pthread_mutex_unlock(&pool->queue_mutex);
-      break;
-    }
-    
-    /* Get work item */
-    char *line = pool->work_queue[pool->queue_front];
-    pool->queue_front = (pool->queue_front + 1) % pool->queue_size;
-    pool->queue_count--;
-    
-    pthread_cond_signal(&pool->queue_not_full);
-    pthread_mutex_unlock(&pool->queue_mutex);
-    
-    /* Process the line */
-    int is_duplicate = 0;
-    int count = 0;
-    size_t line_len = strlen(line);
-    
-    switch (pool->bloom_type) {
-      case BLOOM_REGULAR: {
-        struct bloom *bf = (struct bloom *)pool->bloom_filter;
-        is_duplicate = bloom_check_add_64(bf, line, line_len);
-        count = is_duplicate ? 0 : 1;
-        break;
-      }
-      case BLOOM_SCALING: {
-        scaling_bloom_t *sbf = (scaling_bloom_t *)pool->bloom_filter;
-        static uint64_t line_id = 0;
-        is_duplicate = scaling_bloom_check_add(sbf, line, line_len, ++line_id);
-        count = is_duplicate ? 0 : 1;
-        break;
+  switch (pool->bloom_type) {
+    case BLOOM_REGULAR:
+      if (*lap != 0) {
+        uint64_t hash[2];
+        MurmurHash3_x64_128(line, line_len, BLOOM_HASH_SEED, hash);
+        STAGE_LAP(STAGE_HASH, *lap);
+        is_duplicate = bloom_check_add_64_atomic_hashed((struct bloom *)pool->bloom_filter, hash[0], hash[1]);
+      } else {
+        is_duplicate = bloom_check_add_64_atomic((struct bloom *)pool->bloom_filter, line, line_len);
       }
-    }
-    
-    /* Store result */
-    pthread_mutex_lock(&pool->result_mutex);
-    if (pool->result_count < pool->result_size) {
-      if (!is_duplicate || config->show_duplicates) {
-        pool->results[pool->result_count] = strdup(line);
-        pool->result_counts[pool->result_count] = count;
-        pool->result_count++;
+      break;
+    case BLOOM_SCALING:
+      /* dablooms remaps its bitmap while growing, so it cannot be shared without a lock */
+      if (pthread_mutex_trylock(&pool->filter_mutex) != 0) {
+        uint64_t start = now_ns();
+        uint64_t end;
+        pthread_mutex_lock(&pool->filter_mutex);
+        end = now_ns();
+        __atomic_fetch_add(&pool->filter_wait_ns, end - start, __ATOMIC_RELAXED);
+        /* Inside the probe lap, so it is only traced, not charged to waiting */
+        if (trace_on) trace_span("lock filter", "wait", start, end);
       }
-    }
-    pthread_mutex_unlock(&pool->result_mutex);
+      is_duplicate = scaling_bloom_check_add((scaling_bloom_t *)pool->bloom_filter, line, line_len, ++pool->filter_id);
+      pthread_mutex_unlock(&pool->filter_mutex);
+      break;
+  }
+  /* dablooms hashes internally, so its hashing is timed as probing */
+  STAGE_LAP(STAGE_PROBE, *lap);
+  USDT_VERDICT(is_duplicate, line, line_len);
+  
+  return (is_duplicate == 1) ? 1 : 0;
+}
+
+/****
+ *
+ * Make room for need bytes of block output
+ *
+ ****/
+PRIVATE void reserve_out(block_out_t *out, size_t need) {
+  if (need > out->size) {
+    size_t size = (out->size > 0) ? out->size * 2 : PARALLEL_BLOCK_SIZE;
+    if (need > size) size = need;
+    mem_account(MEM_PIPELINE, (int64_t)(size - out->size));
+    out->data = (char *)((out->data != NULL) ? mem_large_realloc(out->data, out->size, size) : mem_large_alloc(size));
+    out->size = size;
+  }
+}
+
+/****
+ *
+ * Copy a line as read, cut at MAX_LINE_LEN like the serial path does
+ *
+ ****/
+PRIVATE void append_raw(block_out_t *out, const char *line, size_t key_len) {
+  reserve_out(out, out->len + key_len);
+  memcpy(out->data + out->len, line, key_len);
+  out->len += key_len;
+}
+
+/****
+ *
+ * Add a selected line to a block's stdout output
+ *
+ * Text is copied as is, other formats are encoded here so the writer
+ * only has to copy the block out. With -I only the line's position
+ * within the block is recorded, the writer adds where the block starts.
+ *
+ ****/
+PRIVATE void append_line(work_block_t *block, const char *line, size_t key_len, size_t line_len, uint64_t line_no) {
+  block_out_t *out = &block->out;
+  
+  if (config->index_mode != INDEX_NONE) {
+    index_entry_t entry;
     
-    free(line);
+    entry.line = line_no;
+    entry.offset = (uint64_t)(line - block->data);
+    entry.len = (line[line_len - 1] == '\n') ? line_len - 1 : line_len;
+    reserve_out(out, out->len + sizeof(entry));
+    memcpy(out->data + out->len, &entry, sizeof(entry));
+    out->len += sizeof(entry);
+    return;
   }
   
-  return NULL;
+  if (config->output_format == OUTPUT_TEXT) {
+    append_raw(out, line, key_len);
+    return;
+  }
+  
+  reserve_out(out, out->len + OUTPUT_ENCODED_MAX(key_len));
+  if (key_len > 0 && line[key_len - 1] == '\n') key_len--;
+  out->len += output_encode_line(out->data + out->len, line, key_len, 1, config->output_format);
 }
 
 /****
  *
- * Process a file in parallel using multiple threads
+ * Unique lines in a checked block, emitted counts repeats with -D
+ *
+ ****/
+PRIVATE uint64_t block_uniques(const work_block_t *block) {
+  return config->show_duplicates ? block->lines - block->emitted : block->emitted;
+}
+
+/****
+ *
+ * Send a checked line to its file or, if selected, to stdout
  *
- * Opens the specified file (or stdin if filename is "-"), creates a
- * thread pool with the specified number of threads, initializes the
- * appropriate bloom filter, and processes all lines in parallel.
+ ****/
+PRIVATE void route_line(thread_pool_t *pool, work_block_t *block, const char *line, size_t key_len,
+                        size_t line_len, uint64_t line_no, int repeat) {
+  int selected = (repeat == (config->show_duplicates ? 1 : 0));
+  
+  if (selected) block->emitted++;
+  if (pool->routed[repeat]) {
+    append_raw(&block->split[repeat], line, key_len);
+  } else if (selected) {
+    append_line(block, line, key_len, line_len, line_no);
+  }
+}
+
+/****
+ *
+ * Scan a block for lines and filter them
+ *
+ * Splits the block at newlines, checks every line against the shared
+ * filter and copies the lines selected for output (unique lines, or
+ * duplicates with -D) into the block's output buffer.
  *
  * Arguments:
- *   filename - Name of file to process, or "-" for stdin
- *   num_threads - Number of worker threads to use
+ *   ctx - The calling worker
+ *   block - Block to process
  *
  * Returns:
- *   TRUE on success, FAILED on error
+ *   None
  *
  ****/
-int process_file_parallel(const char *filename, int num_threads) {
-  FILE *file;
-  char line[8192];
-  thread_pool_t *pool;
+void process_block(worker_ctx_t *ctx, work_block_t *block) {
+  thread_pool_t *pool = ctx->pool;
+  const char *p = block->data;
+  const char *end = block->data + block->len;
   
-  /* Open file */
-  if (strcmp(filename, "-") == 0) {
-    file = stdin;
-  } else {
-    file = fopen(filename, "r");
-    if (file == NULL) {
-      fprintf(stderr, "ERR - Unable to open file for reading\n");
-      return FAILED;
+  while (p < end) {
+    uint64_t lap = STAGE_BEGIN(block->lines);
+    const char *nl = memchr(p, '\n', end - p);
+    size_t line_len = (nl != NULL) ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+    size_t key_len = (line_len > MAX_LINE_LEN) ? MAX_LINE_LEN : line_len;
+    int dup;
+    
+    STAGE_LAP(STAGE_SCAN, lap);
+    if (ctx->top.capacity > 0) topk_add_line(&ctx->top, p, key_len);
+    if (pool->tally) {
+      count_table_add(&ctx->counts, p, (uint32_t)(key_len - (p[key_len - 1] == '\n')),
+                      (block->seq << 32) | block->lines);
     }
+    STAGE_LAP(STAGE_TALLY, lap);
+    block->lines++;
+    dup = filter_check_add(pool, p, key_len, &lap);
+    route_line(pool, block, p, key_len, line_len, block->lines, dup);
+    STAGE_LAP(STAGE_EMIT, lap);
+    p += line_len;
   }
+}
+
+/****
+ *
+ * Count the lines of a block in the worker's own table
+ *
+ * Positions combine the block sequence number and the line index, so
+ * merged tables order lines exactly like the serial path.
+ *
+ * Arguments:
+ *   ctx - The calling worker
+ *   block - Block to count
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void count_block(worker_ctx_t *ctx, work_block_t *block) {
+  const char *p = block->data;
+  const char *end = block->data + block->len;
+  uint64_t start = STAGE_MARK();
   
-  /* Create thread pool */
-  pool = create_thread_pool(num_threads, 1000);
-  if (pool == NULL) {
-    if (file != stdin) fclose(file);
-    return FAILED;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t len = (nl != NULL) ? (size_t)(nl - p) : (size_t)(end - p);
+    
+    uint32_t key_len = (len > MAX_LINE_LEN) ? MAX_LINE_LEN : (uint32_t)len;
+    
+    count_table_add(&ctx->counts, p, key_len, (block->seq << 32) | block->lines);
+    if (ctx->top.capacity > 0) topk_add(&ctx->top, p, key_len);
+    block->lines++;
+    p += (nl != NULL) ? len + 1 : len;
   }
+  stage_done(STAGE_TALLY, start);
+}
+
+/****
+ *
+ * Rebuild the local dedup table at twice its size
+ *
+ ****/
+PRIVATE void grow_scratch_table(worker_scratch_t *scratch, uint32_t ncand) {
+  size_t mask;
   
-  /* Set up bloom filter based on config */
-  struct bloom bf;
-  scaling_bloom_t *sbf = NULL;
+  XFREE(scratch->table);
+  mem_account(MEM_PIPELINE, (int64_t)(scratch->table_size * sizeof(uint32_t)));
+  scratch->table_size *= 2;
+  scratch->table = (uint32_t *)XMALLOC(scratch->table_size * sizeof(uint32_t));
+  mask = scratch->table_size - 1;
   
-  if (config->bloom_type == BLOOM_REGULAR) {
-    if (bloom_init_64(&bf, 100000, config->eRate) != 0) {
-      destroy_thread_pool(pool);
-      if (file != stdin) fclose(file);
-      return FAILED;
+  for (uint32_t i = 0; i < ncand; i++) {
+    size_t slot = scratch->cands[i].a & mask;
+    while (scratch->table[slot] != 0) {
+      slot = (slot + 1) & mask;
     }
-    set_bloom_filter(pool, &bf, BLOOM_REGULAR);
-  } else if (config->bloom_type == BLOOM_SCALING) {
-    char tmpfile[] = "/tmp/buniq-XXXXXX";
-    int tmpfd = mkstemp(tmpfile);
-    if (tmpfd == -1) {
-      destroy_thread_pool(pool);
-      if (file != stdin) fclose(file);
-      return FAILED;
+    scratch->table[slot] = i + 1;
+  }
+}
+
+/****
+ *
+ * First phase of deterministic mode: deduplicate a block on its own
+ *
+ * Hashes every line once and drops repeats within the block using an
+ * open addressing table, so only the first occurrence of each key needs
+ * the shared filter. Those candidates are bucketed by filter partition
+ * in input order, ready for the resolve tasks of the block's round.
+ *
+ * Arguments:
+ *   ctx - The calling worker
+ *   block - Block to scan
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void scan_block(worker_ctx_t *ctx, work_block_t *block) {
+  worker_scratch_t *scratch = &ctx->scratch;
+  const char *p = block->data;
+  const char *end = block->data + block->len;
+  uint32_t counts[BLOOM_PARTITIONS + 1];
+  uint64_t lines = 0;
+  uint32_t ncand = 0;
+  size_t mask;
+  
+  if (scratch->table == NULL) {
+    scratch->table_size = PARALLEL_TABLE_SIZE;
+    scratch->table = (uint32_t *)XMALLOC(scratch->table_size * sizeof(uint32_t));
+    mem_account(MEM_PIPELINE, (int64_t)(scratch->table_size * sizeof(uint32_t)));
+  } else {
+    memset(scratch->table, 0, scratch->table_size * sizeof(uint32_t));
+  }
+  mask = scratch->table_size - 1;
+  
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t line_len = (nl != NULL) ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+    uint32_t key_len = (line_len > MAX_LINE_LEN) ? MAX_LINE_LEN : (uint32_t)line_len;
+    uint64_t hash[2];
+    uint64_t lap = STAGE_BEGIN(lines);
+    size_t slot;
+    int seen = 0;
+    
+    STAGE_LAP(STAGE_SCAN, lap);
+    if (lines == block->verdict_size) {
+      if (block->verdict == NULL) {
+        block->verdict_size = PARALLEL_TABLE_SIZE;
+        block->verdict = (uint8_t *)XMALLOC(block->verdict_size);
+        mem_account(MEM_PIPELINE, (int64_t)block->verdict_size);
+      } else {
+        mem_account(MEM_PIPELINE, (int64_t)block->verdict_size);
+        block->verdict_size *= 2;
+        block->verdict = (uint8_t *)XREALLOC(block->verdict, block->verdict_size);
+      }
     }
-    close(tmpfd);
     
-    sbf = new_scaling_bloom(1000000, config->eRate, tmpfile);
-    if (sbf == NULL) {
-      destroy_thread_pool(pool);
-      if (file != stdin) fclose(file);
-      return FAILED;
+    if (ctx->top.capacity > 0) topk_add_line(&ctx->top, p, key_len);
+    if (ctx->pool->tally) {
+      count_table_add(&ctx->counts, p, key_len - (p[key_len - 1] == '\n'), (block->seq << 32) | lines);
+    }
+    STAGE_LAP(STAGE_TALLY, lap);
+    MurmurHash3_x64_128(p, key_len, BLOOM_HASH_SEED, hash);
+    STAGE_LAP(STAGE_HASH, lap);
+    slot = hash[0] & mask;
+    while (scratch->table[slot] != 0) {
+      const candidate_t *c = &scratch->cands[scratch->table[slot] - 1];
+      if (c->a == hash[0] && c->b == hash[1] && c->len == key_len &&
+          memcmp(block->data + c->offset, p, key_len) == 0) {
+        seen = 1;
+        break;
+      }
+      slot = (slot + 1) & mask;
     }
-    set_bloom_filter(pool, sbf, BLOOM_SCALING);
+    
+    if (seen) {
+      block->verdict[lines] = 1;
+    } else {
+      if (ncand == scratch->cands_size) {
+        if (scratch->cands == NULL) {
+          scratch->cands_size = PARALLEL_TABLE_SIZE;
+          scratch->cands = (candidate_t *)XMALLOC(scratch->cands_size * sizeof(candidate_t));
+          mem_account(MEM_PIPELINE, (int64_t)(scratch->cands_size * sizeof(candidate_t)));
+        } else {
+          mem_account(MEM_PIPELINE, (int64_t)(scratch->cands_size * sizeof(candidate_t)));
+          scratch->cands_size *= 2;
+          scratch->cands = (candidate_t *)XREALLOC(scratch->cands, scratch->cands_size * sizeof(candidate_t));
+        }
+      }
+      scratch->cands[ncand].a = hash[0];
+      scratch->cands[ncand].b = hash[1];
+      scratch->cands[ncand].offset = (size_t)(p - block->data);
+      scratch->cands[ncand].line = (uint32_t)lines;
+      scratch->cands[ncand].len = key_len;
+      scratch->table[slot] = ++ncand;
+      block->verdict[lines] = 0;
+      
+      /* Keep the table at most half full */
+      if ((size_t)ncand * 2 > scratch->table_size) {
+        grow_scratch_table(scratch, ncand);
+        mask = scratch->table_size - 1;
+      }
+    }
+    
+    STAGE_LAP(STAGE_SCAN, lap);
+    lines++;
+    p += line_len;
   }
+  block->lines = lines;
   
-  /* Process lines */
-  int line_num = 0;
-  while (fgets(line, sizeof(line), file) != NULL) {
-    submit_work(pool, line, strlen(line), line_num++);
-    config->total_lines++;
+  if (block->cands_size < ncand) {
+    if (block->cands != NULL) XFREE(block->cands);
+    mem_account(MEM_PIPELINE, (int64_t)((scratch->cands_size - block->cands_size) * sizeof(candidate_t)));
+    block->cands_size = scratch->cands_size;
+    block->cands = (candidate_t *)XMALLOC(block->cands_size * sizeof(candidate_t));
   }
   
-  /* Wait for processing to complete */
-  pthread_mutex_lock(&pool->queue_mutex);
-  while (pool->queue_count > 0) {
-    pthread_cond_wait(&pool->queue_not_full, &pool->queue_mutex);
-  }
-  pthread_mutex_unlock(&pool->queue_mutex);
+  if (ctx->pool->bloom_type == BLOOM_REGULAR) {
+    /* Counting sort by partition keeps input order within each partition */
+    memset(counts, 0, sizeof(counts));
+    for (uint32_t i = 0; i < ncand; i++) {
+      counts[BLOOM_PARTITION(scratch->cands[i].a) + 1]++;
+    }
+    for (int i = 0; i < BLOOM_PARTITIONS; i++) {
+      counts[i + 1] += counts[i];
+    }
+    memcpy(block->part_start, counts, sizeof(block->part_start));
+    for (uint32_t i = 0; i < ncand; i++) {
+      block->cands[counts[BLOOM_PARTITION(scratch->cands[i].a)]++] = scratch->cands[i];
+    }
+  } else {
+    /* The scaling filter is resolved in one piece, in input order */
+    memset(block->part_start, 0, sizeof(block->part_start));
+    block->part_start[BLOOM_PARTITIONS] = ncand;
+    if (ncand > 0) {
+      memcpy(block->cands, scratch->cands, ncand * sizeof(candidate_t));
+    }
+  }
+}
+
+/****
+ *
+ * Resolve one filter partition for every block of the current round
+ *
+ * Blocks are visited in input order, so each partition of the filter
+ * sees its keys in exactly the order the serial path would.
+ *
+ ****/
+PRIVATE void resolve_partition(thread_pool_t *pool, int part) {
+  uint64_t start = STAGE_MARK();
+  
+  for (int i = 0; i < pool->round_count && !pool->filter_failed; i++) {
+    work_block_t *block = pool->round[i];
+    
+    if (pool->bloom_type == BLOOM_REGULAR) {
+      struct bloom *bf = (struct bloom *)pool->bloom_filter;
+      for (uint32_t j = block->part_start[part]; j < block->part_start[part + 1]; j++) {
+        const candidate_t *c = &block->cands[j];
+        block->verdict[c->line] = (uint8_t)bloom_check_add_64_hashed(bf, c->a, c->b);
+        USDT_VERDICT(block->verdict[c->line], block->data + c->offset, c->len);
+      }
+    } else {
+      scaling_bloom_t *sbf = (scaling_bloom_t *)pool->bloom_filter;
+      for (uint32_t j = 0; j < block->part_start[BLOOM_PARTITIONS]; j++) {
+        const candidate_t *c = &block->cands[j];
+        /* Ids are input line numbers, as in the serial path */
+        int result = scaling_bloom_check_add(sbf, block->data + c->offset, c->len, block->first_line + c->line + 1);
+        if (result == -1) {
+          pool->filter_failed = 1;
+          return;
+        }
+        block->verdict[c->line] = (result == 1) ? 1 : 0;
+        USDT_VERDICT(result, block->data + c->offset, c->len);
+      }
+    }
+  }
+  stage_done(STAGE_PROBE, start);
+}
+
+/****
+ *
+ * Copy the lines of a resolved block selected for output
+ *
+ ****/
+PRIVATE void emit_block(thread_pool_t *pool, work_block_t *block) {
+  const char *p = block->data;
+  const char *end = block->data + block->len;
+  uint64_t start = STAGE_MARK();
+  
+  for (uint64_t i = 0; p < end; i++) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t line_len = (nl != NULL) ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+    size_t key_len = (line_len > MAX_LINE_LEN) ? MAX_LINE_LEN : line_len;
+    
+    route_line(pool, block, p, key_len, line_len, i + 1, block->verdict[i]);
+    p += line_len;
+  }
+  stage_done(STAGE_EMIT, start);
+}
+
+/****
+ *
+ * Run one task of the current deterministic round
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *   task - Partition to resolve or merge, or index of the block to emit
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void run_round_task(thread_pool_t *pool, int task) {
+  switch (pool->round_phase) {
+    case ROUND_RESOLVE:
+      resolve_partition(pool, task);
+      break;
+    case ROUND_EMIT:
+      emit_block(pool, pool->round[task]);
+      progress_add(0, 0, block_uniques(pool->round[task]));
+      break;
+    case ROUND_MERGE:
+      for (int i = 0; i < pool->num_threads; i++) {
+        count_table_merge(&pool->merged, &pool->workers[i].counts, task);
+      }
+      break;
+  }
+}
+
+/****
+ *
+ * Worker thread function for processing blocks
+ *
+ * Main loop for worker threads that takes blocks from the work queue,
+ * processes them and marks them done for the writer.
+ *
+ * Arguments:
+ *   arg - Pointer to thread pool structure cast as void*
+ *
+ * Returns:
+ *   NULL when thread exits
+ *
+ ****/
+void *worker_thread(void *arg) {
+  worker_ctx_t *ctx = (worker_ctx_t *)arg;
+  thread_pool_t *pool = ctx->pool;
+  perf_group_t perf;
+  char name[TRACE_NAME_LEN];
+  
+  snprintf(name, sizeof(name), "hasher %d", ctx->id);
+  trace_thread(name);
+  perf_thread_begin(&perf);
+  while (1) {
+    lock_queue(pool);
+    
+    /* Wait for work, parked hashers only take round tasks */
+    while ((pool->queue_count == 0 || ctx->id >= pool->active_hashers) &&
+           pool->round_next >= pool->round_tasks && !pool->shutdown) {
+      if (ctx->id < pool->active_hashers) {
+        uint64_t start = now_ns();
+        pthread_cond_wait(&pool->queue_not_empty, &pool->queue_mutex);
+        pool->hasher_idle_ns += now_ns() - start;
+        queue_waited("wait work", start);
+      } else {
+        pthread_cond_wait(&pool->queue_not_empty, &pool->queue_mutex);
+      }
+    }
+    
+    /* Round tasks go first, the writer is waiting on them */
+    if (pool->round_next < pool->round_tasks) {
+      int task = pool->round_next++;
+      pthread_mutex_unlock(&pool->queue_mutex);
+      
+      run_round_task(pool, task);
+      
+      pthread_mutex_lock(&pool->result_mutex);
+      pool->round_done++;
+      pthread_cond_broadcast(&pool->result_ready);
+      pthread_mutex_unlock(&pool->result_mutex);
+      continue;
+    }
+    
+    if (pool->shutdown && pool->queue_count == 0) {
+      pthread_mutex_unlock(&pool->queue_mutex);
+      break;
+    }
+    
+    /* Get work item */
+    work_block_t *block = pool->work_queue[pool->queue_front];
+    pool->queue_front = (pool->queue_front + 1) % pool->queue_size;
+    pool->queue_count--;
+    
+    pthread_cond_signal(&pool->queue_not_full);
+    pthread_mutex_unlock(&pool->queue_mutex);
+    
+    if (pool->counting) {
+      count_block(ctx, block);
+      progress_add(0, block->lines, 0);
+    } else if (pool->two_phase) {
+      scan_block(ctx, block);
+      progress_add(0, block->lines, 0);
+    } else {
+      process_block(ctx, block);
+      progress_add(0, block->lines, block_uniques(block));
+    }
+    
+    /* Hand the block to the writer */
+    pthread_mutex_lock(&pool->result_mutex);
+    block->done = 1;
+    pthread_cond_broadcast(&pool->result_ready);
+    pthread_mutex_unlock(&pool->result_mutex);
+  }
+  perf_thread_end(&perf);
+  
+  return NULL;
+}
+
+/****
+ *
+ * Cut a mapped file into blocks of whole lines
+ *
+ ****/
+PRIVATE void read_mapped_blocks(thread_pool_t *pool) {
+  size_t pos = 0;
+  
+  while (pos < pool->map_size) {
+    size_t end = pos + pool->block_size;
+    work_block_t *block;
+    
+    if (end >= pool->map_size) {
+      end = pool->map_size;
+    } else {
+      const char *nl = memrchr(pool->map + pos, '\n', end - pos);
+      if (nl == NULL) {
+        /* Line longer than a block, extend to its end */
+        nl = memchr(pool->map + end, '\n', pool->map_size - end);
+      }
+      end = (nl != NULL) ? (size_t)(nl - pool->map) + 1 : pool->map_size;
+    }
+    
+    if ((block = acquire_block(pool)) == NULL) return;
+    block->data = pool->map + pos;
+    block->len = end - pos;
+    if (submit_block(pool, block) != 0) return;
+    pos = end;
+  }
+}
+
+/****
+ *
+ * Wait until the stream has input or the block's deadline passes
+ *
+ * The deadline starts with the first complete line of the block, a
+ * block without one has nothing to hand on yet.
+ *
+ ****/
+PRIVATE int input_ready(thread_pool_t *pool, uint64_t *deadline) {
+  struct pollfd pfd;
+  uint64_t now = now_ns();
+  int timeout;
+  int n;
+  
+  if (*deadline == 0) *deadline = now + pool->latency_ns;
+  timeout = (now >= *deadline) ? 0 : (int)((*deadline - now + 999999) / 1000000);
+  pfd.fd = pool->input_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+  
+  /* Errors and hangups are left for read() to report */
+  return n != 0;
+}
+
+/****
+ *
+ * Read a stream into blocks of whole lines
+ *
+ * Fills each block with large read() calls, cuts it after the last
+ * newline and carries the partial line over to the next block. With
+ * --latency-ms a block is also cut once its first line has waited that
+ * long, so a slow stream is not held back until the block fills.
+ *
+ ****/
+PRIVATE void read_stream_blocks(thread_pool_t *pool) {
+  char *carry = NULL;
+  size_t carry_len = 0;
+  size_t carry_size = 0;
+  int eof = 0;
+  
+  while (!eof) {
+    work_block_t *block;
+    size_t fill, len;
+    uint64_t deadline;
+    uint64_t start;
+    int has_line;
+    
+    if ((block = acquire_block(pool)) == NULL) break;
+    start = STAGE_MARK();
+    
+    if (block->buf == NULL) {
+      block->buf_size = pool->block_size;
+      block->buf = (char *)mem_large_alloc(block->buf_size);
+      mem_account(MEM_PIPELINE, (int64_t)block->buf_size);
+    }
+    while (carry_len >= block->buf_size) {
+      mem_account(MEM_PIPELINE, (int64_t)block->buf_size);
+      block->buf = (char *)mem_large_realloc(block->buf, block->buf_size, block->buf_size * 2);
+      block->buf_size *= 2;
+    }
+    if (carry_len > 0) {
+      memcpy(block->buf, carry, carry_len);
+    }
+    fill = carry_len;
+    carry_len = 0;
+    deadline = 0;
+    has_line = 0;
+    
+    for (;;) {
+      while (fill < block->buf_size && !eof) {
+        ssize_t n;
+        
+        if (has_line && pool->latency_ns > 0 && !input_ready(pool, &deadline)) break;
+        n = read(pool->input_fd, block->buf + fill, block->buf_size - fill);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          fprintf(stderr, "ERR - Unable to read input: %s\n", strerror(errno));
+          pool->reader_failed = 1;
+          eof = 1;
+        } else if (n == 0) {
+          eof = 1;
+        } else {
+          /* The carried partial line has no newline, only new bytes can */
+          if (!has_line && memchr(block->buf + fill, '\n', (size_t)n) != NULL) has_line = 1;
+          fill += (size_t)n;
+        }
+      }
+      if (eof) {
+        len = fill;
+        break;
+      }
+      const char *nl = memrchr(block->buf, '\n', fill);
+      if (nl != NULL) {
+        len = (size_t)(nl - block->buf) + 1;
+        break;
+      }
+      /* Line longer than the buffer, grow and keep reading */
+      mem_account(MEM_PIPELINE, (int64_t)block->buf_size);
+      block->buf = (char *)mem_large_realloc(block->buf, block->buf_size, block->buf_size * 2);
+      block->buf_size *= 2;
+    }
+    
+    /* Carry the partial last line over to the next block */
+    if (fill > len) {
+      carry_len = fill - len;
+      if (carry_len > carry_size) {
+        if (carry != NULL) XFREE(carry);
+        mem_account(MEM_PIPELINE, (int64_t)(carry_len - carry_size));
+        carry_size = carry_len;
+        carry = (char *)XMALLOC(carry_size);
+      }
+      memcpy(carry, block->buf + len, carry_len);
+    }
+    
+    if (len == 0) {
+      release_block(pool, block);
+      continue;
+    }
+    
+    block->data = block->buf;
+    block->len = len;
+    stage_done(STAGE_READ, start);
+    if (submit_block(pool, block) != 0) break;
+  }
+  
+  if (carry != NULL) XFREE(carry);
+  mem_account(MEM_PIPELINE, -(int64_t)carry_size);
+}
+
+/****
+ *
+ * Reader thread function
+ *
+ * Cuts the input into blocks of whole lines and submits them to the
+ * workers, then tells the writer how many blocks to expect.
+ *
+ * Arguments:
+ *   arg - Pointer to thread pool structure cast as void*
+ *
+ * Returns:
+ *   NULL when thread exits
+ *
+ ****/
+void *reader_thread(void *arg) {
+  thread_pool_t *pool = (thread_pool_t *)arg;
+  perf_group_t perf;
+  
+  trace_thread("reader");
+  perf_thread_begin(&perf);
+  if (pool->map != NULL) {
+    read_mapped_blocks(pool);
+  } else {
+    read_stream_blocks(pool);
+  }
+  perf_thread_end(&perf);
   
-  /* Output results */
   pthread_mutex_lock(&pool->result_mutex);
-  for (int i = 0; i < pool->result_count; i++) {
-    printf("%s", pool->results[i]);
-    free(pool->results[i]);
+  pool->reader_done = 1;
+  pthread_cond_broadcast(&pool->result_ready);
+  pthread_mutex_unlock(&pool->result_mutex);
+  
+  return NULL;
+}
+
+/****
+ *
+ * Snapshot the stall counters at the start of a controller epoch
+ *
+ ****/
+PRIVATE void controller_snapshot(thread_pool_t *pool, uint64_t now) {
+  controller_t *ctl = &pool->ctl;
+  
+  ctl->epoch_start = now;
+  pthread_mutex_lock(&pool->queue_mutex);
+  ctl->hasher_idle_ns = pool->hasher_idle_ns;
+  ctl->fill_sum = pool->fill_sum;
+  ctl->fill_samples = pool->fill_samples;
+  pthread_mutex_unlock(&pool->queue_mutex);
+  pthread_mutex_lock(&pool->result_mutex);
+  ctl->reader_stall_ns = pool->reader_stall_ns;
+  ctl->writer_stall_ns = pool->writer_stall_ns;
+  pthread_mutex_unlock(&pool->result_mutex);
+  ctl->filter_wait_ns = __atomic_load_n(&pool->filter_wait_ns, __ATOMIC_RELAXED);
+}
+
+/****
+ *
+ * Rebalance hasher threads against the reader and writer stages
+ *
+ * Only hashers are parked and woken. The reader and writer stay single
+ * threads because output must follow input order, so relieving them
+ * means handing them a parked hasher's CPU.
+ *
+ * Called by the writer between blocks. Once per epoch it compares how
+ * long each stage spent waiting on its neighbours:
+ *
+ *   - the writer waiting on hashed blocks while the reader waits for
+ *     free blocks means hashing is the bottleneck, so a parked hasher
+ *     is woken;
+ *   - hashers queueing on the scaling filter lock more than they hash
+ *     gain nothing from more threads, so a hasher is parked;
+ *   - active hashers idling on a mostly empty queue means input is the
+ *     bottleneck, and the reader waiting for blocks while the writer
+ *     never waits means output is, so a hasher is parked and its CPU
+ *     left to the reader, the writer and the memory system.
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+PRIVATE void controller_tick(thread_pool_t *pool) {
+  controller_t *ctl = &pool->ctl;
+  pipeline_stats_t *stats = ctl->stats;
+  uint64_t now = now_ns();
+  uint64_t epoch = now - ctl->epoch_start;
+  uint64_t idle, reader, writer, lock, fill_sum, fill_samples;
+  double idle_frac, reader_frac, writer_frac, lock_frac, fill;
+  int active, target;
+  
+  if (epoch < PARALLEL_EPOCH_NS) return;
+  
+  pthread_mutex_lock(&pool->queue_mutex);
+  idle = pool->hasher_idle_ns - ctl->hasher_idle_ns;
+  fill_sum = pool->fill_sum - ctl->fill_sum;
+  fill_samples = pool->fill_samples - ctl->fill_samples;
+  active = pool->active_hashers;
+  pthread_mutex_unlock(&pool->queue_mutex);
+  pthread_mutex_lock(&pool->result_mutex);
+  reader = pool->reader_stall_ns - ctl->reader_stall_ns;
+  writer = pool->writer_stall_ns - ctl->writer_stall_ns;
+  pthread_mutex_unlock(&pool->result_mutex);
+  lock = __atomic_load_n(&pool->filter_wait_ns, __ATOMIC_RELAXED) - ctl->filter_wait_ns;
+  
+  idle_frac = (double)idle / ((double)epoch * active);
+  reader_frac = (double)reader / epoch;
+  writer_frac = (double)writer / epoch;
+  lock_frac = (double)lock / ((double)epoch * active);
+  /* Waits are booked when they end, so one may span several epochs */
+  if (idle_frac > 1.0) idle_frac = 1.0;
+  if (reader_frac > 1.0) reader_frac = 1.0;
+  if (writer_frac > 1.0) writer_frac = 1.0;
+  if (lock_frac > 1.0) lock_frac = 1.0;
+  fill = (fill_samples > 0) ? (double)fill_sum / fill_samples / pool->queue_size : 0.0;
+  
+  target = active;
+  if (lock_frac > 0.5) {
+    target = active - 1;
+  } else if (reader_frac > 0.2 && writer_frac > 0.2 && idle_frac < 0.1) {
+    target = active + 1;
+  } else if (idle_frac > 0.5 && fill < 0.25) {
+    target = active - 1;
+  } else if (reader_frac > 0.2 && writer_frac < 0.05 && idle_frac > 0.3) {
+    target = active - 1;
+  }
+  if (target > pool->num_threads) target = pool->num_threads;
+  if (target < 1) target = 1;
+  
+  if (target != active) {
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->active_hashers = target;
+    pthread_cond_broadcast(&pool->queue_not_empty);
+    pthread_mutex_unlock(&pool->queue_mutex);
+    if (target > active) {
+      stats->grown++;
+    } else {
+      stats->shrunk++;
+    }
+    if (config->debug > 0) {
+      fprintf(stderr, "DEBUG - Hashers %d -> %d (reader %.0f%%, hashers idle %.0f%%, filter lock %.0f%%, writer %.0f%%, queue %.0f%%)\n",
+              active, target, reader_frac * 100, idle_frac * 100, lock_frac * 100, writer_frac * 100, fill * 100);
+    }
+  }
+  
+  stats->epochs++;
+  if (target < stats->active_min) stats->active_min = target;
+  if (target > stats->active_max) stats->active_max = target;
+  controller_snapshot(pool, now);
+}
+
+/****
+ *
+ * Write a block's selected lines, already in the configured output format
+ *
+ * Blocks arrive in input order, so the lines and bytes written so far
+ * are where this block starts in the input.
+ *
+ ****/
+PRIVATE void write_block(thread_pool_t *pool, const work_block_t *block) {
+  uint64_t start = STAGE_MARK();
+  
+  if (config->index_mode != INDEX_NONE) {
+    for (size_t pos = 0; pos + sizeof(index_entry_t) <= block->out.len; pos += sizeof(index_entry_t)) {
+      index_entry_t entry;
+      memcpy(&entry, block->out.data + pos, sizeof(entry));
+      output_index(pool->written_lines + entry.line, pool->written_bytes + entry.offset, entry.len);
+    }
+  } else {
+    output_write_encoded(block->out.data, block->out.len, config->output_format);
+  }
+  USDT2(output__flush, STDOUT_FILENO, block->out.len);
+  if (pool->routed[0]) output_split(block->split[0].data, block->split[0].len, 0);
+  if (pool->routed[1]) output_split(block->split[1].data, block->split[1].len, 1);
+  pool->written_lines += block->lines;
+  pool->written_bytes += block->len;
+  stage_done(STAGE_WRITE, start);
+}
+
+/****
+ *
+ * Hand the workers one kind of round task and wait for all of them
+ *
+ ****/
+PRIVATE void run_round(thread_pool_t *pool, round_phase_t phase, int tasks) {
+  pthread_mutex_lock(&pool->result_mutex);
+  pool->round_done = 0;
+  pthread_mutex_unlock(&pool->result_mutex);
+  
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->round_phase = phase;
+  pool->round_next = 0;
+  pool->round_tasks = tasks;
+  pthread_cond_broadcast(&pool->queue_not_empty);
+  pthread_mutex_unlock(&pool->queue_mutex);
+  
+  pthread_mutex_lock(&pool->result_mutex);
+  if (pool->round_done < tasks) {
+    uint64_t start = now_ns();
+    while (pool->round_done < tasks) {
+      pthread_cond_wait(&pool->result_ready, &pool->result_mutex);
+    }
+    pool->writer_stall_ns += now_ns() - start;
   }
-  config->unique_lines = pool->result_count;
   pthread_mutex_unlock(&pool->result_mutex);
   
-  /* Cleanup */
-  if (config->bloom_type == BLOOM_REGULAR) {
-    bloom_free(&bf);
-  } else if (config->bloom_type == BLOOM_SCALING) {
-    free_scaling_bloom(sbf);
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->round_tasks = 0;
+  pool->round_next = 0;
+  pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+/****
+ *
+ * Write results in deterministic mode
+ *
+ * Gathers runs of consecutive scanned blocks into rounds. Each round
+ * resolves its candidates against the shared filter one partition per
+ * task, then the blocks are emitted in parallel and written in order.
+ * The output is identical to the serial path whatever the thread count.
+ *
+ * Arguments:
+ *   pool - Pointer to thread pool structure
+ *   total_lines - Incremented by the number of lines read
+ *   emitted - Incremented by the number of lines written
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+PRIVATE void write_rounds(thread_pool_t *pool, uint64_t *total_lines, uint64_t *emitted) {
+  int round_max = pool->num_threads * PARALLEL_ROUND_PER_THREAD;
+  uint64_t seq = 0;
+  uint64_t line_base = 0;
+  
+  pool->round = (work_block_t **)XMALLOC(round_max * sizeof(work_block_t *));
+  
+  for (;;) {
+    int count = 0;
+    
+    /* Gather the next run of scanned blocks, with --latency-ms only those already done */
+    while (count < round_max) {
+      work_block_t *block;
+      if (count > 0 && pool->latency_ns > 0 && !result_ready(pool, seq)) break;
+      block = next_result(pool, seq);
+      if (block == NULL) break;
+      block->first_line = line_base;
+      line_base += block->lines;
+      pool->round[count++] = block;
+      seq++;
+    }
+    if (count == 0) break;
+    pool->round_count = count;
+    
+    if (!pool->filter_failed) {
+      run_round(pool, ROUND_RESOLVE, (pool->bloom_type == BLOOM_REGULAR) ? BLOOM_PARTITIONS : 1);
+    }
+    /* After a filter failure keep draining the reader but write nothing */
+    if (!pool->filter_failed) {
+      run_round(pool, ROUND_EMIT, count);
+    }
+    
+    for (int i = 0; i < count; i++) {
+      work_block_t *block = pool->round[i];
+      write_block(pool, block);
+      *total_lines += block->lines;
+      *emitted += block->emitted;
+      release_block(pool, block);
+    }
+    controller_tick(pool);
   }
   
+  XFREE(pool->round);
+  pool->round = NULL;
+}
+
+/****
+ *
+ * Run the reader, worker and writer stages over an opened input
+ *
+ * Arguments:
+ *   fd - Input file descriptor
+ *   map - Mapping of the whole input, NULL to read fd as a stream
+ *   map_size - Size of the mapping
+ *   filter - Bloom filter shared by the workers
+ *   type - Type of the bloom filter
+ *   num_threads - Number of worker threads to use
+ *   pstats - Filled in with the stage balance
+ *
+ * Returns:
+ *   TRUE on success, FAILED on error
+ *
+ ****/
+PRIVATE int run_pipeline(int fd, const char *map, size_t map_size, void *filter, bloom_type_t type, int num_threads, pipeline_stats_t *pstats) {
+  thread_pool_t *pool;
+  cpu_topology_t topo;
+  thread_placement_t placement;
+  uint64_t total_lines = 0;
+  uint64_t emitted = 0;
+  int rc = TRUE;
+  
+  /* Decide where each pipeline thread runs */
+  topology_detect(&topo);
+  if (topology_plan(&topo, num_threads, config->affinity_mode, config->affinity_list, &placement) != TRUE) {
+    topology_free_plan(&placement);
+    topology_free(&topo);
+    return FAILED;
+  }
+  if (config->debug > 0) {
+    topology_print_plan(&topo, &placement);
+  }
+  
+  /* Create thread pool */
+  pool = create_thread_pool(num_threads, num_threads * PARALLEL_BLOCKS_PER_THREAD, &placement);
+  if (pool == NULL) {
+    topology_free_plan(&placement);
+    topology_free(&topo);
+    return FAILED;
+  }
+  set_bloom_filter(pool, filter, type);
+  pool->counting = config->count_duplicates;
+  pool->tally = (config->count_out != NULL) && !pool->counting;
+  pool->routed[0] = (config->unique_out != NULL);
+  pool->routed[1] = (config->dup_out != NULL);
+  pool->two_phase = config->deterministic && !pool->counting;
+  pstats->hashers = num_threads;
+  pstats->active_min = num_threads;
+  pstats->active_max = num_threads;
+  pool->ctl.stats = pstats;
+  controller_snapshot(pool, now_ns());
+  pool->input_fd = fd;
+  /* Half the --latency-ms budget for cutting blocks, the other half is the stdout flush */
+  pool->latency_ns = (uint64_t)config->latency_ms * 1000000ULL / 2;
+  pool->map = map;
+  pool->map_size = map_size;
+  
+  /* Start the reader, the calling thread becomes the writer */
+  if (pthread_create(&pool->reader, NULL, reader_thread, pool) != 0) {
+    fprintf(stderr, "ERR - Unable to start reader thread\n");
+    destroy_thread_pool(pool);
+    topology_free_plan(&placement);
+    topology_free(&topo);
+    return FAILED;
+  }
+  topology_pin_thread(pool->reader, placement.reader_cpu);
+  topology_pin_thread(pthread_self(), placement.writer_cpu);
+  
+  /* Output results in input order */
+  if (pool->two_phase) {
+    write_rounds(pool, &total_lines, &emitted);
+  } else {
+    for (uint64_t seq = 0; ; seq++) {
+      work_block_t *block = next_result(pool, seq);
+      if (block == NULL) break;
+      write_block(pool, block);
+      total_lines += block->lines;
+      emitted += block->emitted;
+      release_block(pool, block);
+      controller_tick(pool);
+    }
+  }
+  
+  pthread_join(pool->reader, NULL);
+  if (pool->reader_failed) rc = FAILED;
+  
+  /* Merge the workers' counts one partition per task, then write them */
+  if (pool->counting || pool->tally) {
+    count_table_init(&pool->merged);
+    run_round(pool, ROUND_MERGE, BLOOM_PARTITIONS);
+    if (pool->counting) {
+      count_table_emit(&pool->merged, output_counted_line);
+      emitted = count_table_distinct(&pool->merged);
+    }
+    if (config->count_out != NULL) {
+      count_table_emit(&pool->merged, output_count_sink_line);
+    }
+    count_table_free(&pool->merged);
+  }
+  
+  /* Fold the workers' heavy hitters into the global summary */
+  if (heavy_hitters != NULL) {
+    for (int i = 0; i < pool->num_threads; i++) {
+      topk_merge(heavy_hitters, &pool->workers[i].top);
+    }
+  }
+  
+  /* Report the stage balance for --stats */
+  pstats->active_final = pool->active_hashers;
+  pstats->hasher_idle = pool->hasher_idle_ns / 1e9;
+  pstats->reader_stall = pool->reader_stall_ns / 1e9;
+  pstats->writer_stall = pool->writer_stall_ns / 1e9;
+  pstats->filter_wait = pool->filter_wait_ns / 1e9;
+  pstats->queue_fill = (pool->fill_samples > 0) ? (double)pool->fill_sum / pool->fill_samples / pool->queue_size : 0.0;
+  if (pool->filter_failed) {
+    fprintf(stderr, "ERR - Failed to add item to scaling bloom filter\n");
+    rc = FAILED;
+  }
+  config->total_bytes = pool->written_bytes;
   destroy_thread_pool(pool);
-  if (file != stdin) fclose(file);
+  topology_free_plan(&placement);
+  topology_free(&topo);
   
-  return TRUE;
-}
\ No newline at end of file
+  config->total_lines = total_lines;
+  if (config->count_duplicates) {
+    config->unique_lines = emitted;
+    config->duplicate_lines = total_lines - emitted;
+  } else if (config->show_duplicates) {
+    config->duplicate_lines = emitted;
+    config->unique_lines = total_lines - emitted;
+  } else {
+    config->unique_lines = emitted;
+    config->duplicate_lines = total_lines - emitted;
+  }
+  
+  return rc;
+}
+
+/****
+ *
+ * Process a file in parallel using multiple threads
+ *
+ * Regular files are mapped and cut into blocks in place, stdin and other
+ * streams are read in large blocks by a dedicated reader thread. Worker
+ * threads scan and filter whole blocks while the calling thread writes
+ * the results in input order.
+ *
+ * Arguments:
+ *   filename - Name of file to process, or "-" for stdin
+ *   num_threads - Number of worker threads to use
+ *   pstats - Filled in with the stage balance for --stats
+ *
+ * Returns:
+ *   TRUE on success, FAILED on error
+ *
+ ****/
+int process_file_parallel(const char *filename, int num_threads, pipeline_stats_t *pstats) {
+  struct stat st;
+  int fd;
+  char *map = NULL;
+  size_t map_size = 0;
+  struct bloom bf;
+  scaling_bloom_t *sbf = NULL;
+  char tmpfile[] = "/tmp/buniq-XXXXXX";
+  filter_plan_t plan;
+  size_t fsize = 0;
+  int rc = FAILED;
+  
+  /* Open input */
+  if (strcmp(filename, "-") == 0) {
+    fd = STDIN_FILENO;
+#ifdef F_SETPIPE_SZ
+    /* A bigger pipe lets the writer on the other side run further ahead */
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+        fcntl(fd, F_SETPIPE_SZ, PARALLEL_PIPE_SIZE) < 0 && config->debug > 0) {
+      fprintf(stderr, "WARN - Unable to raise pipe size: %s\n", strerror(errno));
+    }
+#endif
+  } else {
+    if (secure_validate_path(filename) != 0) {
+      fprintf(stderr, "ERR - Invalid or unsafe file path\n");
+      return FAILED;
+    }
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+      fprintf(stderr, "ERR - Unable to open file for reading\n");
+      return FAILED;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      fprintf(stderr, "ERR - Input must be a regular file\n");
+      close(fd);
+      return FAILED;
+    }
+    fsize = (size_t)st.st_size;
+    if (st.st_size > 0) {
+      map_size = (size_t)st.st_size;
+      map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        /* Fall back to reading the file like a stream */
+        map = NULL;
+        map_size = 0;
+      } else {
+        madvise(map, map_size, MADV_SEQUENTIAL);
+        mem_account(MEM_INPUT, (int64_t)map_size);
+      }
+    }
+  }
+  
+  /* Set up the same bloom filter the serial path would and run the pipeline */
+  plan_filter(filename, fsize, &plan);
+  if (config->count_duplicates) {
+    /* Exact counts need no filter */
+    rc = run_pipeline(fd, map, map_size, NULL, BLOOM_REGULAR, num_threads, pstats);
+  } else if (!plan.use_scaling) {
+    if (bloom_init_64(&bf, plan.entries, plan.error_rate) == 0) {
+      if (config->debug > 0) {
+        fprintf(stderr, "Using regular bloom filter with capacity %zu, error rate %.4f\n",
+                plan.entries, plan.error_rate);
+        bloom_print(&bf);
+      }
+      progress_filter(bf.bits, bf.hashes, plan.entries);
+      rc = run_pipeline(fd, map, map_size, &bf, BLOOM_REGULAR, num_threads, pstats);
+      bloom_free(&bf);
+    }
+  } else {
+    int tmpfd = mkstemp(tmpfile);
+    if (tmpfd != -1) {
+      close(tmpfd);
+      if ((sbf = new_scaling_bloom(plan.capacity, plan.error_rate, tmpfile)) != NULL) {
+        if (config->debug > 0) {
+          fprintf(stderr, "Using scaling bloom filter with error rate %.4f (effective: %.4f)\n",
+                  config->eRate, plan.error_rate);
+        }
+        progress_filter(0, 0, plan.capacity);
+        rc = run_pipeline(fd, map, map_size, sbf, BLOOM_SCALING, num_threads, pstats);
+        free_scaling_bloom(sbf);
+      }
+      unlink(tmpfile);
+    }
+  }
+  
+  if (map != NULL) {
+    munmap(map, map_size);
+    mem_account(MEM_INPUT, -(int64_t)map_size);
+  }
+  if (fd != STDIN_FILENO) close(fd);
+  
+  return rc;
+}
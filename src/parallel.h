@@ -33,15 +33,121 @@
 #include <semaphore.h>
 #include "bloom-filter.h"
 #include "dablooms.h"
+#include "topology.h"
+#include "output.h"
+#include "count.h"
+#include "topk.h"
 
-/* Thread pool structure */
+/* Upper bound for -j */
+#define MAX_THREADS 1024
+
+/* Input is cut into blocks of whole lines of roughly this size */
+#define PARALLEL_BLOCK_SIZE (4 * 1024 * 1024)
+
+/* Pipe buffer size requested for stdin */
+#define PARALLEL_PIPE_SIZE (1024 * 1024)
+
+/* Blocks in flight per worker thread */
+#define PARALLEL_BLOCKS_PER_THREAD 4
+
+/* Concurrency controller sampling period */
+#define PARALLEL_EPOCH_NS (50 * 1000 * 1000ULL)
+
+/* Initial entries of the per-worker dedup table and per-block line arrays */
+#define PARALLEL_TABLE_SIZE (64 * 1024)
+
+/* Blocks resolved together per round in deterministic mode, per worker thread */
+#define PARALLEL_ROUND_PER_THREAD 2
+
+/* First occurrence of a key within a block, waiting for the shared filter */
 typedef struct {
+  uint64_t a;                /* Murmur hash halves, a also picks the filter partition */
+  uint64_t b;
+  size_t offset;             /* Offset of the line in the block */
+  uint32_t line;             /* Line index within the block */
+  uint32_t len;              /* Key length */
+} candidate_t;
+
+/* Per-worker scratch space for deduplicating a block locally */
+typedef struct {
+  candidate_t *cands;
+  size_t cands_size;
+  uint32_t *table;           /* Open addressing table of candidate index + 1 */
+  size_t table_size;         /* Power of two */
+} worker_scratch_t;
+
+/* Kinds of round task handed to the workers in deterministic mode */
+typedef enum {
+  ROUND_RESOLVE = 0,         /* Resolve one filter partition across the round */
+  ROUND_EMIT,                /* Copy one block's selected lines to its output */
+  ROUND_MERGE                /* Merge one partition of every worker's counts */
+} round_phase_t;
+
+/* Bytes a worker produced for one destination */
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+} block_out_t;
+
+/* Block of whole lines handed from the reader to a worker */
+typedef struct work_block_s {
+  uint64_t seq;              /* Position of the block in the input stream */
+  const char *data;          /* First byte of the block (in buf or the input mapping) */
+  size_t len;                /* Bytes in the block */
+  char *buf;                 /* Read buffer owned by the block, NULL until first read */
+  size_t buf_size;
+  
+  /* Output produced by the worker for this block */
+  block_out_t out;           /* Lines for stdout */
+  block_out_t split[2];      /* Unique and repeated lines for --unique-out and --dup-out */
+  uint64_t lines;
+  uint64_t emitted;
+  int done;
+  
+  /* Deterministic mode: per-line verdicts and first occurrences by filter partition */
+  uint8_t *verdict;          /* 1 if the line is a repeat */
+  size_t verdict_size;
+  candidate_t *cands;
+  size_t cands_size;
+  uint32_t part_start[BLOOM_PARTITIONS + 1];
+  uint64_t first_line;       /* Input line number of the block's first line */
+  
+  struct work_block_s *next; /* Free list link */
+} work_block_t;
+
+struct thread_pool_s;
+
+/* Per-worker thread state */
+typedef struct {
+  struct thread_pool_s *pool;
+  int id;                    /* Workers with id >= active_hashers are parked */
+  count_table_t counts;      /* Occurrences seen by this worker with -c */
+  topk_t top;                /* Heavy hitters seen by this worker with --top */
+  worker_scratch_t scratch;  /* Local dedup space for deterministic mode */
+} worker_ctx_t;
+
+/* Concurrency controller state, owned by the writer */
+typedef struct {
+  uint64_t epoch_start;      /* Monotonic ns at the start of the epoch */
+  uint64_t hasher_idle_ns;   /* Counters at the start of the epoch */
+  uint64_t reader_stall_ns;
+  uint64_t writer_stall_ns;
+  uint64_t filter_wait_ns;
+  uint64_t fill_sum;
+  uint64_t fill_samples;
+  pipeline_stats_t *stats;
+} controller_t;
+
+/* Thread pool structure */
+typedef struct thread_pool_s {
   pthread_t *threads;
+  worker_ctx_t *workers;
   int num_threads;
   int shutdown;
   
-  /* Work queue */
-  char **work_queue;
+  /* Work queue of filled blocks */
+  work_block_t **work_queue;
   int queue_size;
   int queue_front;
   int queue_rear;
@@ -52,38 +158,85 @@ typedef struct {
   pthread_cond_t queue_not_empty;
   pthread_cond_t queue_not_full;
   
-  /* Results */
-  char **results;
-  int *result_counts;
-  int result_size;
-  int result_count;
+  /* Block pool and in-order completion, both under result_mutex */
+  work_block_t *blocks;
+  int num_blocks;
+  work_block_t *free_blocks;
+  work_block_t **pending;    /* Blocks in flight indexed by seq % num_blocks */
+  uint64_t blocks_submitted;
+  int reader_done;
+  int reader_failed;
+  uint64_t latency_ns;       /* Cut stream blocks after this wait, 0 to fill them */
   pthread_mutex_t result_mutex;
+  pthread_cond_t result_ready;
+  pthread_cond_t block_free;
   
   /* Bloom filter reference */
   void *bloom_filter;
   bloom_type_t bloom_type;
+  pthread_mutex_t filter_mutex; /* Serializes the scaling filter */
+  uint64_t filter_id;
+  int filter_failed;
+  
+  /* Lines routed to files, indexed by repeat, and counts for --count-out */
+  int routed[2];
+  int tally;
+  
+  /* Input already written, where the next block starts */
+  uint64_t written_lines;
+  uint64_t written_bytes;
+  
+  /* Count mode: per-worker tables merged by partition at the end */
+  int counting;
+  count_table_t merged;
+  
+  /* Deterministic mode: round tasks under queue_mutex, completions under result_mutex */
+  int two_phase;
+  work_block_t **round;
+  int round_count;
+  round_phase_t round_phase;
+  int round_next;
+  int round_tasks;
+  int round_done;
+  
+  /* Stage stalls: hasher idle time and queue fill under queue_mutex, the rest under result_mutex */
+  int active_hashers;
+  uint64_t hasher_idle_ns;
+  uint64_t fill_sum;
+  uint64_t fill_samples;
+  uint64_t reader_stall_ns;
+  uint64_t writer_stall_ns;
+  uint64_t filter_wait_ns;   /* Atomic, time hashers queued on filter_mutex */
+  controller_t ctl;
+  
+  /* CPU placement for the worker threads */
+  thread_placement_t *placement;
+  
+  /* Input source: a mapped regular file or a stream read in blocks */
+  int input_fd;
+  const char *map;
+  size_t map_size;
+  size_t block_size;
+  pthread_t reader;
   
 } thread_pool_t;
 
-/* Work item structure */
-typedef struct {
-  char *line;
-  int line_len;
-  int line_num;
-  int is_duplicate;
-  int count;
-} work_item_t;
-
 /* Function prototypes */
-thread_pool_t *create_thread_pool(int num_threads, int queue_size);
+thread_pool_t *create_thread_pool(int num_threads, int num_blocks, thread_placement_t *placement);
 void destroy_thread_pool(thread_pool_t *pool);
-int submit_work(thread_pool_t *pool, const char *line, int line_len, int line_num);
-int get_result(thread_pool_t *pool, work_item_t *item);
+work_block_t *acquire_block(thread_pool_t *pool);
+void release_block(thread_pool_t *pool, work_block_t *block);
+int submit_block(thread_pool_t *pool, work_block_t *block);
+work_block_t *next_result(thread_pool_t *pool, uint64_t seq);
 void set_bloom_filter(thread_pool_t *pool, void *bloom_filter, bloom_type_t type);
+void process_block(worker_ctx_t *ctx, work_block_t *block);
+void count_block(worker_ctx_t *ctx, work_block_t *block);
+void scan_block(worker_ctx_t *ctx, work_block_t *block);
+void run_round_task(thread_pool_t *pool, int task);
 void *worker_thread(void *arg);
+void *reader_thread(void *arg);
 
 /* Parallel processing functions */
-int process_file_parallel(const char *filename, int num_threads);
-int process_chunk_parallel(FILE *file, off_t start, off_t end, int thread_id);
+int process_file_parallel(const char *filename, int num_threads, pipeline_stats_t *pstats);
 
 #endif /* PARALLEL_DOT_H */
\ No newline at end of file
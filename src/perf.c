@@ -0,0 +1,241 @@
+/*****
+ *
+ * Description: Hardware Performance Counter Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * Each processing thread opens one perf_event_open() group for itself
+ * and adds its counts to process wide totals when it finishes. Events
+ * the kernel or a container refuses are skipped, and when none can be
+ * opened the reason is kept for --stats instead of failing the run.
+ *
+ ****/
+
+#include "perf.h"
+#include <pthread.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+# include <linux/perf_event.h>
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+#endif
+
+PRIVATE int perf_on = FALSE;
+PRIVATE pthread_mutex_t totals_mutex = PTHREAD_MUTEX_INITIALIZER;
+PRIVATE perf_stats_t totals;
+PRIVATE double enabled_ns, running_ns;
+
+PRIVATE const char *event_names[PERF_EVENTS] = {
+  "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"
+};
+
+/****
+ *
+ * Turn counting on for the threads started from now on
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void perf_enable(void) {
+  perf_on = TRUE;
+  totals.enabled = TRUE;
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+/****
+ *
+ * Fill in the attributes of one event
+ *
+ ****/
+PRIVATE void event_attr(perf_event_t event, struct perf_event_attr *attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->type = PERF_TYPE_HARDWARE;
+  switch (event) {
+    case PERF_CYCLES:
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PERF_INSTRUCTIONS:
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PERF_LLC_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case PERF_DTLB_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case PERF_BRANCH_MISSES:
+    default:
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+  }
+  /* User space only, so the default perf_event_paranoid of 2 still allows it */
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+#endif
+
+/****
+ *
+ * Start counting in the calling thread
+ *
+ * The first event that opens leads the group, the rest join it so all
+ * of them are scheduled on the PMU together.
+ *
+ * Arguments:
+ *   group - Counter group of the calling thread
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void perf_thread_begin(perf_group_t *group) {
+  group->leader = -1;
+  group->opened = 0;
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    group->fd[i] = -1;
+  }
+  if (!perf_on) return;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    struct perf_event_attr attr;
+    int fd;
+
+    event_attr((perf_event_t)i, &attr);
+    attr.disabled = (group->leader == -1);
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group->leader, 0);
+    if (fd < 0) {
+      pthread_mutex_lock(&totals_mutex);
+      if (totals.reason[0] == '\0') {
+        const char *hint = "";
+        if (errno == EACCES || errno == EPERM) {
+          hint = ", see /proc/sys/kernel/perf_event_paranoid";
+        } else if (errno == ENOENT || errno == EOPNOTSUPP || errno == ENODEV) {
+          hint = ", no PMU exposed to this system";
+        }
+        snprintf(totals.reason, sizeof(totals.reason), "%s%s", strerror(errno), hint);
+      }
+      pthread_mutex_unlock(&totals_mutex);
+      continue;
+    }
+    if (group->leader == -1) group->leader = fd;
+    group->fd[i] = fd;
+    group->order[group->opened++] = i;
+  }
+  if (group->leader != -1) {
+    ioctl(group->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#else
+  snprintf(totals.reason, sizeof(totals.reason), "perf_event_open() is not supported on this system");
+#endif
+}
+
+/****
+ *
+ * Stop counting in the calling thread and add its counts to the totals
+ *
+ * Arguments:
+ *   group - Counter group started with perf_thread_begin()
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void perf_thread_end(perf_group_t *group) {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  uint64_t data[3 + PERF_EVENTS];
+
+  if (group->leader == -1) return;
+  ioctl(group->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  /* Group read: count, time enabled, time running, then one value per event */
+  if (read(group->leader, data, sizeof(data)) >= (ssize_t)(3 * sizeof(uint64_t)) && data[0] == (uint64_t)group->opened) {
+    pthread_mutex_lock(&totals_mutex);
+    for (int i = 0; i < group->opened; i++) {
+      totals.value[group->order[i]] += data[3 + i];
+      totals.available[group->order[i]] = TRUE;
+    }
+    enabled_ns += (double)data[1];
+    running_ns += (double)data[2];
+    totals.threads++;
+    pthread_mutex_unlock(&totals_mutex);
+  }
+
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    if (group->fd[i] >= 0) close(group->fd[i]);
+    group->fd[i] = -1;
+  }
+  group->leader = -1;
+#else
+  (void)group;
+#endif
+}
+
+/****
+ *
+ * Copy the totals of every thread that finished counting
+ *
+ * Counts are scaled up when the kernel had to multiplex the group with
+ * other users of the PMU, as perf stat does.
+ *
+ * Arguments:
+ *   stats - Set to the totals
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void perf_snapshot(perf_stats_t *stats) {
+  pthread_mutex_lock(&totals_mutex);
+  *stats = totals;
+  stats->running = (enabled_ns > 0) ? running_ns / enabled_ns : 0.0;
+  if (stats->running > 0 && stats->running < 1.0) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+      stats->value[i] = (uint64_t)((double)stats->value[i] / stats->running);
+    }
+  }
+  pthread_mutex_unlock(&totals_mutex);
+}
+
+/****
+ *
+ * Short name of an event for reports
+ *
+ * Arguments:
+ *   event - Event to name
+ *
+ * Returns:
+ *   Static name string
+ *
+ ****/
+const char *perf_event_name(perf_event_t event) {
+  return event_names[event];
+}
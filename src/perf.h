@@ -0,0 +1,68 @@
+/*****
+ *
+ * Description: Hardware Performance Counter Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef PERF_DOT_H
+#define PERF_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* Hardware events counted with --perf-counters */
+typedef enum {
+  PERF_CYCLES = 0,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,           /* Last level cache read misses */
+  PERF_DTLB_MISSES,          /* Data TLB read misses */
+  PERF_BRANCH_MISSES,
+  PERF_EVENTS
+} perf_event_t;
+
+/* Counter group of one thread */
+typedef struct {
+  int fd[PERF_EVENTS];       /* -1 for events that could not be opened */
+  int leader;                /* Group leader fd, -1 when nothing is counting */
+  int order[PERF_EVENTS];    /* Event of each value in a group read */
+  int opened;
+} perf_group_t;
+
+/* Totals over every counted thread */
+typedef struct {
+  int enabled;               /* --perf-counters was given */
+  int threads;               /* Threads whose counters were read */
+  uint64_t value[PERF_EVENTS];
+  int available[PERF_EVENTS]; /* Event counted in at least one thread */
+  double running;            /* Fraction of the time the events were on the PMU */
+  char reason[128];          /* Why nothing could be counted */
+} perf_stats_t;
+
+/* Function prototypes */
+void perf_enable(void);
+void perf_thread_begin(perf_group_t *group);
+void perf_thread_end(perf_group_t *group);
+void perf_snapshot(perf_stats_t *stats);
+const char *perf_event_name(perf_event_t event);
+
+#endif /* PERF_DOT_H */
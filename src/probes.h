@@ -0,0 +1,62 @@
+/*****
+ *
+ * Description: Static Tracing Probes
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef PROBES_DOT_H
+#define PROBES_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+/****
+ *
+ * USDT probes of the buniq provider, for bpftrace and perf on a
+ * running process without a rebuild. Each probe is a single nop until
+ * a tracer attaches, and its arguments are values already at hand, so
+ * the hot paths pay nothing for them. Without <sys/sdt.h> the probes
+ * compile away entirely.
+ *
+ * Double underscores in a probe name read as dashes to the tracers,
+ * usdt:/usr/bin/buniq:buniq:bloom__hit is listed as bloom-hit.
+ *
+ ****/
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define USDT0(name) DTRACE_PROBE(buniq, name)
+# define USDT1(name, a) DTRACE_PROBE1(buniq, name, a)
+# define USDT2(name, a, b) DTRACE_PROBE2(buniq, name, a, b)
+# define USDT3(name, a, b, c) DTRACE_PROBE3(buniq, name, a, b, c)
+#else
+# define USDT0(name) do { } while (0)
+# define USDT1(name, a) do { } while (0)
+# define USDT2(name, a, b) do { } while (0)
+# define USDT3(name, a, b, c) do { } while (0)
+#endif
+
+/* Filter verdict of one line, result as returned by the check and add functions */
+#define USDT_VERDICT(result, line, len) do { \
+    if ((result) == 1) USDT2(bloom__hit, (const char *)(line), (size_t)(len)); \
+    else if ((result) == 0) USDT2(bloom__miss, (const char *)(line), (size_t)(len)); \
+  } while (0)
+
+#endif /* PROBES_DOT_H */
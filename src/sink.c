@@ -0,0 +1,263 @@
+/*****
+ *
+ * Description: Asynchronous Buffered Output Sink Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "sink.h"
+#include "mem.h"
+#include "security.h"
+#include "probes.h"
+
+/****
+ *
+ * Write a whole buffer, retrying short writes
+ *
+ ****/
+PRIVATE int write_all(int fd, const char *data, size_t len) {
+  USDT2(output__flush, fd, len);
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return FAILED;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return TRUE;
+}
+
+/****
+ *
+ * Writer thread, writes filled buffers in order until the sink closes
+ *
+ ****/
+PRIVATE void *sink_thread(void *arg) {
+  sink_t *sink = (sink_t *)arg;
+  
+  pthread_mutex_lock(&sink->mutex);
+  for (;;) {
+    int i = sink->drain;
+    
+    while (!sink->full[i] && !sink->closing) {
+      pthread_cond_wait(&sink->ready, &sink->mutex);
+    }
+    if (!sink->full[i]) break;
+    pthread_mutex_unlock(&sink->mutex);
+    
+    if (write_all(sink->fd, sink->buf[i], sink->len[i]) != TRUE) {
+      pthread_mutex_lock(&sink->mutex);
+      if (!sink->failed) {
+        fprintf(stderr, "ERR - Unable to write to %s: %s\n", sink->path, strerror(errno));
+      }
+      sink->failed = TRUE;
+      pthread_mutex_unlock(&sink->mutex);
+    }
+    
+    pthread_mutex_lock(&sink->mutex);
+    sink->len[i] = 0;
+    sink->full[i] = FALSE;
+    sink->drain = (i + 1) % SINK_BUFFERS;
+    pthread_cond_broadcast(&sink->done);
+  }
+  pthread_mutex_unlock(&sink->mutex);
+  
+  return NULL;
+}
+
+/****
+ *
+ * Create or truncate an output file and start its writer
+ *
+ * Arguments:
+ *   path - File to write
+ *
+ * Returns:
+ *   New sink, or NULL on error
+ *
+ ****/
+sink_t *sink_open(const char *path) {
+  sink_t *sink;
+  int fd;
+  
+  if (secure_validate_path(path) != 0) {
+    fprintf(stderr, "ERR - Invalid or unsafe output path: %s\n", path);
+    return NULL;
+  }
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0) {
+    fprintf(stderr, "ERR - Unable to open %s for writing: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  
+  sink = (sink_t *)XMALLOC(sizeof(sink_t));
+  sink->fd = fd;
+  sink->path = strdup(path);
+  for (int i = 0; i < SINK_BUFFERS; i++) {
+    sink->buf[i] = (char *)XMALLOC(SINK_BUFFER_SIZE);
+  }
+  mem_account(MEM_BUFFERS, SINK_BUFFERS * SINK_BUFFER_SIZE);
+  pthread_mutex_init(&sink->mutex, NULL);
+  pthread_cond_init(&sink->ready, NULL);
+  pthread_cond_init(&sink->done, NULL);
+  if (pthread_create(&sink->writer, NULL, sink_thread, sink) != 0) {
+    fprintf(stderr, "ERR - Unable to start writer for %s\n", path);
+    sink->closing = TRUE;
+    sink_close(sink);
+    return NULL;
+  }
+  
+  return sink;
+}
+
+/****
+ *
+ * Hand the current buffer to the writer and move to the next one
+ *
+ * The caller holds the sink mutex.
+ *
+ ****/
+PRIVATE void sink_flush(sink_t *sink) {
+  int next = (sink->fill + 1) % SINK_BUFFERS;
+  
+  sink->full[sink->fill] = TRUE;
+  pthread_cond_signal(&sink->ready);
+  while (sink->full[next]) {
+    pthread_cond_wait(&sink->done, &sink->mutex);
+  }
+  sink->fill = next;
+}
+
+/****
+ *
+ * Append bytes to a sink
+ *
+ * Only the producer touches the buffer being filled, so appending takes
+ * no lock unless sink_timed() let another thread drain the sink. The
+ * caller blocks only when every other buffer is still waiting to be
+ * written.
+ *
+ * Arguments:
+ *   sink - Sink to write to, owned by a single producer thread
+ *   data - Bytes to write
+ *   len - Number of bytes
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void sink_write(sink_t *sink, const char *data, size_t len) {
+  if (sink->timed) pthread_mutex_lock(&sink->mutex);
+  while (len > 0) {
+    size_t room = SINK_BUFFER_SIZE - sink->len[sink->fill];
+    size_t n = (len < room) ? len : room;
+    
+    memcpy(sink->buf[sink->fill] + sink->len[sink->fill], data, n);
+    sink->len[sink->fill] += n;
+    data += n;
+    len -= n;
+    if (sink->len[sink->fill] == SINK_BUFFER_SIZE) {
+      if (!sink->timed) pthread_mutex_lock(&sink->mutex);
+      sink_flush(sink);
+      if (!sink->timed) pthread_mutex_unlock(&sink->mutex);
+    }
+  }
+  if (sink->timed) pthread_mutex_unlock(&sink->mutex);
+}
+
+/****
+ *
+ * Let sink_drain() be called from a thread other than the producer
+ *
+ * Must be called before the producer first writes. Appends then take
+ * the sink mutex, uncontended except while a drain runs.
+ *
+ * Arguments:
+ *   sink - Sink to share
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void sink_timed(sink_t *sink) {
+  sink->timed = TRUE;
+}
+
+/****
+ *
+ * Hand a partly filled buffer to the writer
+ *
+ * Arguments:
+ *   sink - Sink passed to sink_timed()
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void sink_drain(sink_t *sink) {
+  pthread_mutex_lock(&sink->mutex);
+  if (!sink->full[sink->fill] && sink->len[sink->fill] > 0) {
+    sink_flush(sink);
+  }
+  pthread_mutex_unlock(&sink->mutex);
+}
+
+/****
+ *
+ * Write out what is buffered, stop the writer and close the file
+ *
+ * Arguments:
+ *   sink - Sink to close, freed on return
+ *
+ * Returns:
+ *   TRUE if everything was written, FAILED otherwise
+ *
+ ****/
+int sink_close(sink_t *sink) {
+  int rc;
+  
+  if (!sink->closing) {
+    pthread_mutex_lock(&sink->mutex);
+    if (sink->len[sink->fill] > 0) {
+      sink_flush(sink);
+    }
+    sink->closing = TRUE;
+    pthread_cond_signal(&sink->ready);
+    pthread_mutex_unlock(&sink->mutex);
+    pthread_join(sink->writer, NULL);
+  }
+  
+  rc = sink->failed ? FAILED : TRUE;
+  if (close(sink->fd) != 0) {
+    fprintf(stderr, "ERR - Unable to close %s: %s\n", sink->path, strerror(errno));
+    rc = FAILED;
+  }
+  
+  pthread_mutex_destroy(&sink->mutex);
+  pthread_cond_destroy(&sink->ready);
+  pthread_cond_destroy(&sink->done);
+  for (int i = 0; i < SINK_BUFFERS; i++) {
+    XFREE(sink->buf[i]);
+  }
+  mem_account(MEM_BUFFERS, -(int64_t)(SINK_BUFFERS * SINK_BUFFER_SIZE));
+  free(sink->path);
+  XFREE(sink);
+  
+  return rc;
+}
@@ -0,0 +1,65 @@
+/*****
+ *
+ * Description: Asynchronous Buffered Output Sink Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef SINK_DOT_H
+#define SINK_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+#include <pthread.h>
+
+/* Buffers per sink, one is filled while the others are written */
+#define SINK_BUFFERS 4
+
+/* Bytes per sink buffer */
+#define SINK_BUFFER_SIZE (1024 * 1024)
+
+/* Output file with its own writer thread */
+typedef struct {
+  int fd;
+  char *path;
+  char *buf[SINK_BUFFERS];
+  size_t len[SINK_BUFFERS];
+  int full[SINK_BUFFERS];    /* Handed to the writer, under mutex */
+  int fill;                  /* Buffer the producer appends to */
+  int drain;                 /* Next buffer the writer writes, writer only */
+  int closing;
+  int failed;                /* A write failed, under mutex */
+  int timed;                 /* Appends lock, sink_drain() may run */
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;      /* A buffer was filled or the sink is closing */
+  pthread_cond_t done;       /* A buffer was written */
+  pthread_t writer;
+} sink_t;
+
+/* Function prototypes */
+sink_t *sink_open(const char *path);
+void sink_write(sink_t *sink, const char *data, size_t len);
+void sink_timed(sink_t *sink);
+void sink_drain(sink_t *sink);
+int sink_close(sink_t *sink);
+
+#endif /* SINK_DOT_H */
@@ -0,0 +1,219 @@
+/*****
+ *
+ * Description: Pipeline Stage Timing Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#include "stage.h"
+#include "trace.h"
+
+/* Set once before processing starts, read by every thread */
+int stage_on = FALSE;
+
+PRIVATE stage_stats_t timings;
+PRIVATE uint64_t clock_cost;      /* Cost of one stage_clock() call, taken off each lap */
+PRIVATE const char *stage_names[STAGES] = {
+  "read", "scan", "tally", "hash", "probe", "emit", "write", "wait"
+};
+
+/****
+ *
+ * Turn stage timing on for this run
+ *
+ * Measures the cheapest back to back clock read first, so sampled
+ * laps of a few nanoseconds are not dominated by the timer itself.
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void stage_enable(void) {
+  clock_cost = UINT64_MAX;
+  for (int i = 0; i < 64; i++) {
+    uint64_t start = stage_clock();
+    uint64_t cost = stage_clock() - start;
+    if (cost < clock_cost) clock_cost = cost;
+  }
+  stage_on = TRUE;
+}
+
+/****
+ *
+ * Monotonic clock in nanoseconds
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   Current time in nanoseconds
+ *
+ ****/
+uint64_t stage_clock(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/****
+ *
+ * Add one timing to a stage
+ *
+ * Line level stages are sampled, so their time is weighted by the
+ * sample rate to stay comparable with block level stages.
+ *
+ ****/
+PRIVATE void record(stage_t stage, uint64_t ns, uint64_t weight) {
+  int bucket = 0;
+
+  while (bucket < STAGE_BUCKETS - 1 && ns >= (1ULL << bucket)) {
+    bucket++;
+  }
+  __atomic_fetch_add(&timings.samples[stage], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&timings.total_ns[stage], ns * weight, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&timings.hist[stage][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/****
+ *
+ * Charge a sampled line's time since start to a stage
+ *
+ * Arguments:
+ *   stage - Stage the time was spent in
+ *   start - Clock value when the stage began
+ *
+ * Returns:
+ *   Current clock value, where the next stage begins
+ *
+ ****/
+uint64_t stage_lap(stage_t stage, uint64_t start) {
+  uint64_t now = stage_clock();
+  uint64_t ns = now - start;
+
+  record(stage, (ns > clock_cost) ? ns - clock_cost : 0, STAGE_SAMPLE);
+  if (trace_on) trace_span(stage_names[stage], "line", start, now);
+  return now;
+}
+
+/****
+ *
+ * Charge a block level stage's time since start
+ *
+ * Arguments:
+ *   stage - Stage the time was spent in
+ *   start - Value of STAGE_MARK() when it began, 0 when timing is off
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void stage_done(stage_t stage, uint64_t start) {
+  uint64_t now;
+
+  if (start == 0) return;
+  now = stage_clock();
+  record(stage, now - start, 1);
+  if (trace_on) trace_span(stage_names[stage], "block", start, now);
+}
+
+/****
+ *
+ * Charge a wait on another thread, named for the trace
+ *
+ * Arguments:
+ *   what - What the thread waited for, a static string
+ *   start - Clock value when the wait began, 0 when timing is off
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void stage_wait(const char *what, uint64_t start) {
+  uint64_t now;
+
+  if (start == 0) return;
+  now = stage_clock();
+  record(STAGE_WAIT, now - start, 1);
+  if (trace_on) trace_span(what, "wait", start, now);
+}
+
+/****
+ *
+ * Copy the timings gathered so far
+ *
+ * Arguments:
+ *   stats - Set to the current timings
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void stage_snapshot(stage_stats_t *stats) {
+  for (int s = 0; s < STAGES; s++) {
+    stats->samples[s] = __atomic_load_n(&timings.samples[s], __ATOMIC_RELAXED);
+    stats->total_ns[s] = __atomic_load_n(&timings.total_ns[s], __ATOMIC_RELAXED);
+    for (int b = 0; b < STAGE_BUCKETS; b++) {
+      stats->hist[s][b] = __atomic_load_n(&timings.hist[s][b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/****
+ *
+ * Latency below which a fraction of a stage's timings fall
+ *
+ * Arguments:
+ *   stats - Timings to inspect
+ *   stage - Stage to inspect
+ *   q - Fraction, 0.5 for the median
+ *
+ * Returns:
+ *   Upper bound of the bucket holding that quantile in ns, 0 without timings
+ *
+ ****/
+uint64_t stage_percentile(const stage_stats_t *stats, stage_t stage, double q) {
+  uint64_t want = (uint64_t)(q * (double)stats->samples[stage]);
+  uint64_t seen = 0;
+
+  if (stats->samples[stage] == 0) return 0;
+  for (int b = 0; b < STAGE_BUCKETS; b++) {
+    seen += stats->hist[stage][b];
+    if (seen > want) return 1ULL << b;
+  }
+
+  return 1ULL << (STAGE_BUCKETS - 1);
+}
+
+/****
+ *
+ * Short name of a stage for reports
+ *
+ * Arguments:
+ *   stage - Stage to name
+ *
+ * Returns:
+ *   Static name string
+ *
+ ****/
+const char *stage_name(stage_t stage) {
+  return stage_names[stage];
+}
@@ -0,0 +1,80 @@
+/*****
+ *
+ * Description: Pipeline Stage Timing Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef STAGE_DOT_H
+#define STAGE_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* One line in this many is timed, a power of two */
+#define STAGE_SAMPLE 64
+
+/* Histogram buckets, bucket i holds times below 2^i ns */
+#define STAGE_BUCKETS 40
+
+/* Work a line or block goes through */
+typedef enum {
+  STAGE_READ = 0,            /* Reading input */
+  STAGE_SCAN,                /* Finding line ends, in-block dedup of -R */
+  STAGE_TALLY,               /* Count tables and --top summaries */
+  STAGE_HASH,                /* MurmurHash3 of the line */
+  STAGE_PROBE,               /* Filter check and add */
+  STAGE_EMIT,                /* Formatting selected lines into block output */
+  STAGE_WRITE,               /* Handing output to stdio or the sinks */
+  STAGE_WAIT,                /* Threads waiting on each other */
+  STAGES
+} stage_t;
+
+/* Snapshot of the stage timings */
+typedef struct {
+  uint64_t samples[STAGES];
+  uint64_t total_ns[STAGES]; /* Estimated time, sampled lines scaled up */
+  uint64_t hist[STAGES][STAGE_BUCKETS];
+} stage_stats_t;
+
+extern int stage_on;
+
+/* Start timing a line when n is a sampled line number, 0 otherwise */
+#define STAGE_BEGIN(n) ((stage_on && ((n) & (STAGE_SAMPLE - 1)) == 0) ? stage_clock() : 0)
+
+/* Charge the time since lap to stage and restart the lap, for sampled lines */
+#define STAGE_LAP(stage, lap) do { if ((lap) != 0) (lap) = stage_lap((stage), (lap)); } while (0)
+
+/* Start timing a block level stage, 0 when timing is off */
+#define STAGE_MARK() (stage_on ? stage_clock() : 0)
+
+/* Function prototypes */
+void stage_enable(void);
+uint64_t stage_clock(void);
+uint64_t stage_lap(stage_t stage, uint64_t start);
+void stage_done(stage_t stage, uint64_t start);
+void stage_wait(const char *what, uint64_t start);
+void stage_snapshot(stage_stats_t *stats);
+uint64_t stage_percentile(const stage_stats_t *stats, stage_t stage, double q);
+const char *stage_name(stage_t stage);
+
+#endif /* STAGE_DOT_H */
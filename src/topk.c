@@ -0,0 +1,447 @@
+/*****
+ *
+ * Description: Streaming Top-K Heavy Hitter Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * Space-Saving (Metwally, Agrawal, El Abbadi) keeps a fixed number of
+ * counters. A line that is not monitored takes over the counter with
+ * the smallest count and inherits that count as its error, so every
+ * count is an overestimate by at most error <= N / capacity and every
+ * line occurring more than N / capacity times is monitored.
+ *
+ ****/
+
+#include "topk.h"
+#include "murmur.h"
+#include "mem.h"
+
+/* Seed for the key hash, independent of the bloom filter */
+#define TOPK_HASH_SEED 0x5bd1e995
+
+/* Smallest key slot, slots double so a counter moves a few times at most */
+#define TOPK_KEY_MIN 16
+
+/* Arena chunk for key slots */
+#define TOPK_KEY_CHUNK (64 * 1024)
+
+/****
+ *
+ * Initialize an empty summary
+ *
+ * Arguments:
+ *   top - Summary to initialize
+ *   k - Number of heavy hitters wanted
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topk_init(topk_t *top, int k) {
+  memset(top, 0, sizeof(topk_t));
+  top->k = k;
+  top->capacity = (k < TOPK_MIN_COUNTERS / TOPK_COUNTERS_PER_K) ? TOPK_MIN_COUNTERS : k * TOPK_COUNTERS_PER_K;
+  top->counters = (topk_counter_t *)XMALLOC(top->capacity * sizeof(topk_counter_t));
+  top->heap = (int *)XMALLOC(top->capacity * sizeof(int));
+  top->index_size = 1;
+  while (top->index_size < (size_t)top->capacity * 2) {
+    top->index_size <<= 1;
+  }
+  top->index = (int *)XMALLOC(top->index_size * sizeof(int));
+  mem_account(MEM_TOPK, (int64_t)(top->capacity * (sizeof(topk_counter_t) + sizeof(int)) + top->index_size * sizeof(int)));
+  mem_arena_init(&top->keys, TOPK_KEY_CHUNK, MEM_TOPK);
+}
+
+/****
+ *
+ * Release a summary
+ *
+ * Arguments:
+ *   top - Summary to free
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topk_free(topk_t *top) {
+  if (top->counters != NULL) {
+    XFREE(top->counters);
+    mem_account(MEM_TOPK, -(int64_t)(top->capacity * (sizeof(topk_counter_t) + sizeof(int)) + top->index_size * sizeof(int)));
+  }
+  if (top->heap != NULL) XFREE(top->heap);
+  if (top->index != NULL) XFREE(top->index);
+  mem_arena_free(&top->keys);
+  memset(top, 0, sizeof(topk_t));
+}
+
+/****
+ *
+ * Heap helpers, ordered by count
+ *
+ ****/
+PRIVATE void heap_swap(topk_t *top, int i, int j) {
+  int tmp = top->heap[i];
+
+  top->heap[i] = top->heap[j];
+  top->heap[j] = tmp;
+  top->counters[top->heap[i]].heap_pos = i;
+  top->counters[top->heap[j]].heap_pos = j;
+}
+
+PRIVATE void heap_up(topk_t *top, int pos) {
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (top->counters[top->heap[parent]].count <= top->counters[top->heap[pos]].count) break;
+    heap_swap(top, pos, parent);
+    pos = parent;
+  }
+}
+
+PRIVATE void heap_down(topk_t *top, int pos) {
+  for (;;) {
+    int left = pos * 2 + 1;
+    int smallest = pos;
+
+    if (left < top->used && top->counters[top->heap[left]].count < top->counters[top->heap[smallest]].count) {
+      smallest = left;
+    }
+    if (left + 1 < top->used && top->counters[top->heap[left + 1]].count < top->counters[top->heap[smallest]].count) {
+      smallest = left + 1;
+    }
+    if (smallest == pos) break;
+    heap_swap(top, pos, smallest);
+    pos = smallest;
+  }
+}
+
+/****
+ *
+ * Find the index slot of a key, or the empty slot where it belongs
+ *
+ ****/
+PRIVATE size_t index_find(const topk_t *top, uint64_t b, const char *key, uint32_t len) {
+  size_t mask = top->index_size - 1;
+  size_t slot = b & mask;
+
+  while (top->index[slot] != 0) {
+    const topk_counter_t *c = &top->counters[top->index[slot] - 1];
+    if (c->b == b && c->len == len && memcmp(c->key, key, len) == 0) break;
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+/****
+ *
+ * Remove a slot from the index, shifting later entries of its run back
+ *
+ ****/
+PRIVATE void index_remove(topk_t *top, size_t slot) {
+  size_t mask = top->index_size - 1;
+  size_t next = (slot + 1) & mask;
+
+  top->index[slot] = 0;
+  while (top->index[next] != 0) {
+    size_t home = top->counters[top->index[next] - 1].b & mask;
+    /* Move the entry back if its home is not between the hole and it */
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      top->index[slot] = top->index[next];
+      top->index[next] = 0;
+      slot = next;
+    }
+    next = (next + 1) & mask;
+  }
+}
+
+/****
+ *
+ * Point a counter at a new key
+ *
+ * Replacing a key reuses the counter's slot when it fits. A longer key
+ * takes a new slot of the next power of two from the arena, and the
+ * old slot is left behind. This keeps the takeovers of a long stream
+ * free of malloc() and free(), and at most half the slots are wasted.
+ *
+ ****/
+PRIVATE void set_key(mem_arena_t *keys, topk_counter_t *c, uint64_t b, const char *key, uint32_t len) {
+  if (c->key == NULL || c->key_size < len) {
+    uint32_t size = TOPK_KEY_MIN;
+    while (size < len) {
+      size <<= 1;
+    }
+    c->key = mem_arena_alloc(keys, size);
+    c->key_size = size;
+  }
+  if (len > 0) memcpy(c->key, key, len);
+  c->len = len;
+  c->b = b;
+}
+
+/****
+ *
+ * Record one occurrence of a line
+ *
+ * Arguments:
+ *   top - Summary to update
+ *   line - Line without its newline
+ *   len - Length of the line
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topk_add(topk_t *top, const char *line, uint32_t len) {
+  uint64_t hash[2];
+  size_t slot;
+  int idx;
+
+  MurmurHash3_x64_128(line, len, TOPK_HASH_SEED, hash);
+  top->total++;
+  slot = index_find(top, hash[1], line, len);
+
+  if (top->index[slot] != 0) {
+    idx = top->index[slot] - 1;
+    top->counters[idx].count++;
+    heap_down(top, top->counters[idx].heap_pos);
+    return;
+  }
+
+  if (top->used < top->capacity) {
+    /* Free counter */
+    idx = top->used++;
+    set_key(&top->keys, &top->counters[idx], hash[1], line, len);
+    top->counters[idx].count = 1;
+    top->counters[idx].error = 0;
+    top->counters[idx].heap_pos = idx;
+    top->heap[idx] = idx;
+    top->index[slot] = idx + 1;
+    heap_up(top, idx);
+    return;
+  }
+
+  /* Take over the smallest counter, its count becomes our error */
+  idx = top->heap[0];
+  index_remove(top, index_find(top, top->counters[idx].b, top->counters[idx].key, top->counters[idx].len));
+  set_key(&top->keys, &top->counters[idx], hash[1], line, len);
+  top->counters[idx].error = top->counters[idx].count;
+  top->counters[idx].count++;
+  top->index[index_find(top, hash[1], line, len)] = idx + 1;
+  heap_down(top, 0);
+}
+
+/****
+ *
+ * Record one occurrence of a line that may still end in its newline
+ *
+ * Arguments:
+ *   top - Summary to update
+ *   line - Line as read, newline optional
+ *   len - Length including any newline
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topk_add_line(topk_t *top, const char *line, size_t len) {
+  if (len > 0 && line[len - 1] == '\n') len--;
+  topk_add(top, line, (uint32_t)len);
+}
+
+/****
+ *
+ * Smallest count of a full summary, what an unmonitored line may have had
+ *
+ ****/
+PRIVATE uint64_t min_count(const topk_t *top) {
+  return (top->used == top->capacity && top->used > 0) ? top->counters[top->heap[0]].count : 0;
+}
+
+/****
+ *
+ * Order counters by count, largest first
+ *
+ * Ties go to the smaller error, then to the line bytes, so the report
+ * does not depend on where each line landed in the counter array.
+ *
+ ****/
+PRIVATE int compare_count(const void *x, const void *y) {
+  const topk_counter_t *cx = *(const topk_counter_t * const *)x;
+  const topk_counter_t *cy = *(const topk_counter_t * const *)y;
+  int diff;
+
+  if (cx->count != cy->count) return (cx->count < cy->count) - (cx->count > cy->count);
+  if (cx->error != cy->error) return (cx->error > cy->error) - (cx->error < cy->error);
+  if ((diff = memcmp(cx->key, cy->key, (cx->len < cy->len) ? cx->len : cy->len)) != 0) return diff;
+  return (cx->len > cy->len) - (cx->len < cy->len);
+}
+
+/****
+ *
+ * Merge another summary into this one
+ *
+ * Follows the mergeable summaries construction (Agarwal et al.): a line
+ * missing from one side is charged that side's smallest count, both as
+ * count and as error, then the largest counters are kept. The result
+ * still overestimates by at most (N1 + N2) / capacity.
+ *
+ * Arguments:
+ *   dst - Summary receiving the merge, same k as src
+ *   src - Summary to merge
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topk_merge(topk_t *dst, const topk_t *src) {
+  uint64_t dst_min = min_count(dst);
+  uint64_t src_min = min_count(src);
+  int n = dst->used + src->used;
+  topk_counter_t *all = (topk_counter_t *)XMALLOC((n > 0 ? n : 1) * sizeof(topk_counter_t));
+  const topk_counter_t **order = (const topk_counter_t **)XMALLOC((n > 0 ? n : 1) * sizeof(topk_counter_t *));
+  topk_counter_t *old = dst->counters;
+  mem_arena_t old_keys = dst->keys;
+  int m = 0;
+
+  /* Combine: lines in dst, with their src count or src's minimum */
+  for (int i = 0; i < dst->used; i++) {
+    const topk_counter_t *c = &dst->counters[i];
+    size_t slot = index_find(src, c->b, c->key, c->len);
+    all[m] = *c;
+    all[m].key_size = 0;
+    if (src->index[slot] != 0) {
+      all[m].count += src->counters[src->index[slot] - 1].count;
+      all[m].error += src->counters[src->index[slot] - 1].error;
+    } else {
+      all[m].count += src_min;
+      all[m].error += src_min;
+    }
+    m++;
+  }
+  /* Lines only in src, charged dst's minimum */
+  for (int i = 0; i < src->used; i++) {
+    const topk_counter_t *c = &src->counters[i];
+    if (dst->index[index_find(dst, c->b, c->key, c->len)] != 0) continue;
+    all[m] = *c;
+    all[m].count += dst_min;
+    all[m].error += dst_min;
+    m++;
+  }
+
+  for (int i = 0; i < m; i++) {
+    order[i] = &all[i];
+  }
+  qsort(order, m, sizeof(topk_counter_t *), compare_count);
+
+  /* Rebuild dst from the largest counters, with keys in a fresh arena */
+  dst->counters = (topk_counter_t *)XMALLOC(dst->capacity * sizeof(topk_counter_t));
+  mem_arena_init(&dst->keys, TOPK_KEY_CHUNK, MEM_TOPK);
+  memset(dst->index, 0, dst->index_size * sizeof(int));
+  dst->used = 0;
+  for (int i = 0; i < m && dst->used < dst->capacity; i++) {
+    const topk_counter_t *from = order[i];
+    int idx = dst->used++;
+    topk_counter_t *c = &dst->counters[idx];
+
+    /* Keys still point into the old dst or into src, copy them */
+    set_key(&dst->keys, c, from->b, from->key, from->len);
+    c->count = from->count;
+    c->error = from->error;
+    c->heap_pos = idx;
+    dst->heap[idx] = idx;
+    dst->index[index_find(dst, c->b, c->key, c->len)] = idx + 1;
+  }
+  for (int i = dst->used / 2 - 1; i >= 0; i--) {
+    heap_down(dst, i);
+  }
+  dst->total += src->total;
+
+  mem_arena_free(&old_keys);
+  XFREE(old);
+  XFREE(order);
+  XFREE(all);
+}
+
+/****
+ *
+ * Counters ordered from the most frequent down
+ *
+ * Arguments:
+ *   top - Summary to read
+ *   out - Set to an array the caller frees with XFREE
+ *
+ * Returns:
+ *   Number of counters in the array
+ *
+ ****/
+int topk_sorted(const topk_t *top, const topk_counter_t ***out) {
+  const topk_counter_t **order = (const topk_counter_t **)XMALLOC((top->used > 0 ? top->used : 1) * sizeof(topk_counter_t *));
+
+  for (int i = 0; i < top->used; i++) {
+    order[i] = &top->counters[i];
+  }
+  qsort(order, top->used, sizeof(topk_counter_t *), compare_count);
+  *out = order;
+
+  return top->used;
+}
+
+/****
+ *
+ * How many of the leading results are certainly among the k most frequent
+ *
+ * A result is certain when even its lowest possible count beats the
+ * largest possible count of the first line outside the top k.
+ *
+ * Arguments:
+ *   sorted - Counters from topk_sorted()
+ *   n - Number of counters
+ *   k - Results wanted
+ *
+ * Returns:
+ *   Length of the guaranteed prefix
+ *
+ ****/
+int topk_guaranteed(const topk_counter_t **sorted, int n, int k) {
+  uint64_t outside = (n > k) ? sorted[k]->count : 0;
+  int certain = 0;
+
+  while (certain < k && certain < n && sorted[certain]->count - sorted[certain]->error >= outside) {
+    certain++;
+  }
+
+  return certain;
+}
+
+/****
+ *
+ * Largest overestimate any reported count can carry
+ *
+ * Arguments:
+ *   top - Summary to read
+ *
+ * Returns:
+ *   The Space-Saving bound N / capacity, rounded down
+ *
+ ****/
+uint64_t topk_error_bound(const topk_t *top) {
+  return top->total / top->capacity;
+}
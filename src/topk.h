@@ -0,0 +1,77 @@
+/*****
+ *
+ * Description: Streaming Top-K Heavy Hitter Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef TOPK_DOT_H
+#define TOPK_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+#include "mem.h"
+
+/* Upper bound for --top */
+#define TOPK_MAX 1000000
+
+/* Counters kept per requested result, more counters tighten the error bound */
+#define TOPK_COUNTERS_PER_K 4
+
+/* Fewest counters kept, small K still gets a useful error bound */
+#define TOPK_MIN_COUNTERS 1024
+
+/* Monitored line of a Space-Saving summary */
+typedef struct {
+  uint64_t b;                /* Hash of the key, picks the index slot */
+  uint64_t count;            /* Overestimate of the occurrences */
+  uint64_t error;            /* Most the count can overestimate by */
+  char *key;                 /* Line without its newline */
+  uint32_t len;
+  uint32_t key_size;         /* Bytes of key's arena slot, a power of two */
+  int heap_pos;
+} topk_counter_t;
+
+/* Space-Saving summary with a hash index and a min-heap on count */
+typedef struct {
+  int k;                     /* Results wanted */
+  int capacity;              /* Counters monitored */
+  int used;
+  topk_counter_t *counters;
+  int *heap;                 /* Counter indexes, smallest count first */
+  int *index;                /* Open addressing table of counter index + 1 */
+  size_t index_size;         /* Power of two */
+  uint64_t total;            /* Lines seen, the N of the N/capacity bound */
+  mem_arena_t keys;          /* Key bytes of the counters */
+} topk_t;
+
+/* Function prototypes */
+void topk_init(topk_t *top, int k);
+void topk_free(topk_t *top);
+void topk_add(topk_t *top, const char *line, uint32_t len);
+void topk_add_line(topk_t *top, const char *line, size_t len);
+void topk_merge(topk_t *dst, const topk_t *src);
+int topk_sorted(const topk_t *top, const topk_counter_t ***out);
+int topk_guaranteed(const topk_counter_t **sorted, int n, int k);
+uint64_t topk_error_bound(const topk_t *top);
+
+#endif /* TOPK_DOT_H */
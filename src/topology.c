@@ -0,0 +1,500 @@
+/*****
+ *
+ * Description: CPU Topology and Thread Placement Implementation
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/* sched_getaffinity() and pthread_setaffinity_np() need this before any system header */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <sched.h>
+
+#include "topology.h"
+#include "main.h"
+
+extern Config_t *config;
+
+/****
+ *
+ * Read a single integer from a sysfs/cgroupfs file
+ *
+ * Arguments:
+ *   path - File to read
+ *   value - Where to store the parsed value
+ *
+ * Returns:
+ *   TRUE on success, FALSE if the file is missing or unparsable
+ *
+ ****/
+PRIVATE int read_int_file(const char *path, long *value) {
+  FILE *fp;
+  int rc;
+
+  if ((fp = fopen(path, "r")) == NULL) return FALSE;
+  rc = fscanf(fp, "%ld", value);
+  fclose(fp);
+
+  return (rc == 1) ? TRUE : FALSE;
+}
+
+/****
+ *
+ * Determine how many CPUs the cgroup CPU quota allows
+ *
+ * Looks up our cgroup from /proc/self/cgroup and reads cpu.max (cgroup v2)
+ * or cpu.cfs_quota_us/cpu.cfs_period_us (cgroup v1), falling back to the
+ * root of the cgroup mount which is what containers usually see.
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   Number of CPUs the quota allows (rounded up), 0 if unlimited or unknown
+ *
+ ****/
+PRIVATE int cgroup_quota_cpus(void) {
+  FILE *fp;
+  char line[PATH_MAX];
+  char v2_path[PATH_MAX] = "";
+  char v1_path[PATH_MAX] = "";
+  char path[PATH_MAX];
+  long quota = -1, period = 0;
+
+  if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      char *controllers = strchr(line, ':');
+      char *cg_path;
+      if (controllers == NULL) continue;
+      controllers++;
+      if ((cg_path = strchr(controllers, ':')) == NULL) continue;
+      *cg_path++ = '\0';
+      cg_path[strcspn(cg_path, "\n")] = '\0';
+      if (*controllers == '\0') {
+        snprintf(v2_path, sizeof(v2_path), "%s", cg_path);
+      } else if (strstr(controllers, "cpu") != NULL && strstr(controllers, "cpuset") == NULL) {
+        snprintf(v1_path, sizeof(v1_path), "%s", cg_path);
+      }
+    }
+    fclose(fp);
+  }
+
+  /* cgroup v2: "max 100000" or "<quota> <period>" */
+  const char *v2_candidates[] = { v2_path, "" };
+  for (int i = 0; i < 2 && quota < 0; i++) {
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", v2_candidates[i]);
+    if ((fp = fopen(path, "r")) != NULL) {
+      char qbuf[32];
+      if (fscanf(fp, "%31s %ld", qbuf, &period) == 2 && strcmp(qbuf, "max") != 0) {
+        quota = atol(qbuf);
+      } else {
+        quota = 0;
+      }
+      fclose(fp);
+    }
+  }
+
+  /* cgroup v1 */
+  const char *v1_mounts[] = { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" };
+  for (int i = 0; i < 2 && quota < 0; i++) {
+    const char *v1_candidates[] = { v1_path, "" };
+    for (int j = 0; j < 2 && quota < 0; j++) {
+      long q, p;
+      snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us", v1_mounts[i], v1_candidates[j]);
+      if (!read_int_file(path, &q)) continue;
+      snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us", v1_mounts[i], v1_candidates[j]);
+      if (!read_int_file(path, &p)) continue;
+      quota = (q > 0) ? q : 0;
+      period = p;
+    }
+  }
+
+  if (quota <= 0 || period <= 0) return 0;
+
+  return (int)((quota + period - 1) / period);
+}
+
+/****
+ *
+ * Order CPUs for placement
+ *
+ * Sorts first hardware threads of every physical core ahead of their SMT
+ * siblings, keeping cores of the same package together so neighbouring
+ * hashers share a last level cache.
+ *
+ ****/
+PRIVATE int cpu_info_cmp(const void *a, const void *b) {
+  const cpu_info_t *x = (const cpu_info_t *)a;
+  const cpu_info_t *y = (const cpu_info_t *)b;
+
+  if (x->smt_rank != y->smt_rank) return x->smt_rank - y->smt_rank;
+  if (x->package_id != y->package_id) return x->package_id - y->package_id;
+  if (x->core_id != y->core_id) return x->core_id - y->core_id;
+  return x->cpu - y->cpu;
+}
+
+/****
+ *
+ * Detect usable CPUs and their physical topology
+ *
+ * Reads the process affinity mask with sched_getaffinity(), the core and
+ * package ids for each CPU from sysfs, and the cgroup CPU quota. The
+ * resulting CPU list is ordered so that taking entries from the front
+ * spreads threads across physical cores before using SMT siblings.
+ *
+ * Arguments:
+ *   topo - Topology structure to fill in
+ *
+ * Returns:
+ *   TRUE on success, FAILED on error
+ *
+ ****/
+int topology_detect(cpu_topology_t *topo) {
+  XMEMSET(topo, 0, sizeof(cpu_topology_t));
+  topo->cpus = (cpu_info_t *)XMALLOC(TOPO_MAX_CPUS * sizeof(cpu_info_t));
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu < TOPO_MAX_CPUS; cpu++) {
+      char path[PATH_MAX];
+      long value;
+      cpu_info_t *info;
+
+      if (!CPU_ISSET(cpu, &set)) continue;
+
+      info = &topo->cpus[topo->num_cpus++];
+      info->cpu = cpu;
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+      info->core_id = read_int_file(path, &value) ? (int)value : cpu;
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+      info->package_id = read_int_file(path, &value) ? (int)value : 0;
+    }
+  }
+#endif
+
+  /* No affinity interface, assume every online CPU is its own core */
+  if (topo->num_cpus == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) online = 1;
+    if (online > TOPO_MAX_CPUS) online = TOPO_MAX_CPUS;
+    for (int cpu = 0; cpu < online; cpu++) {
+      topo->cpus[cpu].cpu = cpu;
+      topo->cpus[cpu].core_id = cpu;
+      topo->cpus[cpu].package_id = 0;
+    }
+    topo->num_cpus = (int)online;
+  }
+
+  /* Rank SMT siblings within each physical core (cpus are in ascending order here) */
+  for (int i = 0; i < topo->num_cpus; i++) {
+    topo->cpus[i].smt_rank = 0;
+    for (int j = 0; j < i; j++) {
+      if (topo->cpus[j].core_id == topo->cpus[i].core_id &&
+          topo->cpus[j].package_id == topo->cpus[i].package_id) {
+        topo->cpus[i].smt_rank++;
+      }
+    }
+    if (topo->cpus[i].smt_rank == 0) topo->num_cores++;
+  }
+
+  qsort(topo->cpus, topo->num_cpus, sizeof(cpu_info_t), cpu_info_cmp);
+
+  topo->quota_cpus = cgroup_quota_cpus();
+
+  return TRUE;
+}
+
+/****
+ *
+ * Release memory held by a topology structure
+ *
+ * Arguments:
+ *   topo - Topology structure filled in by topology_detect()
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topology_free(cpu_topology_t *topo) {
+  if (topo->cpus != NULL) {
+    XFREE(topo->cpus);
+    topo->cpus = NULL;
+  }
+  topo->num_cpus = 0;
+}
+
+/****
+ *
+ * Number of CPUs we can actually keep busy
+ *
+ * The affinity mask bounds where we may run and the cgroup quota bounds
+ * how much CPU time we get, whichever is smaller wins.
+ *
+ * Arguments:
+ *   topo - Detected topology
+ *
+ * Returns:
+ *   Usable CPU count, at least 1
+ *
+ ****/
+int topology_usable_cpus(const cpu_topology_t *topo) {
+  int usable = topo->num_cpus;
+
+  if (topo->quota_cpus > 0 && topo->quota_cpus < usable) {
+    usable = topo->quota_cpus;
+  }
+
+  return (usable < 1) ? 1 : usable;
+}
+
+/****
+ *
+ * Thread count used for -j auto
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   Number of usable CPUs for this process
+ *
+ ****/
+int topology_auto_threads(void) {
+  cpu_topology_t topo;
+  int usable;
+
+  topology_detect(&topo);
+  usable = topology_usable_cpus(&topo);
+  topology_free(&topo);
+
+  return usable;
+}
+
+/****
+ *
+ * Parse a CPU list such as "0,2,4-7" into an array
+ *
+ * Arguments:
+ *   list - CPU list string
+ *   cpus - Output array
+ *   max - Capacity of the output array
+ *
+ * Returns:
+ *   Number of CPUs parsed, FAILED on a malformed list
+ *
+ ****/
+PRIVATE int parse_cpu_list(const char *list, int *cpus, int max) {
+  const char *p = list;
+  int count = 0;
+
+  while (*p != '\0') {
+    char *end;
+    long first, last;
+
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0) return FAILED;
+    last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) return FAILED;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last && count < max; cpu++) {
+      cpus[count++] = (int)cpu;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return FAILED;
+    }
+  }
+
+  return (count > 0) ? count : FAILED;
+}
+
+/****
+ *
+ * Choose a CPU for every pipeline thread
+ *
+ * In automatic mode the reader and writer share the first physical core
+ * (on SMT siblings when available) since they mostly wait on I/O, and the
+ * hashers take the following physical cores, only doubling up on SMT
+ * siblings once every core has a hasher. An explicit CPU list is assigned
+ * in order reader, writer, hashers and reused round-robin when it is
+ * shorter than the thread count.
+ *
+ * Arguments:
+ *   topo - Detected topology
+ *   num_hashers - Number of hashing worker threads
+ *   mode - AFFINITY_AUTO, AFFINITY_NONE or AFFINITY_LIST
+ *   cpu_list - CPU list for AFFINITY_LIST
+ *   plan - Placement to fill in
+ *
+ * Returns:
+ *   TRUE on success, FAILED if the CPU list is malformed
+ *
+ ****/
+int topology_plan(const cpu_topology_t *topo, int num_hashers, affinity_mode_t mode, const char *cpu_list, thread_placement_t *plan) {
+  plan->num_hashers = num_hashers;
+  plan->hasher_cpus = (int *)XMALLOC(num_hashers * sizeof(int));
+  plan->reader_cpu = -1;
+  plan->writer_cpu = -1;
+  for (int i = 0; i < num_hashers; i++) {
+    plan->hasher_cpus[i] = -1;
+  }
+
+  if (mode == AFFINITY_NONE || topo->num_cpus == 0) {
+    return TRUE;
+  }
+
+  if (mode == AFFINITY_LIST) {
+    int cpus[TOPO_MAX_CPUS];
+    int count = parse_cpu_list(cpu_list, cpus, TOPO_MAX_CPUS);
+    if (count == FAILED) {
+      fprintf(stderr, "ERR - Invalid CPU list: %s\n", cpu_list);
+      return FAILED;
+    }
+    plan->reader_cpu = cpus[0];
+    plan->writer_cpu = cpus[1 % count];
+    for (int i = 0; i < num_hashers; i++) {
+      plan->hasher_cpus[i] = cpus[(i + 2) % count];
+    }
+    return TRUE;
+  }
+
+  /* AFFINITY_AUTO */
+  const cpu_info_t *first = &topo->cpus[0];
+  plan->reader_cpu = first->cpu;
+  plan->writer_cpu = first->cpu;
+  for (int i = topo->num_cores; i < topo->num_cpus; i++) {
+    if (topo->cpus[i].core_id == first->core_id && topo->cpus[i].package_id == first->package_id) {
+      plan->writer_cpu = topo->cpus[i].cpu;
+      break;
+    }
+  }
+
+  for (int i = 0; i < num_hashers; i++) {
+    int slot = (topo->num_cpus > 1) ? 1 + (i % (topo->num_cpus - 1)) : 0;
+    plan->hasher_cpus[i] = topo->cpus[slot].cpu;
+  }
+
+  return TRUE;
+}
+
+/****
+ *
+ * Release memory held by a placement plan
+ *
+ * Arguments:
+ *   plan - Placement filled in by topology_plan()
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topology_free_plan(thread_placement_t *plan) {
+  if (plan->hasher_cpus != NULL) {
+    XFREE(plan->hasher_cpus);
+    plan->hasher_cpus = NULL;
+  }
+}
+
+/****
+ *
+ * Describe a CPU for placement output
+ *
+ ****/
+PRIVATE void print_cpu(const cpu_topology_t *topo, const char *label, int index, int cpu) {
+  if (index >= 0) {
+    fprintf(stderr, "  %s[%d] -> ", label, index);
+  } else {
+    fprintf(stderr, "  %s -> ", label);
+  }
+
+  if (cpu < 0) {
+    fprintf(stderr, "unpinned\n");
+    return;
+  }
+
+  for (int i = 0; i < topo->num_cpus; i++) {
+    if (topo->cpus[i].cpu == cpu) {
+      fprintf(stderr, "cpu %d (package %d, core %d, smt %d)\n",
+              cpu, topo->cpus[i].package_id, topo->cpus[i].core_id, topo->cpus[i].smt_rank);
+      return;
+    }
+  }
+  fprintf(stderr, "cpu %d (not in affinity mask)\n", cpu);
+}
+
+/****
+ *
+ * Print the detected topology and chosen thread placement to stderr
+ *
+ * Arguments:
+ *   topo - Detected topology
+ *   plan - Chosen placement
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void topology_print_plan(const cpu_topology_t *topo, const thread_placement_t *plan) {
+  fprintf(stderr, "CPU topology: %d cpus in affinity mask, %d physical cores", topo->num_cpus, topo->num_cores);
+  if (topo->quota_cpus > 0) {
+    fprintf(stderr, ", cgroup quota %d cpus", topo->quota_cpus);
+  }
+  fprintf(stderr, "\nThread placement:\n");
+  print_cpu(topo, "reader", -1, plan->reader_cpu);
+  print_cpu(topo, "writer", -1, plan->writer_cpu);
+  for (int i = 0; i < plan->num_hashers; i++) {
+    print_cpu(topo, "hasher", i, plan->hasher_cpus[i]);
+  }
+}
+
+/****
+ *
+ * Pin a thread to a single CPU
+ *
+ * Arguments:
+ *   thread - Thread to pin
+ *   cpu - Logical CPU number, negative values leave the thread unpinned
+ *
+ * Returns:
+ *   TRUE on success, FAILED if pinning is unsupported or refused
+ *
+ ****/
+int topology_pin_thread(pthread_t thread, int cpu) {
+  if (cpu < 0) return TRUE;
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) {
+    return TRUE;
+  }
+#else
+  (void)thread;
+#endif
+
+  return FAILED;
+}
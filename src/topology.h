@@ -0,0 +1,71 @@
+/*****
+ *
+ * Description: CPU Topology and Thread Placement Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef TOPOLOGY_DOT_H
+#define TOPOLOGY_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+#include <pthread.h>
+
+/* Upper bound on logical CPUs we track */
+#define TOPO_MAX_CPUS 1024
+
+/* Logical CPU description */
+typedef struct {
+  int cpu;          /* Logical CPU number */
+  int core_id;      /* Physical core id within the package */
+  int package_id;   /* Physical package (socket) id */
+  int smt_rank;     /* 0 for the first hardware thread of a core, 1.. for siblings */
+} cpu_info_t;
+
+/* Usable CPUs ordered for placement: one thread per physical core first, then SMT siblings */
+typedef struct {
+  cpu_info_t *cpus;
+  int num_cpus;     /* Logical CPUs in our affinity mask */
+  int num_cores;    /* Distinct physical cores in our affinity mask */
+  int quota_cpus;   /* CPUs allowed by the cgroup CPU quota, 0 if unlimited */
+} cpu_topology_t;
+
+/* Chosen CPU per thread, -1 means the thread is not pinned */
+typedef struct {
+  int reader_cpu;
+  int writer_cpu;
+  int *hasher_cpus;
+  int num_hashers;
+} thread_placement_t;
+
+/* Function prototypes */
+int topology_detect(cpu_topology_t *topo);
+void topology_free(cpu_topology_t *topo);
+int topology_usable_cpus(const cpu_topology_t *topo);
+int topology_auto_threads(void);
+int topology_plan(const cpu_topology_t *topo, int num_hashers, affinity_mode_t mode, const char *cpu_list, thread_placement_t *plan);
+void topology_free_plan(thread_placement_t *plan);
+void topology_print_plan(const cpu_topology_t *topo, const thread_placement_t *plan);
+int topology_pin_thread(pthread_t thread, int cpu);
+
+#endif /* TOPOLOGY_DOT_H */
@@ -0,0 +1,231 @@
+/*****
+ *
+ * Description: Pipeline Trace Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * --trace keeps the spans the stage timings see, per thread, and
+ * writes them as Chrome trace event JSON when the run ends. Perfetto
+ * and chrome://tracing show each thread as its own track, so hashers
+ * parked on an empty queue or a reader throttled by the writer stand
+ * out where the --stats totals only show an average.
+ *
+ * Every thread appends to a buffer only it writes, registered once on
+ * a list pushed with compare and swap, so recording takes no lock.
+ * The buffers are read after every processing thread has been joined.
+ *
+ ****/
+
+#include "trace.h"
+#include "main.h"
+
+/* Set once before processing starts, read by every thread */
+int trace_on = FALSE;
+
+PRIVATE FILE *trace_file = NULL;
+PRIVATE char *trace_path = NULL;
+PRIVATE uint64_t trace_start;
+PRIVATE trace_buf_t *buffers = NULL;
+PRIVATE int next_tid = 0;
+PRIVATE __thread trace_buf_t *mine = NULL;
+
+/****
+ *
+ * Open the trace file and start recording
+ *
+ * The file is created up front so a bad path fails before any input
+ * is read.
+ *
+ * Arguments:
+ *   path - File the trace is written to at the end of the run
+ *
+ * Returns:
+ *   TRUE if recording started, FALSE on error
+ *
+ ****/
+int trace_open(const char *path) {
+  if ((trace_file = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "ERR - Unable to open trace file [%s]: %s\n", path, strerror(errno));
+    return FALSE;
+  }
+  trace_path = strdup(path);
+  /* Spans are timed with stage_clock(), so the origin must be too */
+  trace_start = stage_clock();
+  trace_on = TRUE;
+
+  return TRUE;
+}
+
+/****
+ *
+ * Give the calling thread a buffer and a name on the timeline
+ *
+ * Threads that record without calling this get a generic name.
+ *
+ * Arguments:
+ *   name - Track name, such as "reader" or "hasher 3"
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void trace_thread(const char *name) {
+  trace_buf_t *buf;
+
+  if (!trace_on) return;
+  if (mine == NULL) {
+    buf = (trace_buf_t *)XMALLOC(sizeof(trace_buf_t));
+    mem_account(MEM_TRACE, (int64_t)sizeof(trace_buf_t));
+    buf->tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    buf->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffers, &buf->next, buf, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    mine = buf;
+  }
+  if (name != NULL) {
+    snprintf(mine->name, sizeof(mine->name), "%s", name);
+  } else if (mine->name[0] == '\0') {
+    snprintf(mine->name, sizeof(mine->name), "thread %d", mine->tid);
+  }
+}
+
+/****
+ *
+ * Record one span in the calling thread's buffer
+ *
+ * Arguments:
+ *   name - What the time was spent on, a static string
+ *   cat - Kind of span, a static string
+ *   start - Clock value when it began
+ *   end - Clock value when it ended
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void trace_span(const char *name, const char *cat, uint64_t start, uint64_t end) {
+  trace_chunk_t *chunk;
+  trace_span_t *span;
+
+  if (mine == NULL) trace_thread(NULL);
+  if (mine->spans >= TRACE_MAX_SPANS) {
+    mine->dropped++;
+    return;
+  }
+  chunk = mine->tail;
+  if (chunk == NULL || chunk->used == TRACE_CHUNK_SPANS) {
+    chunk = (trace_chunk_t *)XMALLOC(sizeof(trace_chunk_t));
+    mem_account(MEM_TRACE, (int64_t)sizeof(trace_chunk_t));
+    if (mine->tail == NULL) {
+      mine->head = chunk;
+    } else {
+      mine->tail->next = chunk;
+    }
+    mine->tail = chunk;
+  }
+  span = &chunk->spans[chunk->used++];
+  span->start = start;
+  span->dur = (end > start) ? end - start : 0;
+  span->name = name;
+  span->cat = cat;
+  mine->spans++;
+}
+
+/****
+ *
+ * Microseconds since the trace started, the unit of trace events
+ *
+ ****/
+PRIVATE double trace_us(uint64_t ns) {
+  return (ns > trace_start) ? (double)(ns - trace_start) / 1000.0 : 0.0;
+}
+
+/****
+ *
+ * Write the recorded spans and release the buffers
+ *
+ * Must only be called once every thread that recorded has finished.
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   TRUE if the trace was written, FALSE on error
+ *
+ ****/
+int trace_close(void) {
+  trace_buf_t *buf = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+  int pid = (int)getpid();
+  uint64_t spans = 0, dropped = 0;
+  int ok = TRUE;
+
+  if (trace_file == NULL) return TRUE;
+  trace_on = FALSE;
+
+  fprintf(trace_file, "{\"traceEvents\":[\n");
+  fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+          pid, PROGNAME);
+  for (trace_buf_t *b = buf; b != NULL; b = b->next) {
+    fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            pid, b->tid, b->name);
+    fprintf(trace_file, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"sort_index\":%d}}",
+            pid, b->tid, b->tid);
+    for (trace_chunk_t *c = b->head; c != NULL; c = c->next) {
+      for (size_t i = 0; i < c->used; i++) {
+        const trace_span_t *s = &c->spans[i];
+        fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                s->name, s->cat, pid, b->tid, trace_us(s->start), (double)s->dur / 1000.0);
+      }
+    }
+    spans += b->spans;
+    dropped += b->dropped;
+  }
+  fprintf(trace_file, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"version\":\"%s\",\"spans\":%lu,\"dropped\":%lu}}\n",
+          VERSION, spans, dropped);
+
+  if (ferror(trace_file)) ok = FALSE;
+  if (fclose(trace_file) != 0) ok = FALSE;
+  trace_file = NULL;
+  if (!ok) {
+    fprintf(stderr, "ERR - Unable to write trace file [%s]: %s\n", trace_path, strerror(errno));
+  } else if (dropped > 0) {
+    fprintf(stderr, "WARN - Trace kept %d spans per thread, %lu later ones were dropped\n", TRACE_MAX_SPANS, dropped);
+  }
+
+  while (buf != NULL) {
+    trace_buf_t *next = buf->next;
+    while (buf->head != NULL) {
+      trace_chunk_t *chunk = buf->head->next;
+      XFREE(buf->head);
+      mem_account(MEM_TRACE, -(int64_t)sizeof(trace_chunk_t));
+      buf->head = chunk;
+    }
+    XFREE(buf);
+    mem_account(MEM_TRACE, -(int64_t)sizeof(trace_buf_t));
+    buf = next;
+  }
+  buffers = NULL;
+  mine = NULL;
+  free(trace_path);
+  trace_path = NULL;
+
+  return ok;
+}
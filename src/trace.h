@@ -0,0 +1,75 @@
+/*****
+ *
+ * Description: Pipeline Trace Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef TRACE_DOT_H
+#define TRACE_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* Spans kept per thread, later ones are dropped and counted */
+#define TRACE_MAX_SPANS (1 << 20)
+
+/* Spans per buffer chunk, a thread adds chunks as it fills them */
+#define TRACE_CHUNK_SPANS 8192
+
+/* Longest thread name shown in the timeline */
+#define TRACE_NAME_LEN 32
+
+/* One timed piece of work */
+typedef struct {
+  uint64_t start;            /* stage_clock() when it began, ns */
+  uint64_t dur;              /* ns */
+  const char *name;          /* Static string */
+  const char *cat;           /* "line", "block" or "wait" */
+} trace_span_t;
+
+typedef struct trace_chunk_s {
+  struct trace_chunk_s *next;
+  size_t used;
+  trace_span_t spans[TRACE_CHUNK_SPANS];
+} trace_chunk_t;
+
+/* Span buffer of one thread, only that thread writes to it */
+typedef struct trace_buf_s {
+  struct trace_buf_s *next;  /* Registered buffers, pushed without a lock */
+  int tid;
+  char name[TRACE_NAME_LEN];
+  trace_chunk_t *head;
+  trace_chunk_t *tail;
+  uint64_t spans;
+  uint64_t dropped;
+} trace_buf_t;
+
+extern int trace_on;
+
+/* Function prototypes */
+int trace_open(const char *path);
+void trace_thread(const char *name);
+void trace_span(const char *name, const char *cat, uint64_t start, uint64_t end);
+int trace_close(void);
+
+#endif /* TRACE_DOT_H */
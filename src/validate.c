@@ -0,0 +1,223 @@
+/*****
+ *
+ * Description: False Positive Validation Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+/****
+ *
+ * --validate runs the filter as usual and checks each of its verdicts
+ * against an exact set of 128 bit line fingerprints. A line the set
+ * has never seen but the filter calls a repeat is a false positive.
+ *
+ * Huge inputs are sampled by fingerprint: when the set outgrows
+ * VALIDATE_MAX_KEYS only lines whose fingerprint has one more low bit
+ * clear are kept. Every copy of a line falls on the same side of that
+ * test, so the lines still checked are checked exactly.
+ *
+ ****/
+
+#include "validate.h"
+#include "main.h"
+
+/* One fingerprint, a of 0 marks an empty slot */
+typedef struct {
+  uint64_t a;
+  uint64_t b;
+} validate_key_t;
+
+PRIVATE validate_key_t *keys = NULL;
+PRIVATE size_t key_slots = 0;
+PRIVATE size_t key_count = 0;
+PRIVATE validate_stats_t result;
+
+/****
+ *
+ * Insert a fingerprint, returns TRUE when it was already present
+ *
+ ****/
+PRIVATE int insert_key(uint64_t a, uint64_t b) {
+  size_t mask = key_slots - 1;
+  size_t slot = b & mask;
+
+  while (keys[slot].a != 0) {
+    if (keys[slot].a == a && keys[slot].b == b) return TRUE;
+    slot = (slot + 1) & mask;
+  }
+  keys[slot].a = a;
+  keys[slot].b = b;
+  key_count++;
+
+  return FALSE;
+}
+
+/****
+ *
+ * Rebuild the set with size slots, keeping the keys still sampled
+ *
+ ****/
+PRIVATE void rebuild_keys(size_t size) {
+  validate_key_t *old = keys;
+  size_t old_slots = key_slots;
+  uint64_t mask = ((uint64_t)1 << result.sample_shift) - 1;
+
+  keys = (validate_key_t *)mem_large_alloc(size * sizeof(validate_key_t));
+  mem_account(MEM_VALIDATE, (int64_t)((size - old_slots) * sizeof(validate_key_t)));
+  key_slots = size;
+  key_count = 0;
+  if (old == NULL) return;
+
+  for (size_t i = 0; i < old_slots; i++) {
+    if (old[i].a != 0 && (old[i].a & mask) == 0) {
+      insert_key(old[i].a, old[i].b);
+    }
+  }
+  mem_large_free(old, old_slots * sizeof(validate_key_t));
+}
+
+/****
+ *
+ * Count a sampled line in a generation or window
+ *
+ ****/
+PRIVATE void tally(validate_count_t *count, int fresh, int false_pos) {
+  count->fresh += fresh;
+  count->false_pos += false_pos;
+}
+
+/****
+ *
+ * Start validating a filter
+ *
+ * Arguments:
+ *   scaling - TRUE for the scaling filter
+ *   error_rate - Error rate the filter was built for
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void validate_begin(int scaling, double error_rate) {
+  memset(&result, 0, sizeof(result));
+  result.enabled = TRUE;
+  result.scaling = scaling;
+  result.configured = error_rate;
+  result.window_lines = VALIDATE_FIRST_WINDOW;
+  rebuild_keys(1 << 16);
+}
+
+/****
+ *
+ * Check one verdict of the filter
+ *
+ * Arguments:
+ *   line - Line exactly as the filter hashed it
+ *   len - Length of the line
+ *   verdict - 1 when the filter called it a repeat, 0 when new
+ *   line_no - Input line number, from 1
+ *   generation - Newest scaling sub-filter at the time, 0 for a regular filter
+ *   gen_rate - Error rate of that sub-filter
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void validate_line(const char *line, size_t len, int verdict, uint64_t line_no, int generation, double gen_rate) {
+  uint64_t hash[2];
+  uint64_t window;
+  int fresh, false_pos;
+
+  MurmurHash3_x64_128(line, len, VALIDATE_SEED, hash);
+  hash[0] |= (uint64_t)1 << 63;
+  if ((hash[0] & (((uint64_t)1 << result.sample_shift) - 1)) != 0) return;
+
+  fresh = !insert_key(hash[0], hash[1]);
+  false_pos = fresh && verdict == 1;
+  result.sampled++;
+  if (!fresh && verdict == 0) result.false_neg++;
+  tally(&result.total, fresh, false_pos);
+
+  /* Generations appear one at a time, each adds its rate to the bound */
+  if (generation >= VALIDATE_GENERATIONS) generation = VALIDATE_GENERATIONS - 1;
+  while (result.generations <= generation) {
+    double before = (result.generations > 0) ? result.gen_bound[result.generations - 1] : 0.0;
+    result.gen_bound[result.generations++] = before + gen_rate;
+  }
+  tally(&result.gen[generation], fresh, false_pos);
+
+  /* Halve the resolution of the time series when it is full */
+  window = (line_no - 1) / result.window_lines;
+  while (window >= VALIDATE_WINDOWS) {
+    for (int i = 0; i < VALIDATE_WINDOWS / 2; i++) {
+      result.window[i].fresh = result.window[2 * i].fresh + result.window[2 * i + 1].fresh;
+      result.window[i].false_pos = result.window[2 * i].false_pos + result.window[2 * i + 1].false_pos;
+    }
+    memset(&result.window[VALIDATE_WINDOWS / 2], 0, sizeof(validate_count_t) * (VALIDATE_WINDOWS / 2));
+    result.windows = VALIDATE_WINDOWS / 2;
+    result.window_lines *= 2;
+    window = (line_no - 1) / result.window_lines;
+  }
+  if ((int)window >= result.windows) result.windows = (int)window + 1;
+  tally(&result.window[window], fresh, false_pos);
+
+  /* Grow to VALIDATE_MAX_KEYS, then sample half as many lines */
+  if (key_count * 2 >= key_slots) {
+    if (key_count < VALIDATE_MAX_KEYS) {
+      rebuild_keys(key_slots * 2);
+    } else {
+      result.sample_shift++;
+      rebuild_keys(key_slots);
+    }
+  }
+}
+
+/****
+ *
+ * Release the exact set, the results stay for validate_snapshot()
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void validate_end(void) {
+  if (keys == NULL) return;
+  mem_account(MEM_VALIDATE, -(int64_t)(key_slots * sizeof(validate_key_t)));
+  mem_large_free(keys, key_slots * sizeof(validate_key_t));
+  keys = NULL;
+  key_slots = 0;
+  key_count = 0;
+}
+
+/****
+ *
+ * Copy the validation results
+ *
+ * Arguments:
+ *   stats - Set to the results, enabled is FALSE when nothing was checked
+ *
+ * Returns:
+ *   None
+ *
+ ****/
+void validate_snapshot(validate_stats_t *stats) {
+  *stats = result;
+}
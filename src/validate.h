@@ -0,0 +1,75 @@
+/*****
+ *
+ * Description: False Positive Validation Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+#ifndef VALIDATE_DOT_H
+#define VALIDATE_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* Distinct lines kept before the sample is halved, 16 bytes each at half load */
+#define VALIDATE_MAX_KEYS (1 << 21)
+
+/* Seed of the fingerprints, apart from BLOOM_HASH_SEED so they fail independently */
+#define VALIDATE_SEED 0x5bd1e995
+
+/* Scaling filter generations reported one by one, later ones share the last row */
+#define VALIDATE_GENERATIONS 32
+
+/* Windows of the over time report, merged in pairs when the input outgrows them */
+#define VALIDATE_WINDOWS 16
+#define VALIDATE_FIRST_WINDOW 1024
+
+/* Outcome of the sampled lines of one generation or window */
+typedef struct {
+  uint64_t fresh;            /* Sampled lines seen for the first time */
+  uint64_t false_pos;        /* Of those, lines the filter called repeats */
+} validate_count_t;
+
+/* Observed against configured false positive rates */
+typedef struct {
+  int enabled;               /* --validate was given and a filter was checked */
+  int scaling;               /* Engine was the scaling filter */
+  double configured;         /* Error rate the filter was built for */
+  int sample_shift;          /* One distinct line in 2^sample_shift was checked */
+  uint64_t sampled;          /* Lines checked against the exact set */
+  uint64_t false_neg;        /* Repeats the filter called new, always 0 for a bloom filter */
+  validate_count_t total;
+  int generations;
+  validate_count_t gen[VALIDATE_GENERATIONS];
+  double gen_bound[VALIDATE_GENERATIONS]; /* Sum of the error rates of the sub-filters so far */
+  uint64_t window_lines;     /* Input lines per window */
+  int windows;
+  validate_count_t window[VALIDATE_WINDOWS];
+} validate_stats_t;
+
+/* Function prototypes */
+void validate_begin(int scaling, double error_rate);
+void validate_line(const char *line, size_t len, int verdict, uint64_t line_no, int generation, double gen_rate);
+void validate_end(void);
+void validate_snapshot(validate_stats_t *stats);
+
+#endif /* VALIDATE_DOT_H */
@@ -0,0 +1,262 @@
+/*****
+ *
+ * Description: Zero-Copy Output Functions
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+
+/* copy_file_range() and splice() need this before any system header */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "zcopy.h"
+#include "main.h"
+#include "mem.h"
+
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+extern Config_t *config;
+
+PRIVATE const char *method_names[] = { "read/write", "sendfile", "splice", "copy_file_range" };
+
+/* Source file and the run of selected bytes not yet copied */
+PRIVATE int src_fd = -1;
+PRIVATE uint64_t src_size = 0;
+PRIVATE uint64_t run_start = 0;
+PRIVATE uint64_t run_end = 0;
+PRIVATE zcopy_method_t method = ZCOPY_READ;
+PRIVATE char *bounce = NULL;
+PRIVATE int failed = FALSE;
+PRIVATE uint64_t runs = 0;
+PRIVATE uint64_t copied = 0;
+
+/****
+ *
+ * Copy through a buffer when the kernel refuses every direct path
+ *
+ ****/
+PRIVATE ssize_t copy_read(uint64_t offset, size_t len) {
+  ssize_t n;
+  size_t done = 0;
+  
+  if (bounce == NULL) {
+    bounce = (char *)XMALLOC(ZCOPY_BUFFER_SIZE);
+    mem_account(MEM_BUFFERS, ZCOPY_BUFFER_SIZE);
+  }
+  if (len > ZCOPY_BUFFER_SIZE) len = ZCOPY_BUFFER_SIZE;
+  
+  n = pread(src_fd, bounce, len, (off_t)offset);
+  if (n <= 0) return n;
+  while (done < (size_t)n) {
+    ssize_t w = write(STDOUT_FILENO, bounce + done, (size_t)n - done);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += (size_t)w;
+  }
+  
+  return n;
+}
+
+/****
+ *
+ * Copy one range of the input to stdout with the best method that works
+ *
+ * A method the kernel rejects for this pair of files is dropped for the
+ * rest of the run, nothing has been written when that happens.
+ *
+ ****/
+PRIVATE int copy_run(uint64_t offset, uint64_t len) {
+  while (len > 0) {
+    size_t chunk = (len > ZCOPY_CHUNK) ? ZCOPY_CHUNK : (size_t)len;
+    ssize_t n;
+    
+    switch (method) {
+#ifdef HAVE_COPY_FILE_RANGE
+      case ZCOPY_RANGE: {
+        loff_t off = (loff_t)offset;
+        n = copy_file_range(src_fd, &off, STDOUT_FILENO, NULL, chunk, 0);
+        break;
+      }
+#endif
+#ifdef HAVE_SPLICE
+      case ZCOPY_SPLICE: {
+        loff_t off = (loff_t)offset;
+        n = splice(src_fd, &off, STDOUT_FILENO, NULL, chunk, SPLICE_F_MORE);
+        break;
+      }
+#endif
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+      case ZCOPY_SENDFILE: {
+        off_t off = (off_t)offset;
+        n = sendfile(STDOUT_FILENO, src_fd, &off, chunk);
+        break;
+      }
+#endif
+      default:
+        method = ZCOPY_READ;
+        n = copy_read(offset, chunk);
+        break;
+    }
+    
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (method != ZCOPY_READ &&
+          (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) {
+        if (config->debug >= 1) {
+          fprintf(stderr, "DEBUG - %s refused: %s\n", method_names[method], strerror(errno));
+        }
+        method = (method == ZCOPY_SENDFILE) ? ZCOPY_READ : ZCOPY_SENDFILE;
+        continue;
+      }
+      return FAILED;
+    }
+    
+    /* Input shrank underneath us */
+    if (n == 0) break;
+    offset += (uint64_t)n;
+    len -= (uint64_t)n;
+    copied += (uint64_t)n;
+  }
+  
+  return TRUE;
+}
+
+/****
+ *
+ * Copy the pending run, if any
+ *
+ ****/
+PRIVATE void flush_run(void) {
+  if (run_end > run_start && !failed) {
+    runs++;
+    if (copy_run(run_start, run_end - run_start) != TRUE) {
+      fprintf(stderr, "ERR - Unable to write output: %s\n", strerror(errno));
+      failed = TRUE;
+    }
+  }
+  run_start = run_end = 0;
+}
+
+/****
+ *
+ * Prepare to copy selected lines of a regular file straight to stdout
+ *
+ * Picks copy_file_range() when stdout is a regular file, splice() when
+ * it is a pipe and sendfile() otherwise. Anything already buffered for
+ * stdout is flushed first so output stays in order.
+ *
+ * Arguments:
+ *   path - Input file, already validated by the caller
+ *
+ * Returns:
+ *   TRUE on success, FAILED if the input cannot be opened
+ *
+ ****/
+int zcopy_open(const char *path) {
+  struct stat st;
+  
+  if ((src_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "ERR - Zero-copy output needs a regular input file\n");
+    if (src_fd >= 0) close(src_fd);
+    src_fd = -1;
+    return FAILED;
+  }
+  src_size = (uint64_t)st.st_size;
+  
+  method = ZCOPY_SENDFILE;
+  if (fstat(STDOUT_FILENO, &st) == 0) {
+    if (S_ISREG(st.st_mode)) {
+      method = ZCOPY_RANGE;
+    } else if (S_ISFIFO(st.st_mode)) {
+      method = ZCOPY_SPLICE;
+    }
+  }
+  fflush(stdout);
+  
+  return TRUE;
+}
+
+/****
+ *
+ * Queue a selected range of the input for stdout
+ *
+ * Ranges must arrive in input order. A range that starts where the
+ * previous one ended extends it, so runs of selected lines become one
+ * kernel copy.
+ *
+ * Arguments:
+ *   offset - Byte offset of the range in the input
+ *   len - Bytes to copy, clipped to the end of the input
+ *
+ * Returns:
+ *   None (void function)
+ *
+ ****/
+void zcopy_range(uint64_t offset, uint64_t len) {
+  if (src_fd < 0) return;
+  if (offset + len > src_size) len = (offset < src_size) ? src_size - offset : 0;
+  
+  if (offset != run_end || run_end == run_start) {
+    flush_run();
+    run_start = offset;
+  }
+  run_end = offset + len;
+}
+
+/****
+ *
+ * Copy the last run and release the input
+ *
+ * Arguments:
+ *   None
+ *
+ * Returns:
+ *   TRUE if every range was written, FAILED otherwise
+ *
+ ****/
+int zcopy_close(void) {
+  int ret;
+  
+  if (src_fd < 0) return FAILED;
+  flush_run();
+  close(src_fd);
+  src_fd = -1;
+  if (bounce != NULL) {
+    XFREE(bounce);
+    mem_account(MEM_BUFFERS, -(int64_t)ZCOPY_BUFFER_SIZE);
+    bounce = NULL;
+  }
+  
+  if (config->debug >= 1) {
+    fprintf(stderr, "DEBUG - Zero-copy wrote %lu bytes in %lu runs with %s\n",
+            (unsigned long)copied, (unsigned long)runs, method_names[method]);
+  }
+  ret = failed ? FAILED : TRUE;
+  failed = FALSE;
+  
+  return ret;
+}
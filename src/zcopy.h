@@ -0,0 +1,53 @@
+/*****
+ *
+ * Description: Zero-Copy Output Headers
+ *
+ * Copyright (c) 2025, Ron Dilley
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ****/
+
+
+#ifndef ZCOPY_DOT_H
+#define ZCOPY_DOT_H
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "../include/sysdep.h"
+#include "../include/common.h"
+
+/* Largest single kernel copy request */
+#define ZCOPY_CHUNK (1024 * 1024 * 1024)
+
+/* Bounce buffer for the read()/write() fallback */
+#define ZCOPY_BUFFER_SIZE (1024 * 1024)
+
+/* How byte ranges get from the input to stdout, best first */
+typedef enum {
+  ZCOPY_READ = 0,            /* pread() and write() through a buffer */
+  ZCOPY_SENDFILE,            /* sendfile() to anything the kernel accepts */
+  ZCOPY_SPLICE,              /* splice() into a pipe */
+  ZCOPY_RANGE                /* copy_file_range() into a regular file */
+} zcopy_method_t;
+
+/* Function prototypes */
+int zcopy_open(const char *path);
+void zcopy_range(uint64_t offset, uint64_t len);
+int zcopy_close(void);
+
+#endif /* ZCOPY_DOT_H */